@@ -12,18 +12,29 @@
 #include <linux/hdreg.h>
 #include <linux/proc_fs.h>
 #include <linux/sort.h>
+#include <linux/log2.h>
+#include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/math64.h>
 
 #include <asm/atomic.h>
 
-#include "ififo.h"
+#include "tfifo.h"
+#include "pcfifo.h"
+#include "qtree.h"
+#include "wagg.h"
 
-#define BLKSTAT_DEBUG 1
+/* #define BLKSTAT_DEBUG 1 */
 
 #define DEVNAME "blkstat"
 #define PROC_ENTRY "blkstat"
 
 #define NR_MINORS 1
 
+/* response times, in ns: in one FIFO or in one per CPU */
+DEFINE_TFIFO(rtfifo, u64)
+DEFINE_PCFIFO(rtpcfifo, rtfifo, u64)
+
 #define TDEV_MODE (FMODE_READ | FMODE_WRITE | FMODE_EXCL)
 #define KERNEL_SECTOR_SIZE 512  /* FIXME: */
 
@@ -37,45 +48,109 @@ module_param(LOGICAL_BLOCK_SIZE, int, S_IRUGO | S_IWUSR);
 
 static int nrsamples = DEF_SAMPLES;
 module_param(nrsamples, int, S_IRUGO | S_IWUSR);
+/*
+ * Keep the response times per CPU, nrsamples / CPUs on each, put without
+ * info_lock. No qtree or min/max/mean then: those are shared.
+ */
+static int rtimes_percpu = 0;
+module_param(rtimes_percpu, int, S_IRUGO);
+/* 
+ * Keep the quantiles of the window up to date in a qtree (within 1%),
+ * rather than sorting the samples on every read of /proc.
+ */
+static int rtimes_qtree = 1;
+module_param(rtimes_qtree, int, S_IRUGO);
 
 char targetname[256];
 module_param_string(target, targetname, sizeof(targetname), 0);
 
+/*
+ * target=null: no target device, bios are completed by blkstat itself,
+ * after null_latency_us. Measures what blkstat costs on its own.
+ */
+#define NULL_TARGET "null"
+static ulong null_sectors = 2097152;
+module_param(null_sectors, ulong, S_IRUGO);
+static int null_latency_us = 0;
+module_param(null_latency_us, int, S_IRUGO | S_IWUSR);
+
+/*
+ * Discards up to discard_merge_sectors long are held for up to
+ * discard_merge_us, and adjacent ones are sent down as one; 0 - off.
+ */
+static int discard_merge_us = 200;
+module_param(discard_merge_us, int, S_IRUGO | S_IWUSR);
+static int discard_merge_sectors = 256;
+module_param(discard_merge_sectors, int, S_IRUGO | S_IWUSR);
+
 /* placeholder for extra data assigned to bi_private of cloned bios */
 struct biostat {
     struct bio *bio;        /* original bio */
     unsigned long time;     /* timestamp of submission of cloned bio */
+    struct hrtimer timer;   /* null target: the simulated latency */
 };
 
+/* kinds of I/O accounted separately; READ and WRITE come first */
+#define OP_DISCARD      2
+#define OP_WRITE_SAME   3
+#define OP_FLUSH        4
+#define NR_OPS          5
+
+/* latency histogram: bucket b counts times in [2^b, 2^(b+1)) ns */
+#define NR_BUCKETS      40
+
 struct binfo {
-    unsigned long ios[2];
-    unsigned long duration[2];
+    unsigned long ios[NR_OPS];
+    unsigned long duration[NR_OPS];
+    unsigned long hist[NR_OPS][NR_BUCKETS];
     /* no explicit mean value - can be derived from the above */
+    /* min and max are of reads and writes only, as are the quantiles */
     unsigned long minrt;
     unsigned long maxrt;
 };
 
 /* our 'device' structure */
 struct blkstat {
-    /* target device */
+    /* target device, NULL for the null target */
     struct block_device *tdev;
+    int null_target;
+    /* for the pieces of bios split to fit the target's limits */
+    struct bio_set *bio_set;
 
     /* the boilerplate stuff: gendisk, queue */
     struct gendisk *gendisk;
     struct request_queue *queue;
     sector_t capacity;
 
-    /* the statistics: info + qdepth + rtimes -- protected by info_lock */
+    /* the statistics: info + qdepth + rtimes -- updated under info_lock, but rtimes_pcpu */
     struct binfo info;
     atomic_t qdepth;
-    /* a FIFO with response times (the capacity is nrsamples) */
-    struct ififo *rtimes;   
+    /* bios split before being passed on */
+    atomic_long_t splits;
+    /* discards merged, and the discards they were merged into */
+    atomic_long_t discards_merged;
+    atomic_long_t discards_issued;
+    /* a FIFO with response times (the capacity is nrsamples), read with no lock */
+    struct rtfifo *rtimes;
+    /* or this, with rtimes_percpu */
+    struct rtpcfifo *rtimes_pcpu;
+    /* the order statistics of rtimes, with rtimes_qtree (not with rtimes_percpu) */
+    struct qtree *rtq;
+    /* min/max/mean of rtimes; not with rtimes_percpu, as the shards drop out of order */
+    struct wagg *rtw;
 
     /* protects the info struct */
     spinlock_t info_lock;
     /* prevents concurrent access to procfs entry */
     struct mutex procfs_mutex;
 
+    /* small discards waiting to be merged -- protected by discard_lock */
+    spinlock_t discard_lock;
+    struct bio_list discards;
+    sector_t discard_start;
+    sector_t discard_end;
+    struct delayed_work discard_work;
+
     int ready;
 }; 
 
@@ -90,8 +165,16 @@ char *pnam[NR_QUANTILES] = {"10%", "20%", "30%", "40%", "50%", "60%", "70%", "80
 struct userinfo {
     struct binfo info;
     int qdepth;
-    int qtles[NR_QUANTILES];
+    long splits;
+    long discards_merged;
+    long discards_issued;
+    u64 qtles[NR_QUANTILES];
     int rtlen; 
+    /* samples pushed out of rtimes by newer ones */
+    unsigned long rtdropped;
+    /* of the samples in rtimes */
+    unsigned int wcount;
+    u64 wmin, wmax, wmean;
 };
 
 static struct blkstat blkstat = {
@@ -117,72 +200,229 @@ static void free_biostat(struct biostat *bs)
     kfree(bs);
 }
 
+static char *opnam[NR_OPS] = {"Read", "Write", "Discard", "Write same", "Flush"};
+
+static int bio_op_index(struct bio *bio)
+{
+    if (bio->bi_rw & REQ_DISCARD)
+        return OP_DISCARD;
+    if (bio->bi_rw & REQ_WRITE_SAME)
+        return OP_WRITE_SAME;
+    /* a flush with data is counted as the write it is */
+    if ((bio->bi_rw & REQ_FLUSH) && !bio->bi_iter.bi_size)
+        return OP_FLUSH;
+    return bio_data_dir(bio);
+}
+
+static int rtimes_alloc(void)
+{
+    int rc;
+
+    if (rtimes_qtree && !rtimes_percpu && (rc = qtree_alloc(&blkstat.rtq, GFP_KERNEL)))
+        goto out;
+    if (!rtimes_percpu && (rc = wagg_alloc(&blkstat.rtw, nrsamples, GFP_KERNEL)))
+        goto out;
+
+    if (rtimes_percpu)
+        rc = rtpcfifo_alloc(&blkstat.rtimes_pcpu, nrsamples, GFP_KERNEL);
+    else
+        rc = rtfifo_alloc(&blkstat.rtimes, nrsamples, GFP_KERNEL);
+    if (!rc)
+        return 0;
+
+out:
+    qtree_free(blkstat.rtq);
+    blkstat.rtq = NULL;
+    wagg_free(blkstat.rtw);
+    blkstat.rtw = NULL;
+    return rc;
+}
+
+static void rtimes_free(void)
+{
+    if (blkstat.rtimes_pcpu)
+        rtpcfifo_free(blkstat.rtimes_pcpu);
+    rtfifo_free(blkstat.rtimes);
+    qtree_free(blkstat.rtq);
+    wagg_free(blkstat.rtw);
+}
+
+/* the single FIFO -- with info_lock held, as the qtree and rtw go with it */
+static void rtimes_add(u64 rtime)
+{
+    u64 old;
+
+    /* the oldest sample makes room once the FIFO is full */
+    if (rtfifo_put_overwrite(blkstat.rtimes, rtime, &old)) {
+        if (blkstat.rtq)
+            qtree_remove(blkstat.rtq, old);
+        if (blkstat.rtw)
+            wagg_remove(blkstat.rtw, old);
+    }
+
+    if (blkstat.rtq)
+        qtree_add(blkstat.rtq, rtime);
+    if (blkstat.rtw)
+        wagg_add(blkstat.rtw, rtime);
+}
+
+static int rtimes_len(void)
+{
+    if (blkstat.rtimes_pcpu)
+        return rtpcfifo_len(blkstat.rtimes_pcpu);
+    return rtfifo_len(blkstat.rtimes);
+}
+
+static unsigned long rtimes_dropped(void)
+{
+    if (blkstat.rtimes_pcpu)
+        return rtpcfifo_dropped(blkstat.rtimes_pcpu);
+    return rtfifo_dropped(blkstat.rtimes);
+}
+
+/* the order doesn't matter to the quantiles: the CPUs one after another will do */
+static unsigned int rtimes_snapshot(u64 *buf, unsigned int max)
+{
+    if (blkstat.rtimes_pcpu)
+        return rtpcfifo_snapshot(blkstat.rtimes_pcpu, buf, max);
+    return rtfifo_snapshot(blkstat.rtimes, buf, max);
+}
+
 /* must be called with blkstat.info_lock held */
-void update_info(int rw, unsigned long rtime)
+void update_info(int op, unsigned long rtime)
 {
-    blkstat.info.ios[rw]++;
-    blkstat.info.duration[rw] += rtime;
+    blkstat.info.ios[op]++;
+    blkstat.info.duration[op] += rtime;
+    blkstat.info.hist[op][min_t(unsigned int, rtime ? ilog2(rtime) : 0, NR_BUCKETS - 1)]++;
+    atomic_dec(&blkstat.qdepth);
+
+    if (op != READ && op != WRITE)
+        return;
 
     if (blkstat.info.maxrt < rtime)
         blkstat.info.maxrt = rtime;
     if (blkstat.info.minrt > rtime)
         blkstat.info.minrt = rtime;
-    atomic_dec(&blkstat.qdepth);
     
-    if (ififo_is_full(blkstat.rtimes))
-        ififo_get(blkstat.rtimes, NULL);
-
-    ififo_put(blkstat.rtimes, rtime);
+    /* the per CPU shards are written by blkstat_complete(), without the lock */
+    if (!blkstat.rtimes_pcpu)
+        rtimes_add(rtime);
 }
 
-static void blkstat_endio(struct bio *cloned_bio, int error)
+/* account for the bio and complete it */
+static void blkstat_complete(struct biostat *bs, int op, int error)
 {
     unsigned long flags;
-
-    struct biostat *bs = cloned_bio->bi_private;
-    struct bio *bio = bs->bio;
-   
-    unsigned long now = ktime_to_ns(ktime_get());
-    unsigned long nselapsed = now - bs->time;
-
-    int uptodate = test_bit(BIO_UPTODATE, &cloned_bio->bi_flags);
-
-    pr_info("%s: endio -- elapsed: %lu -- size: %u -- up-to-date: %d-- error: %d -- IRQ: %lu -- INTR: %lu\n", 
-        DEVNAME, nselapsed, cloned_bio->bi_iter.bi_size, uptodate, error, in_irq(), in_interrupt());
+    unsigned long nselapsed = ktime_to_ns(ktime_get()) - bs->time;
 
     /*
      * It seems that we may get called both from a non-IRQ and IRQ context,
      * so use the irq-saving version, to be on the safe side.
      */
     spin_lock_irqsave(&blkstat.info_lock, flags);
-    update_info(bio_data_dir(cloned_bio) & REQ_WRITE, nselapsed);
+    update_info(op, nselapsed);
     spin_unlock_irqrestore(&blkstat.info_lock, flags);
 
-    bio_endio(bio, error);
-    free_biostat(bs);    
+    /* this CPU's shard only: IRQs off keeps another completion off it */
+    if (blkstat.rtimes_pcpu && (op == READ || op == WRITE)) {
+        local_irq_save(flags);
+        rtpcfifo_put_overwrite(blkstat.rtimes_pcpu, nselapsed, NULL);
+        local_irq_restore(flags);
+    }
+
+    bio_endio(bs->bio, error);
+    free_biostat(bs);
 }
 
-static void blkstat_make_request(struct request_queue *q, struct bio *bio) 
+static void blkstat_endio(struct bio *cloned_bio, int error)
 {
-    struct bio *cloned_bio;
+    struct biostat *bs = cloned_bio->bi_private;
 
-#ifdef BLKSTAT_DEBUG 
-    pr_info("blkstat: make request %-5s block %-12llu #pages %-4hu total-size "
-            "%-10u\n", bio_data_dir(bio) == WRITE ? "write" : "read",
-            (unsigned long long) bio->bi_iter.bi_sector, bio->bi_vcnt, bio->bi_iter.bi_size);
+#ifdef BLKSTAT_DEBUG
+    pr_info("%s: endio -- elapsed: %lu -- size: %u -- up-to-date: %d-- error: %d -- IRQ: %lu -- INTR: %lu\n", 
+        DEVNAME, (unsigned long) ktime_to_ns(ktime_get()) - bs->time, cloned_bio->bi_iter.bi_size,
+        test_bit(BIO_UPTODATE, &cloned_bio->bi_flags), error, in_irq(), in_interrupt());
 #endif
 
-    if (!blkstat.tdev)
-    {
-        pr_info("blkstat: Request before tdev is ready, aborting\n");
-        goto err_bio;
+    blkstat_complete(bs, bio_op_index(cloned_bio), error);
+    bio_put(cloned_bio);
+}
+
+static enum hrtimer_restart blkstat_null_timer(struct hrtimer *timer)
+{
+    struct biostat *bs = container_of(timer, struct biostat, timer);
+
+    blkstat_complete(bs, bio_op_index(bs->bio), 0);
+    return HRTIMER_NORESTART;
+}
+
+/* null target: the bio is done here, at once or when the timer goes off */
+static void blkstat_null(struct bio *bio)
+{
+    struct biostat *bs = alloc_biostat(bio);
+
+    if (!bs) {
+        bio_io_error(bio);
+        return;
     }
-    if (!blkstat.ready)
-    {
-        pr_info("blkstat: Device not active yet, aborting\n");
-        goto err_bio;
+
+    atomic_inc(&blkstat.qdepth);
+    if (null_latency_us <= 0) {
+        blkstat_complete(bs, bio_op_index(bio), 0);
+        return;
     }
 
+    hrtimer_init(&bs->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    bs->timer.function = blkstat_null_timer;
+    hrtimer_start(&bs->timer, ns_to_ktime((u64) null_latency_us * NSEC_PER_USEC),
+            HRTIMER_MODE_REL);
+}
+
+/*
+ * How many sectors from the start of bio the target takes in one piece:
+ * within max_sectors and max_segments, and not across a multiple of
+ * io_opt, so that e.g. a RAID target gets whole stripes rather than the
+ * tail of one and the head of the next.
+ */
+static unsigned int blkstat_split_sectors(struct bio *bio)
+{
+    struct request_queue *tq = bdev_get_queue(blkstat.tdev);
+    unsigned int lbs = queue_logical_block_size(tq) >> 9;
+    unsigned int opt = queue_io_opt(tq) >> 9;
+    unsigned int max = queue_max_sectors(tq);
+    unsigned int seg_size = queue_max_segment_size(tq);
+    unsigned int nsegs = 0, sectors = 0;
+    struct bvec_iter iter;
+    struct bio_vec bv;
+    sector_t offset;
+
+    if (opt) {
+        /* sector_div() leaves the quotient in offset, returns the remainder */
+        offset = bio->bi_iter.bi_sector;
+        max = min(max, opt - sector_div(offset, opt));
+    }
+
+    bio_for_each_segment(bv, bio, iter) {
+        nsegs += DIV_ROUND_UP(bv.bv_len, seg_size);
+        if (nsegs > queue_max_segments(tq))
+            break;
+        /* a size limit cuts through the bvec, a segment limit before it */
+        sectors += bv.bv_len >> 9;
+        if (sectors >= max) {
+            sectors = max;
+            break;
+        }
+    }
+
+    /* the pieces must stay whole logical blocks */
+    return max(sectors - sectors % lbs, lbs);
+}
+
+/* pass the bio on to the target */
+static void blkstat_remap(struct bio *bio)
+{
+    struct bio *cloned_bio;
+
     cloned_bio = bio_clone(bio, GFP_NOIO);
     if (!cloned_bio)
         goto err_bio; 
@@ -208,6 +448,176 @@ err_bio:
     return;
 }
 
+/* completes the discards a merged one was made of, chained through bi_next */
+static void blkstat_discard_endio(struct bio *bio, int error)
+{
+    struct bio *orig = bio->bi_private, *next;
+
+    for (; orig; orig = next) {
+        next = orig->bi_next;
+        orig->bi_next = NULL;
+        bio_endio(orig, error);
+    }
+    bio_put(bio);
+}
+
+/* take the discards held so far; must be called with blkstat.discard_lock held */
+static void blkstat_discard_take(struct bio_list *batch, sector_t *start, sector_t *end)
+{
+    bio_list_merge(batch, &blkstat.discards);
+    bio_list_init(&blkstat.discards);
+    *start = blkstat.discard_start;
+    *end = blkstat.discard_end;
+}
+
+/* send a batch of adjacent discards down, as one where there is more than one */
+static void blkstat_discard_issue(struct bio_list *batch, sector_t start, sector_t end)
+{
+    struct bio *bio, *orig;
+    int n = 0;
+
+    if (bio_list_empty(batch))
+        return;
+
+    if (batch->head != batch->tail && (bio = bio_alloc(GFP_NOIO, 0))) {
+        bio->bi_iter.bi_sector = start;
+        bio->bi_iter.bi_size = (end - start) << 9;
+        bio->bi_rw = REQ_WRITE | REQ_DISCARD;
+        bio->bi_end_io = blkstat_discard_endio;
+        bio->bi_private = bio_list_get(batch);
+        for (orig = bio->bi_private; orig; orig = orig->bi_next)
+            n++;
+        atomic_long_add(n, &blkstat.discards_merged);
+        atomic_long_inc(&blkstat.discards_issued);
+        blkstat_remap(bio);
+        return;
+    }
+
+    /* a single one, or no memory to merge them: each goes as it is */
+    while ((bio = bio_list_pop(batch)))
+        blkstat_remap(bio);
+}
+
+static void blkstat_discard_work(struct work_struct *work)
+{
+    struct bio_list batch;
+    sector_t start, end;
+
+    bio_list_init(&batch);
+    spin_lock(&blkstat.discard_lock);
+    blkstat_discard_take(&batch, &start, &end);
+    spin_unlock(&blkstat.discard_lock);
+
+    blkstat_discard_issue(&batch, start, end);
+}
+
+/*
+ * Filesystems tend to discard freed extents a few blocks at a time, and
+ * many targets handle a discard at a fixed cost whatever its size. Small
+ * ones are held for a short while, and those that touch the held range
+ * are sent down together with it.
+ */
+static void blkstat_discard(struct bio *bio)
+{
+    struct request_queue *tq = bdev_get_queue(blkstat.tdev);
+    sector_t start = bio->bi_iter.bi_sector, end = bio_end_sector(bio);
+    sector_t bstart = 0, bend = 0;
+    struct bio_list batch;
+    int first;
+
+    if (discard_merge_us <= 0 || bio_sectors(bio) > discard_merge_sectors ||
+            (bio->bi_rw & REQ_SECURE)) {
+        blkstat_remap(bio);
+        return;
+    }
+
+    bio_list_init(&batch);
+    spin_lock(&blkstat.discard_lock);
+    if (!bio_list_empty(&blkstat.discards) &&
+            ((start != blkstat.discard_end && end != blkstat.discard_start) ||
+             blkstat.discard_end - blkstat.discard_start + bio_sectors(bio) >
+             tq->limits.max_discard_sectors))
+        blkstat_discard_take(&batch, &bstart, &bend);
+
+    if ((first = bio_list_empty(&blkstat.discards))) {
+        blkstat.discard_start = start;
+        blkstat.discard_end = end;
+    } else {
+        blkstat.discard_start = min(blkstat.discard_start, start);
+        blkstat.discard_end = max(blkstat.discard_end, end);
+    }
+    bio_list_add(&blkstat.discards, bio);
+    spin_unlock(&blkstat.discard_lock);
+
+    blkstat_discard_issue(&batch, bstart, bend);
+    /* a new batch gets the whole of its wait */
+    if (first)
+        mod_delayed_work(system_wq, &blkstat.discard_work,
+                usecs_to_jiffies(discard_merge_us));
+}
+
+static void blkstat_make_request(struct request_queue *q, struct bio *bio) 
+{
+    struct bio *split;
+    unsigned int sectors;
+
+#ifdef BLKSTAT_DEBUG 
+    pr_info("blkstat: make request %-5s block %-12llu #pages %-4hu total-size "
+            "%-10u\n", bio_data_dir(bio) == WRITE ? "write" : "read",
+            (unsigned long long) bio->bi_iter.bi_sector, bio->bi_vcnt, bio->bi_iter.bi_size);
+#endif
+
+    if (!blkstat.tdev && !blkstat.null_target)
+    {
+        pr_info("blkstat: Request before tdev is ready, aborting\n");
+        goto err_bio;
+    }
+    if (!blkstat.ready)
+    {
+        pr_info("blkstat: Device not active yet, aborting\n");
+        goto err_bio;
+    }
+
+    if (blkstat.null_target) {
+        blkstat_null(bio);
+        return;
+    }
+
+    if (bio->bi_rw & REQ_DISCARD) {
+        blkstat_discard(bio);
+        return;
+    }
+
+    /*
+     * Split up front rather than leave it to the target: the pieces then
+     * are aligned, and each one is timed separately. The original bio
+     * completes with the last of them (bio_chain()). A write same bio
+     * carries a single block for the whole range; the target splits it.
+     *
+     * One piece per call, as blk_queue_split() does: what we submit only
+     * sits on current->bio_list until we return, so a second bio_split()
+     * here could wait on a bio_set that only those pieces would refill.
+     * The rest comes back to us through generic_make_request().
+     */
+    if (bio_has_data(bio) && !(bio->bi_rw & REQ_WRITE_SAME) &&
+            (sectors = blkstat_split_sectors(bio)) < bio_sectors(bio)) {
+        split = bio_split(bio, sectors, GFP_NOIO, blkstat.bio_set);
+        if (!split)
+            goto err_bio;
+        bio_chain(split, bio);
+        atomic_long_inc(&blkstat.splits);
+        blkstat_remap(split);
+        generic_make_request(bio);
+        return;
+    }
+
+    blkstat_remap(bio);
+    return;
+
+err_bio:
+    bio_io_error(bio);
+}
+
 static struct block_device *blkstat_bdev_open(char dev_path[])
 {
     /* Open underlying device */
@@ -238,10 +648,26 @@ static struct block_device *blkstat_bdev_open(char dev_path[])
 
 static int blkstat_start(char dev_path[])
 {
-    unsigned max_sectors;
+    struct request_queue *q = blkstat.queue;
+    struct request_queue *tq;
+
+    if (!strcmp(dev_path, NULL_TARGET)) {
+        /* whatever may come from above is taken, and finished at once */
+        blkstat.null_target = 1;
+        blkstat.capacity = null_sectors;
+        set_capacity(blkstat.gendisk, blkstat.capacity);
+        blk_queue_flush(q, REQ_FLUSH | REQ_FUA);
+        blk_queue_max_discard_sectors(q, UINT_MAX);
+        queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, q);
+        pr_info("%s: null target, capacity: %lu -- latency: %d us\n", DEVNAME,
+                null_sectors, null_latency_us);
+        blkstat.ready = 1;
+        return 0;
+    }
 
     if (!(blkstat.tdev = blkstat_bdev_open(dev_path)))
         return -EFAULT;
+    tq = bdev_get_queue(blkstat.tdev);
 
     /* Set up our internal device */
     blkstat.capacity = get_capacity(blkstat.tdev->bd_disk);
@@ -249,9 +675,36 @@ static int blkstat_start(char dev_path[])
 
     set_capacity(blkstat.gendisk, blkstat.capacity);
 
-    max_sectors = queue_max_hw_sectors(bdev_get_queue(blkstat.tdev));
-    blk_queue_max_hw_sectors(blkstat.queue, max_sectors);
-    pr_info("blkstat: Max sectors: %u\n", max_sectors);
+    /*
+     * Take over all of the target's limits (block sizes, alignment, I/O
+     * sizes, segments, discard granularity), so that the layers above
+     * build bios the target can take as they are.
+     */
+    blk_set_stacking_limits(&q->limits);
+    blk_queue_logical_block_size(q, LOGICAL_BLOCK_SIZE);
+    if (bdev_stack_limits(&q->limits, blkstat.tdev, 0))
+        pr_info("%s: the target is misaligned\n", DEVNAME);
+
+    /*
+     * The limits carry the discard and write same sizes, but the target's
+     * support for them, and for flushes, has to be advertised as well.
+     */
+    if (blk_queue_discard(tq))
+        queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, q);
+    blk_queue_flush(q, tq->flush_flags & (REQ_FLUSH | REQ_FUA));
+
+    pr_info("%s: discard: %s -- write same: %s -- flush: %s -- FUA: %s\n", DEVNAME,
+            blk_queue_discard(q) ? "yes" : "no",
+            q->limits.max_write_same_sectors ? "yes" : "no",
+            q->flush_flags & REQ_FLUSH ? "yes" : "no",
+            q->flush_flags & REQ_FUA ? "yes" : "no");
+    pr_info("%s: limits -- logical block: %u -- physical block: %u -- io_min: %u -- "
+            "io_opt: %u\n", DEVNAME, queue_logical_block_size(q),
+            queue_physical_block_size(q), queue_io_min(q), queue_io_opt(q));
+    pr_info("%s: limits -- max sectors: %u (hw %u) -- max segments: %u -- "
+            "max segment size: %u -- discard granularity: %u\n", DEVNAME,
+            queue_max_sectors(q), queue_max_hw_sectors(q), queue_max_segments(q),
+            queue_max_segment_size(q), q->limits.discard_granularity);
 
     blkstat.ready = 1;
 
@@ -281,19 +734,62 @@ static struct block_device_operations blkstat_ops = {
 	.getgeo = blkstat_getgeo,
 };
 
-static void *blkstat_seq_start(struct seq_file *sf, loff_t *pos)
+/* the rank of quantile i among n samples */
+static unsigned int qtrank(int i, unsigned int n)
+{
+    return div_u64((u64) pval[i] * n, 100000);
+}
+
+/* without the qtree: copy the samples out and sort them */
+static void quantiles_sorted(void)
 {
 
     int cmp(const void *l, const void *r)
     {   
-        return *((int *) l) - *((int *) r); 
+        u64 a = *((u64 *) l), b = *((u64 *) r);
+
+        return a < b ? -1 : a > b; 
     }
 
-    int *samples;
-    unsigned long flags;
-    int qtloc;
+    u64 *samples;
     int len, i;
 
+    /* 
+     * The FIFO may grow after we have got its length: we then take the
+     * newest len samples. It never shrinks.
+     */
+    len = rtimes_len();
+    /* chose vmalloc() to put less pressure on system memory for large sample sets */ 
+    samples = vmalloc(len * sizeof(*samples));
+
+    /* no lock: completions keep adding samples while we copy */
+    userinfo.rtlen = samples ? rtimes_snapshot(samples, len) : 0;
+
+    sort(samples, userinfo.rtlen, sizeof(*samples), &cmp, NULL);
+    memset(userinfo.qtles, 0, sizeof(userinfo.qtles));
+
+    for (i = 0; i < NR_QUANTILES && userinfo.rtlen; i++) {
+        /* store values for subsequent access by seq_file methods */
+        userinfo.qtles[i] = samples[qtrank(i, userinfo.rtlen)];
+    }
+
+    vfree(samples); 
+}
+
+/* must be called with blkstat.info_lock held */
+static void quantiles_qtree(void)
+{
+    int i;
+
+    userinfo.rtlen = qtree_count(blkstat.rtq);
+    for (i = 0; i < NR_QUANTILES; i++)
+        userinfo.qtles[i] = qtree_kth(blkstat.rtq, qtrank(i, userinfo.rtlen));
+}
+
+static void *blkstat_seq_start(struct seq_file *sf, loff_t *pos)
+{
+    unsigned long flags;
+
     /* 
      * Prevent concurrent access to the seq_file. Race to perform a vmalloc() 
      * by concurrent invocations would be a disaster. May also corrupt 
@@ -304,37 +800,28 @@ static void *blkstat_seq_start(struct seq_file *sf, loff_t *pos)
         return NULL;    /* signal termination to the higher layer */
 
     if (*pos == 0) {
-        /* 
-         * Note the race here: we use the length value later, in the critical section,
-         * when the FIFO length may have changed. This is hardly a problem
-         * since our FIFO either grows in size or remains at the maximum size level.
-         * We can't do it otherwise because vmalloc() may sleep and is not allowed
-         * in our spinlock-protected section.
-         */
-        len = ififo_len(blkstat.rtimes);
-        /* chose vmalloc() to put less pressure on system memory for large sample sets */ 
-        samples = vmalloc(len * sizeof(*samples));
+        if (!blkstat.rtq)
+            quantiles_sorted();
 
         /* grab the info spinlock and take a snapshot of current statistics */
         spin_lock_irqsave(&blkstat.info_lock, flags);
-        memcpy(&userinfo.info, &blkstat.info, sizeof(userinfo));
+        memcpy(&userinfo.info, &blkstat.info, sizeof(userinfo.info));
         userinfo.qdepth = atomic_read(&blkstat.qdepth);
-        userinfo.rtlen = min(len, ififo_len(blkstat.rtimes));
-        for (i = 0; i < userinfo.rtlen; i++)
-            ififo_get_at(blkstat.rtimes, &samples[i], i);
+        userinfo.splits = atomic_long_read(&blkstat.splits);
+        userinfo.discards_merged = atomic_long_read(&blkstat.discards_merged);
+        userinfo.discards_issued = atomic_long_read(&blkstat.discards_issued);
+        userinfo.rtdropped = rtimes_dropped();
+        /* a dozen O(log n) lookups: no need to copy anything out */
+        if (blkstat.rtq)
+            quantiles_qtree();
+        if (blkstat.rtw) {
+            userinfo.wcount = wagg_count(blkstat.rtw);
+            userinfo.wmin = wagg_min(blkstat.rtw);
+            userinfo.wmax = wagg_max(blkstat.rtw);
+            userinfo.wmean = wagg_mean(blkstat.rtw);
+        }
         spin_unlock_irqrestore(&blkstat.info_lock, flags);
         /* info spinlock -- end of critical section */
-
-        sort(samples, userinfo.rtlen, sizeof(int), &cmp, NULL);
-
-        for (i = 0; i < NR_QUANTILES; i++) {
-            /* rescale quantile ranks */
-            qtloc = pval[i] * userinfo.rtlen / 100000;
-            /* store values for subsequent access by seq_file methods */
-            userinfo.qtles[i] = samples[qtloc];
-        }
-
-        vfree(samples); 
     
         return SEQ_START_TOKEN;
     }
@@ -367,6 +854,7 @@ static int blkstat_seq_show(struct seq_file *sf, void *v)
     /* the first item => header */
     if (idx == 1) {
         long meanrt = 0;
+        int op, b;
         if (info->ios[0] + info->ios[1])
             meanrt = (info->duration[0] + info->duration[1]) / (info->ios[0] + info->ios[1]);
         seq_printf(sf, "Target device: %s\n", targetname);
@@ -380,11 +868,35 @@ static int blkstat_seq_show(struct seq_file *sf, void *v)
             seq_printf(sf, " -- I/Os per sec: %lu\n", info->duration[1]/info->ios[1]);
         else
             seq_printf(sf, "\n");
+        for (op = OP_DISCARD; op < NR_OPS; op++) {
+            seq_printf(sf, "%s I/Os: %lu", opnam[op], info->ios[op]);
+            if (info->ios[op])
+                seq_printf(sf, " -- mean (ns): %lu\n", info->duration[op]/info->ios[op]);
+            else
+                seq_printf(sf, "\n");
+        }
         seq_printf(sf, "Queue depth: %d\n", userinfo.qdepth);
+        seq_printf(sf, "Split bios: %ld\n", userinfo.splits);
+        seq_printf(sf, "Discards merged: %ld into %ld\n", userinfo.discards_merged,
+                userinfo.discards_issued);
+        /* buckets of powers of two, by their upper bound */
+        for (op = 0; op < NR_OPS; op++) {
+            if (!info->ios[op])
+                continue;
+            seq_printf(sf, "%s histogram (ns):", opnam[op]);
+            for (b = 0; b < NR_BUCKETS; b++)
+                if (info->hist[op][b])
+                    seq_printf(sf, " %llu: %lu", 1ULL << (b + 1), info->hist[op][b]);
+            seq_printf(sf, "\n");
+        }
         seq_printf(sf, "I/O service time (ns)\n");
         seq_printf(sf, "Min: %lu -- Max: %lu\n", info->minrt, info->maxrt);
         seq_printf(sf, "Mean: %lu\n", meanrt);
-        seq_printf(sf, "Median: %d\n", userinfo.qtles[QT_MEDIAN]);
+        seq_printf(sf, "Median: %llu\n", userinfo.qtles[QT_MEDIAN]);
+        seq_printf(sf, "Samples: %d -- dropped: %lu\n", userinfo.rtlen, userinfo.rtdropped);
+        if (blkstat.rtw)
+            seq_printf(sf, "Last %u -- Min: %llu -- Max: %llu -- Mean: %llu\n",
+                    userinfo.wcount, userinfo.wmin, userinfo.wmax, userinfo.wmean);
         
         return 0;
     }
@@ -393,7 +905,7 @@ static int blkstat_seq_show(struct seq_file *sf, void *v)
     idx -= 2;
 
     seq_printf(sf, "%-7s:", pnam[idx]);
-    seq_printf(sf, " %d\n", userinfo.qtles[idx]);
+    seq_printf(sf, " %llu\n", userinfo.qtles[idx]);
     return 0;
 }
 
@@ -430,11 +942,19 @@ static int __init blkstat_init(void)
 
     spin_lock_init(&blkstat.info_lock);
     mutex_init(&blkstat.procfs_mutex);
+    spin_lock_init(&blkstat.discard_lock);
+    bio_list_init(&blkstat.discards);
+    INIT_DELAYED_WORK(&blkstat.discard_work, blkstat_discard_work);
 
     /* allocate the FIFO to store recent response times */
-    if ((rc = ififo_alloc(&blkstat.rtimes, nrsamples, GFP_KERNEL)))
+    if ((rc = rtimes_alloc()))
         return rc;
 
+    if (!(blkstat.bio_set = bioset_create(BIO_POOL_SIZE, 0))) {
+        rtimes_free();
+        return -ENOMEM;
+    }
+
 	/* 
      * Use blk_alloc_queue() to set up the 'bio-oriented' processing,
      * i.e. it is enough to register the make_request() callback
@@ -443,7 +963,7 @@ static int __init blkstat_init(void)
      */
     if (!(blkstat.queue = blk_alloc_queue(GFP_KERNEL))) {
         pr_info("%s: alloc_queue failed\n", DEVNAME);
-        goto error_rm_fifo;
+        goto error_rm_bioset;
     }
 
     /* register our make_request() callback */
@@ -476,14 +996,15 @@ static int __init blkstat_init(void)
     proc_entry = proc_create(PROC_ENTRY, S_IRUGO, NULL, &proc_fops);
     return rc;
 
-error_rm_fifo:
-    ififo_free(blkstat.rtimes);
-
 error_rm_dev:
 	unregister_blkdev(majornr, DEVNAME);
 
 error_rm_queue:
     blk_cleanup_queue(blkstat.queue);
+
+error_rm_bioset:
+    bioset_free(blkstat.bio_set);
+    rtimes_free();
 	return -ENXIO;
 }
 
@@ -491,7 +1012,10 @@ static void __exit blkstat_exit(void)
 {
     remove_proc_entry(PROC_ENTRY, NULL);
 
-    if (blkstat.ready) {
+    /* the discards still held are sent down */
+    flush_delayed_work(&blkstat.discard_work);
+
+    if (blkstat.ready && blkstat.tdev) {
         blkdev_put(blkstat.tdev, TDEV_MODE);
         bdput(blkstat.tdev);
     }
@@ -504,7 +1028,8 @@ static void __exit blkstat_exit(void)
     if (blkstat.queue)
 	    blk_cleanup_queue(blkstat.queue);
 
-    ififo_free(blkstat.rtimes);	
+    bioset_free(blkstat.bio_set);
+    rtimes_free();	
     unregister_blkdev(majornr, DEVNAME);
     pr_info("%s: exit complete\n", DEVNAME);
 }
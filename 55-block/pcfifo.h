@@ -0,0 +1,209 @@
+#ifndef PCFIFO_H
+#define PCFIFO_H
+
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/smp.h>
+#include <linux/slab.h>
+#include <linux/kernel.h>
+
+#include "tfifo.h"
+
+/*
+ * A FIFO sharded per CPU: DEFINE_PCFIFO(name, fifo, type) generates struct
+ * name over the typed fifo struct fifo (from DEFINE_TFIFO(fifo, type)).
+ * Each possible CPU has a fifo of its own, so producers on different CPUs
+ * never touch the same cache lines.
+ *
+ * The calls are those of tfifo. put(), put_overwrite(), get() and
+ * is_full() work on the shard of the CPU they run on: the caller has
+ * preemption disabled, and IRQs too if an IRQ may put as well -- then each
+ * shard has one writer at a time, as tfifo expects. len(), dropped() and
+ * the snapshots see all shards.
+ *
+ * size is for all the CPUs together: each shard holds size / CPUs items.
+ * With an uneven load, the busy CPUs keep fewer of their newest items
+ * than one fifo would.
+ *
+ * Readers get either the shards one after another (name_snapshot()), or
+ * the items in order of a key, e.g. a timestamp (name_snapshot_merged()):
+ * every shard is in order already, so a k-way merge of them, k being the
+ * number of CPUs, does it in O(n log k).
+ */
+
+#define DEFINE_PCFIFO(name, fifo, type)                                         \
+struct name {                                                                   \
+    struct fifo * __percpu *shards;                                             \
+    unsigned int size;                                                          \
+    /* for snapshot_merged(): per CPU runs and a heap of them */                \
+    unsigned int *run_start;                                                    \
+    unsigned int *run_end;                                                      \
+    unsigned int *heap;                                                         \
+};                                                                              \
+                                                                                \
+static inline void name##_free(struct name *pf)                                 \
+{                                                                               \
+    int cpu;                                                                    \
+                                                                                \
+    if (pf->shards)                                                             \
+        for_each_possible_cpu(cpu)                                              \
+            if (*per_cpu_ptr(pf->shards, cpu))                                  \
+                fifo##_free(*per_cpu_ptr(pf->shards, cpu));                     \
+    free_percpu(pf->shards);                                                    \
+    kfree(pf->run_start);                                                       \
+    kfree(pf->run_end);                                                         \
+    kfree(pf->heap);                                                            \
+    kfree(pf);                                                                  \
+}                                                                               \
+                                                                                \
+static inline int name##_alloc(struct name **fifo, unsigned int size, gfp_t gfp_mask) \
+{                                                                               \
+    struct name *self;                                                          \
+    unsigned int shard;                                                         \
+    int cpu;                                                                    \
+                                                                                \
+    if (!size)                                                                  \
+        return -EINVAL;                                                         \
+    shard = DIV_ROUND_UP(size, num_possible_cpus());                            \
+                                                                                \
+    if (!(self = kzalloc(sizeof(struct name), gfp_mask)))                       \
+        return -ENOMEM;                                                         \
+    self->size = size;                                                          \
+    self->shards = alloc_percpu(struct fifo *);                                 \
+    self->run_start = kcalloc(nr_cpu_ids, sizeof(unsigned int), gfp_mask);      \
+    self->run_end = kcalloc(nr_cpu_ids, sizeof(unsigned int), gfp_mask);        \
+    self->heap = kcalloc(nr_cpu_ids, sizeof(unsigned int), gfp_mask);           \
+    if (!self->shards || !self->run_start || !self->run_end || !self->heap)     \
+        goto nomem;                                                             \
+                                                                                \
+    for_each_possible_cpu(cpu)                                                  \
+        if (fifo##_alloc(per_cpu_ptr(self->shards, cpu), shard, gfp_mask))      \
+            goto nomem;                                                         \
+                                                                                \
+    *fifo = self;                                                               \
+    return 0;                                                                   \
+                                                                                \
+nomem:                                                                          \
+    name##_free(self);                                                          \
+    return -ENOMEM;                                                             \
+}                                                                               \
+                                                                                \
+static inline struct fifo *name##_local(struct name *pf)                        \
+{                                                                               \
+    return __this_cpu_read(*pf->shards);                                        \
+}                                                                               \
+                                                                                \
+static inline int name##_len(struct name *pf)                                   \
+{                                                                               \
+    int cpu, len = 0;                                                           \
+                                                                                \
+    for_each_possible_cpu(cpu)                                                  \
+        len += fifo##_len(*per_cpu_ptr(pf->shards, cpu));                       \
+    return len;                                                                 \
+}                                                                               \
+                                                                                \
+static inline int name##_is_empty(struct name *pf)                              \
+{                                                                               \
+    return name##_len(pf) == 0;                                                 \
+}                                                                               \
+                                                                                \
+static inline int name##_is_full(struct name *pf)                               \
+{                                                                               \
+    return fifo##_is_full(name##_local(pf));                                    \
+}                                                                               \
+                                                                                \
+static inline int name##_put(struct name *pf, type value)                       \
+{                                                                               \
+    return fifo##_put(name##_local(pf), value);                                 \
+}                                                                               \
+                                                                                \
+static inline int name##_put_overwrite(struct name *pf, type value, type *old)  \
+{                                                                               \
+    return fifo##_put_overwrite(name##_local(pf), value, old);                  \
+}                                                                               \
+                                                                                \
+static inline unsigned long name##_dropped(struct name *pf)                     \
+{                                                                               \
+    unsigned long dropped = 0;                                                  \
+    int cpu;                                                                    \
+                                                                                \
+    for_each_possible_cpu(cpu)                                                  \
+        dropped += fifo##_dropped(*per_cpu_ptr(pf->shards, cpu));               \
+    return dropped;                                                             \
+}                                                                               \
+                                                                                \
+static inline int name##_get(struct name *pf, type *value)                      \
+{                                                                               \
+    return fifo##_get(name##_local(pf), value);                                 \
+}                                                                               \
+                                                                                \
+/* the shards one after another, up to max items; no lock needed */            \
+static inline unsigned int name##_snapshot(struct name *pf, type *buf,          \
+        unsigned int max)                                                       \
+{                                                                               \
+    unsigned int n = 0;                                                         \
+    int cpu;                                                                    \
+                                                                                \
+    for_each_possible_cpu(cpu)                                                  \
+        n += fifo##_snapshot(*per_cpu_ptr(pf->shards, cpu), buf + n, max - n);  \
+    return n;                                                                   \
+}                                                                               \
+                                                                                \
+static inline int name##_heap_before(struct name *pf, type *tmp,                \
+        int (*before)(const type *, const type *), unsigned int a, unsigned int b) \
+{                                                                               \
+    return before(&tmp[pf->run_start[pf->heap[a]]], &tmp[pf->run_start[pf->heap[b]]]); \
+}                                                                               \
+                                                                                \
+static inline void name##_heap_down(struct name *pf, type *tmp,                 \
+        int (*before)(const type *, const type *), unsigned int i, unsigned int k) \
+{                                                                               \
+    unsigned int c, t;                                                          \
+                                                                                \
+    while ((c = 2 * i + 1) < k) {                                               \
+        if (c + 1 < k && name##_heap_before(pf, tmp, before, c + 1, c))         \
+            c++;                                                                \
+        if (!name##_heap_before(pf, tmp, before, c, i))                         \
+            break;                                                              \
+        t = pf->heap[i];                                                        \
+        pf->heap[i] = pf->heap[c];                                              \
+        pf->heap[c] = t;                                                        \
+        i = c;                                                                  \
+    }                                                                           \
+}                                                                               \
+                                                                                \
+/*                                                                              \
+ * All shards merged by before(), which orders the items of each shard, into  \
+ * buf; tmp is scratch space of max items. One reader at a time.               \
+ */                                                                             \
+static inline unsigned int name##_snapshot_merged(struct name *pf, type *buf,   \
+        type *tmp, unsigned int max, int (*before)(const type *, const type *)) \
+{                                                                               \
+    unsigned int n = 0, k = 0, i, r;                                            \
+    int cpu;                                                                    \
+                                                                                \
+    for_each_possible_cpu(cpu) {                                                \
+        pf->run_start[k] = n;                                                   \
+        n += fifo##_snapshot(*per_cpu_ptr(pf->shards, cpu), tmp + n, max - n);  \
+        pf->run_end[k] = n;                                                     \
+        if (pf->run_end[k] > pf->run_start[k]) {                                \
+            pf->heap[k] = k;                                                    \
+            k++;                                                                \
+        }                                                                       \
+    }                                                                           \
+                                                                                \
+    for (i = k / 2; i-- > 0; )                                                  \
+        name##_heap_down(pf, tmp, before, i, k);                                \
+                                                                                \
+    for (i = 0; k; i++) {                                                       \
+        r = pf->heap[0];                                                        \
+        buf[i] = tmp[pf->run_start[r]++];                                       \
+        /* the run is done: the last one takes its place */                     \
+        if (pf->run_start[r] == pf->run_end[r])                                 \
+            pf->heap[0] = pf->heap[--k];                                        \
+        name##_heap_down(pf, tmp, before, 0, k);                                \
+    }                                                                           \
+    return n;                                                                   \
+}
+
+#endif /* PCFIFO_H */
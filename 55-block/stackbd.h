@@ -0,0 +1,747 @@
+#ifndef STACKBD_H
+#define STACKBD_H
+
+#include <linux/types.h>
+#include <linux/blkdev.h>
+#include <linux/mutex.h>
+#include <linux/mempool.h>
+#include <linux/rcupdate.h>
+#include <linux/radix-tree.h>
+#include <linux/completion.h>
+#include <linux/hrtimer.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+
+#define DEVNAME "stackbd"
+
+/*
+ * We can tweak our hardware sector size, but the kernel talks to us
+ * in terms of small sectors, always.
+ */
+#define KERNEL_SECTOR_SIZE 512
+
+#define STACKBD_MAX_MEMBERS 8
+
+/* read latency histogram: 4 buckets per power of 2 of nanoseconds */
+#define STACKBD_LAT_BUCKETS 256
+
+/* a backing device */
+struct stackbd_member {
+    struct block_device *bdev;
+    sector_t capacity;
+    /* a mirror member that failed I/O is no longer read from */
+    int faulty;
+
+    /* statistics */
+    atomic_t inflight;
+    atomic_long_t ios;
+    atomic_long_t sectors;
+
+    /*
+     * Read latency: a moving average, and a histogram that is halved
+     * every so often so that the p99 estimate follows recent behaviour.
+     */
+    long ewma_ns;
+    unsigned long p99_ns;
+    spinlock_t lat_lock;
+    unsigned int lat_total;
+    unsigned int lat_hist[STACKBD_LAT_BUCKETS];
+
+    /* hedged reads sent to this member, and how many of them won */
+    atomic_long_t hedges;
+    atomic_long_t hedge_wins;
+};
+
+/*
+ * Per-bio context: a bio is serviced by one or more clones (flushes and
+ * mirror writes go to every target, hedged reads to two of them), and
+ * completes when the last of them does -- or, for hedged reads, when
+ * the first one succeeds.
+ */
+struct stackbd_io;
+
+struct stackbd_clone {
+    struct stackbd_io *io;
+    struct stackbd_member *m;
+    unsigned long start;        /* submission time, ns */
+    int bounce;                 /* reads into private pages, not the original's */
+};
+
+/* succeed if any of the clones does (mirror writes and flushes) */
+#define STACKBD_IO_ANY_OK   1
+/* hedged read: bounce buffers, the first successful clone completes the bio */
+#define STACKBD_IO_HEDGED   2
+/* all-zero write: sent as a discard to members that read back zeroes after one */
+#define STACKBD_IO_ZERO     4
+/* mirror write counted in the write-intent bitmap: sector, size are its range */
+#define STACKBD_IO_BITMAP   8
+/* empty flushes to every member ahead of a flush with data, which follows them */
+#define STACKBD_IO_PREFLUSH 16
+
+struct stackbd_io {
+    struct bio *bio;            /* original bio */
+    atomic_t pending;           /* clones (and the hedge timer) not done yet */
+    atomic_t nr_ok;             /* clones completed successfully */
+    int error;
+    int flags;
+    int done;                   /* original bio already completed */
+    /* hedged reads: fires at the p99 latency; what the hedge has to read */
+    struct hrtimer timer;
+    sector_t sector;
+    unsigned int size;
+    unsigned long rw;
+    struct list_head list;      /* on the worker's hedge list */
+    struct stackbd_epoch *ep;   /* the bio is counted in ep until it completes */
+    int epoch;
+    struct stackbd_clone clone[0];
+};
+
+/*
+ * Helpers shared by the stackbd pieces (stackbd_kt.c)
+ */
+
+struct stackbd_io *stackbd_io_alloc(struct bio *bio, int nr);
+
+void stackbd_io_put(struct stackbd_io *io, int error);
+
+void stackbd_io_dispatch(struct stackbd_io *io, int i, struct stackbd_member *m,
+        sector_t sector, struct bio *b);
+
+void stackbd_io_clone(struct stackbd_io *io, int i, struct stackbd_member *m,
+        sector_t sector);
+
+void stackbd_queue_hedge(struct stackbd_io *io);
+
+/* submit a bio below the cache -- may block, never fails to take the bio */
+void stackbd_lower_submit(struct bio *bio);
+
+/* submit a bio through the cache and the layout -- may block */
+void stackbd_upper_submit(struct bio *bio);
+
+/* submit a bio to the virtual device from any context: inline or via the worker */
+void stackbd_submit(struct bio *bio);
+
+static inline unsigned long stackbd_now(void)
+{
+    return ktime_to_ns(ktime_get());
+}
+
+/* close a member opened by stackbd -- no I/O may be in flight to it */
+void stackbd_member_close(struct stackbd_member *m);
+
+/* synchronous I/O on a buffer that lives in the kernel direct mapping */
+int stackbd_sync_io(struct block_device *bdev, int rw, sector_t sector,
+        void *buf, unsigned int len);
+
+/*
+ * Background copies: tier moves, migration, mirror resync. The data goes
+ * through buf, read from one member and written to the others a piece at
+ * a time, the foreground first: the copy pauses while more than
+ * *busy_inflight bios are in flight, and keeps to *mbps MB/s (0 -
+ * unlimited). Those are the caller's module parameters, read as the copy
+ * goes. window(), if set, is called before each piece and window_done()
+ * after it, e.g. to hold the writes to it; the pauses are outside them.
+ * From a kthread, the copy stops with -EINTR when the thread is told to.
+ */
+struct stackbd_copier {
+    void *buf;
+    unsigned int buf_sectors;
+    atomic_t *inflight;                 /* foreground bios; NULL - no pausing */
+    int *busy_inflight;
+    int *mbps;                          /* NULL - unlimited */
+    atomic_long_t *copied_sectors;      /* NULL - not counted */
+    atomic_long_t *throttled_ms;        /* NULL - not counted */
+    int (*window)(struct stackbd_copier *cp, sector_t sector, unsigned int sectors);
+    void (*window_done)(struct stackbd_copier *cp, sector_t sector, unsigned int sectors);
+};
+
+/* copy sectors from from_sector on from to to_sector on each of to[nr_to] */
+int stackbd_copy_range(struct stackbd_copier *cp, struct block_device *from,
+        sector_t from_sector, struct block_device **to, int nr_to,
+        sector_t to_sector, sector_t sectors);
+
+/*
+ * Epochs: I/O is counted in the current epoch until it completes, so
+ * that a thread changing where things go can wait for everything that
+ * started before the change. stackbd_epoch_drain() switches to the other
+ * epoch and waits for the old one to empty; it is not reentrant.
+ */
+struct stackbd_epoch {
+    int cur;
+    atomic_t count[2];
+    wait_queue_head_t wait;
+};
+
+void stackbd_epoch_init(struct stackbd_epoch *ep);
+
+/* returns the epoch to pass to stackbd_epoch_exit() */
+int stackbd_epoch_enter(struct stackbd_epoch *ep);
+
+void stackbd_epoch_exit(struct stackbd_epoch *ep, int epoch);
+
+void stackbd_epoch_drain(struct stackbd_epoch *ep);
+
+/*
+ * Thin translation layer (stackbd_map.c)
+ *
+ * The virtual address space is carved into chunks of chunk_sectors
+ * sectors, which are mapped to physical chunks of the data area on
+ * demand, when first written to. The map is an ordered table of extents
+ * (runs of virtually and physically contiguous chunks). Readers look
+ * it up under rcu_read_lock() only; the writer (allocation) builds a new
+ * copy of the table and publishes it with rcu_assign_pointer().
+ * Writes of nothing but zeroes (zero_detect) to chunks that are not
+ * allocated are dropped: such chunks read back zeroes anyway.
+ *
+ * On-disk layout of the target:
+ *   [ metadata area: meta_sectors ][ data area: chunk 0, chunk 1, ... ]
+ */
+
+struct stackbd_extent {
+    u64 vchunk;         /* first virtual chunk */
+    u64 pchunk;         /* first physical chunk */
+    u32 nr;             /* number of chunks */
+};
+
+struct stackbd_table {
+    struct rcu_head rcu;
+    unsigned int nr;
+    struct stackbd_extent ext[0];
+};
+
+struct stackbd_map {
+    struct stackbd_table __rcu *table;
+
+    struct block_device *bdev;
+    unsigned int chunk_sectors;     /* power of 2 */
+    unsigned int chunk_shift;
+    sector_t meta_sectors;
+    u64 virt_chunks;                /* size of the virtual device */
+    u64 phys_chunks;                /* size of the data area */
+
+    /* allocation state -- protected by lock */
+    struct mutex lock;
+    u64 next_free;
+    unsigned int max_extents;       /* how many fit in the metadata area */
+    void *meta_buf;                 /* metadata area image, page-allocated */
+    unsigned int meta_order;
+
+    /* statistics */
+    atomic_long_t nr_alloc;
+    atomic_long_t nr_unmapped_reads;
+};
+
+/* stackbd_map_bio() result: the bio has been completed by the map */
+#define STACKBD_MAP_DONE 1
+
+int stackbd_map_init(struct stackbd_map *map, struct block_device *bdev,
+        unsigned int chunk_sectors, sector_t meta_sectors, sector_t virt_sectors);
+
+void stackbd_map_exit(struct stackbd_map *map);
+
+int stackbd_map_lookup(struct stackbd_map *map, u64 vchunk, u64 *pchunk);
+
+int stackbd_map_bio(struct stackbd_map *map, struct bio *bio, sector_t *psector,
+        int may_block);
+
+static inline sector_t stackbd_map_capacity(struct stackbd_map *map)
+{
+    return (sector_t) map->virt_chunks << map->chunk_shift;
+}
+
+/*
+ * Mirror (RAID1) layout (stackbd_mirror.c)
+ *
+ * Writes go to all members. Reads go to the member with the lowest
+ * expected wait, ewma * (inflight + 1); optionally, a second (hedged)
+ * read is sent to another member when the first one is slower than the
+ * member's recent p99.
+ */
+
+void stackbd_member_init(struct stackbd_member *m);
+
+void stackbd_member_account(struct stackbd_member *m, unsigned long ns);
+
+struct stackbd_bitmap;
+
+/* bm: the write-intent bitmap of the writes, NULL - none */
+void stackbd_mirror_submit(struct stackbd_member *members, int nr,
+        struct bio *bio, sector_t sector, struct stackbd_bitmap *bm);
+
+void stackbd_mirror_hedge(struct stackbd_member *members, int nr,
+        struct stackbd_io *io);
+
+void stackbd_mirror_read_done(struct stackbd_clone *c, struct bio *b, int error);
+
+/*
+ * Write-intent bitmap of the mirror layout (stackbd_bitmap.c)
+ *
+ * With mirror_bitmap, the mirror is carved into regions, and each region
+ * has a bit, set on disk (on every member, with FUA) before the first
+ * write to it goes out. After a crash, only the regions whose bit is set
+ * can differ between the members, so only they are copied over when the
+ * device is started again. The writers that need a bit set at the same
+ * time share one bitmap write. A thread clears the bits of regions that
+ * had no writes in flight for two passes in a row (bitmap_clear_ms), so a
+ * region that is written to all the time costs no bitmap writes at all.
+ * A faulty member is recorded in the header, and stops the clearing: it
+ * is left out when the bits are resynced next time.
+ *
+ * The bitmap lives at the end of every member, after the data:
+ *   [ data ][ header page ][ bitmap pages ]
+ * so a mirror that has been in use without one loses its tail to it.
+ */
+
+struct stackbd_bitmap {
+    struct stackbd_member *members;
+    int nr;
+    sector_t offset;                /* of the area on the members: the end of the data */
+    unsigned int region_sectors;    /* power of 2 */
+    unsigned int region_shift;
+    unsigned long nr_regions;
+
+    /* area image: header page, then the bits */
+    void *buf;
+    unsigned int order;
+    unsigned int nr_pages;
+    unsigned long *bits;
+
+    /* protected by lock */
+    spinlock_t lock;
+    unsigned int *inflight;         /* writes in flight, per region */
+    unsigned long *clear_pending;   /* idle at the last pass */
+    unsigned long *dirty;           /* pages changed since they were written */
+    unsigned long *busy;            /* pages being written */
+    unsigned long nr_dirty;         /* regions with the bit set */
+
+    /* one bitmap write at a time */
+    struct mutex io_mutex;
+    struct task_struct *thread;
+    wait_queue_head_t wait;
+
+    /* statistics */
+    atomic_long_t bits_set;
+    atomic_long_t bits_cleared;
+    atomic_long_t page_writes;
+    atomic_long_t resynced;         /* regions, at start */
+};
+
+/* resyncs what the last shutdown left dirty; *capacity shrinks by the area */
+int stackbd_bitmap_init(struct stackbd_bitmap *bm, struct stackbd_member *members, int nr,
+        sector_t *capacity, unsigned int region_sectors);
+
+void stackbd_bitmap_exit(struct stackbd_bitmap *bm);
+
+/* returns 0 when the bits of the write are on disk, -EWOULDBLOCK or an error */
+int stackbd_bitmap_start_write(struct stackbd_bitmap *bm, sector_t sector,
+        unsigned int sectors, int may_block);
+
+void stackbd_bitmap_end_write(struct stackbd_bitmap *bm, sector_t sector,
+        unsigned int sectors);
+
+/*
+ * Hot/cold tiering (stackbd_tier.c)
+ *
+ * Two targets: members[0] is the fast one, members[1] the slow one. The
+ * slow target is the home of every chunk, at the same offset as on the
+ * virtual device. Chunks that get a lot of I/O (heat: I/O counts, halved
+ * every tier_interval_ms) are copied to the fast target in the background,
+ * and the remap table sends their I/O there from then on. When the fast
+ * target is full, a chunk only gets in by pushing out one that is much
+ * colder, which is copied back first. Migration is throttled to tier_mbps
+ * and backs off while foreground I/O is queued up.
+ *
+ * I/O is counted against an epoch, so a migration can wait for the I/O
+ * mapped before some point. Writes to the chunk being copied are let
+ * through, but make the copy start over; they are only held for the
+ * moment the remap table entry changes.
+ *
+ * Layout of the fast target:
+ *   [ header ][ remap table: 4 bytes per chunk ][ fast chunk 0, 1, ... ]
+ */
+
+/* remap table entry of a chunk that is on the slow target */
+#define STACKBD_TIER_SLOW (~0U)
+
+struct stackbd_tier {
+    struct stackbd_member *fast;
+    struct stackbd_member *slow;
+    atomic_t *inflight;             /* foreground I/O, to back off from */
+    unsigned int chunk_sectors;     /* power of 2 */
+    unsigned int chunk_shift;
+    u32 vchunks;                    /* chunks of the virtual device */
+    u32 fchunks;                    /* chunks of the fast data area */
+    sector_t data_start;            /* of the fast data area */
+
+    /* only the tier thread changes these */
+    u32 *table;                     /* chunk -> fast chunk, or STACKBD_TIER_SLOW */
+    u32 *owner;                     /* fast chunk -> chunk, or STACKBD_TIER_SLOW */
+    u32 nr_fast;
+    /* racy on purpose */
+    u32 *heat;
+
+    /* migration */
+    u32 mig_vchunk;                 /* being copied, or STACKBD_TIER_SLOW */
+    int mig_hold;                   /* writes to mig_vchunk wait */
+    int mig_dirty;                  /* mig_vchunk written to during the copy */
+    struct stackbd_epoch epoch;     /* I/O mapped */
+    wait_queue_head_t wait;         /* for mig_hold */
+    void *buf;                      /* copy buffer */
+    struct stackbd_copier copier;
+    void *sector_buf;               /* for writing out the remap table */
+    struct task_struct *thread;
+
+    /* statistics */
+    atomic_long_t fast_ios;
+    atomic_long_t slow_ios;
+    atomic_long_t promotions;
+    atomic_long_t demotions;
+    atomic_long_t aborts;           /* copies given up on after writes */
+    atomic_long_t migrated_sectors;
+    atomic_long_t throttled_ms;
+};
+
+int stackbd_tier_init(struct stackbd_tier *t, struct stackbd_member *fast,
+        struct stackbd_member *slow, unsigned int chunk_sectors, atomic_t *inflight);
+
+void stackbd_tier_exit(struct stackbd_tier *t);
+
+int stackbd_tier_map(struct stackbd_tier *t, struct bio *bio, int may_block,
+        struct stackbd_member **m, sector_t *sector, int *epoch);
+
+static inline sector_t stackbd_tier_capacity(struct stackbd_tier *t)
+{
+    return (sector_t) t->vchunks << t->chunk_shift;
+}
+
+/*
+ * Online migration of the linear layout (stackbd_migrate.c)
+ *
+ * The linear layout sends I/O to the member target points to, read with
+ * rcu_dereference() and no lock. To move to another device, a thread
+ * copies the data over in windows of a buffer's size, while dest points
+ * to the new member and writes go to both; writes to the window being
+ * copied wait until it is done. Then target is switched to the new member
+ * and the old one is closed once the I/O sent to it has completed.
+ */
+
+#define STACKBD_MIGRATE_IDLE    0
+#define STACKBD_MIGRATE_COPYING 1
+#define STACKBD_MIGRATE_DONE    2
+#define STACKBD_MIGRATE_FAILED  3
+
+struct stackbd_migrate {
+    struct stackbd_member __rcu *target;
+    struct stackbd_member __rcu *dest;  /* gets the writes too, if set */
+    atomic_t *inflight;                 /* foreground I/O, to back off from */
+
+    /* I/O mapped, so a switch can wait for it */
+    struct stackbd_epoch epoch;
+    /* writes to [hold_start, hold_end) wait for the copy */
+    sector_t hold_start;
+    sector_t hold_end;
+    wait_queue_head_t wait;
+
+    /* the copy */
+    struct task_struct *thread;
+    struct stackbd_member *src;
+    struct stackbd_member *dst;
+    int state;
+    int error;                          /* a write to dst failed */
+    void *buf;
+    struct stackbd_copier copier;
+    sector_t size;
+    sector_t copied;
+    unsigned long start_ns;
+    unsigned long end_ns;
+};
+
+void stackbd_migrate_init(struct stackbd_migrate *mg, struct stackbd_member *target,
+        atomic_t *inflight);
+
+/* copy the first size sectors over to dst and switch to it */
+int stackbd_migrate_start(struct stackbd_migrate *mg, struct stackbd_member *dst,
+        sector_t size);
+
+void stackbd_migrate_exit(struct stackbd_migrate *mg);
+
+/*
+ * The members to send the bio to, in m[0] and m[1]; returns how many,
+ * or -EWOULDBLOCK. The bio is counted in the epoch returned in *epoch.
+ */
+int stackbd_migrate_map(struct stackbd_migrate *mg, struct bio *bio, sector_t sector,
+        int may_block, struct stackbd_member **m, int *epoch);
+
+/* the error to report for a clone sent to m */
+int stackbd_migrate_endio(struct stackbd_migrate *mg, struct stackbd_member *m,
+        int error);
+
+/*
+ * Copy-on-write snapshot (stackbd_snap.c)
+ *
+ * The snapshot is taken when the device is started with a COW store. The
+ * first write to each chunk of the virtual device after that copies the
+ * chunk's old contents to the next free chunk of the COW store. A bitmap
+ * says which chunks have been copied, so other writes cost one test_bit();
+ * a radix tree gives the chunk's place in the store, for snapshot reads.
+ * The snapshot is a second, read-only disk: chunks that have been copied
+ * are read from the store, the others from the virtual device.
+ *
+ * The copies are made by a thread of their own, which holds the writes
+ * back until they are done and the snapshot reads that may have gone to
+ * the old contents have completed.
+ *
+ * The index is kept in memory only: the snapshot does not survive a
+ * restart. When the store fills up the snapshot is invalidated, and its
+ * reads fail from then on.
+ */
+
+struct stackbd_snap {
+    struct block_device *cow;
+    unsigned int chunk_sectors;     /* power of 2 */
+    unsigned int chunk_shift;
+    unsigned long nr_chunks;        /* of the virtual device */
+    unsigned long cow_chunks;       /* of the store */
+
+    unsigned long *copied;          /* chunk bitmap */
+    struct radix_tree_root index;   /* chunk -> place in the store */
+    int invalid;
+
+    /* writes waiting for their chunks to be copied -- protected by lock */
+    spinlock_t lock;
+    struct bio_list bios;
+    wait_queue_head_t wait;
+
+    /* only the snapshot thread changes these */
+    struct task_struct *thread;
+    unsigned long next_free;
+    void *buf;                      /* one chunk */
+    struct completion done;
+    int error;
+
+    /* snapshot reads sent to the virtual device */
+    struct stackbd_epoch epoch;
+
+    /* statistics */
+    atomic_long_t cow_writes;       /* writes that had to wait for a copy */
+    atomic_long_t cow_chunks_copied;
+    atomic_long_t cow_ns;           /* time spent copying */
+    atomic_long_t reads_cow;
+    atomic_long_t reads_origin;
+};
+
+int stackbd_snap_init(struct stackbd_snap *s, struct block_device *cow,
+        unsigned int chunk_sectors, sector_t capacity);
+
+void stackbd_snap_exit(struct stackbd_snap *s);
+
+/* stackbd_snap_write() result: the bio is queued for the copy to be made first */
+#define STACKBD_SNAP_QUEUED 1
+
+/* write hook: returns 0 when the bio may go ahead */
+int stackbd_snap_write(struct stackbd_snap *s, struct bio *bio);
+
+/* read from the snapshot disk: the bio is taken care of */
+void stackbd_snap_read(struct stackbd_snap *s, struct bio *bio);
+
+/*
+ * Worker queues (stackbd_sched.c)
+ *
+ * Bios handed over to the worker are queued by I/O priority class (the
+ * bio's ioprio, else the submitter's), reads and writes apart. The worker
+ * serves the classes by weight, counted in sectors (deficit round robin):
+ * while they are all busy, each class gets its weight's share of the
+ * sectors sent down, so a stream of large writes from a background job
+ * uses up its share sooner than reads do. Within a class reads go first;
+ * a read (or write) that has waited past its deadline goes ahead of
+ * everything, whatever its class.
+ *
+ * The queues are protected by the worker's lock, taken by the callers.
+ */
+
+#define STACKBD_CLASS_RT    0
+#define STACKBD_CLASS_BE    1
+#define STACKBD_CLASS_IDLE  2
+#define STACKBD_NR_CLASSES  3
+
+/* wait histogram: bucket b counts waits in [2^b, 2^(b+1)) ns */
+#define STACKBD_WAIT_BUCKETS 32
+
+extern char *stackbd_class_names[STACKBD_NR_CLASSES];
+
+struct stackbd_sched_entry {
+    struct list_head list;
+    struct bio *bio;
+    unsigned long queued;       /* ns */
+};
+
+struct stackbd_sched_class {
+    struct list_head fifo[2];   /* READ, WRITE */
+    unsigned int nr_queued[2];
+    long credit;                /* sectors left of this round's share */
+
+    /* statistics */
+    unsigned long dispatched;
+    unsigned long expired;      /* sent down because of their deadline */
+    unsigned long wait_hist[STACKBD_WAIT_BUCKETS];
+};
+
+struct stackbd_sched {
+    struct stackbd_sched_class classes[STACKBD_NR_CLASSES];
+    unsigned int queued;
+    mempool_t *pool;
+    /* bios that got no entry: they go first, and are not accounted */
+    struct bio_list overflow;
+};
+
+int stackbd_sched_init(struct stackbd_sched *s);
+
+void stackbd_sched_exit(struct stackbd_sched *s);
+
+/* the class to queue the bio in */
+int stackbd_bio_class(struct bio *bio);
+
+void stackbd_sched_add(struct stackbd_sched *s, struct bio *bio, int c);
+
+/* the bio to send down next, NULL if there is none */
+struct bio *stackbd_sched_next(struct stackbd_sched *s, unsigned long now);
+
+/*
+ * Write-back cache (stackbd_wbcache.c)
+ *
+ * A fixed pool of page-sized blocks of the virtual device, looked up by
+ * block number in a hash table. Writes are copied into the cache and
+ * completed at once; a thread writes the dirty blocks back in block order,
+ * merging adjacent ones into one bio, when cache_dirty_ratio of the cache
+ * is dirty, when a writer is out of clean blocks, or every
+ * cache_writeback_ms. Reads are served from the cache when all of their
+ * sectors are there, and what misses is put in the cache when the target
+ * returns it. REQ_FLUSH writes back everything and flushes the target;
+ * REQ_FUA writes go through to the target.
+ *
+ * Clean blocks are reclaimed 2Q-style: a block seen once sits in the
+ * a1in FIFO; when it is pushed out, its number is remembered in a ghost
+ * FIFO (a1out), and if it is asked for again while still there it comes
+ * back into the am LRU. A one-time scan only ever goes through a1in, so
+ * it can't push the working set out of am.
+ *
+ * Sequential readers are detected per stream and read ahead of: when a
+ * reader gets into the second half of what was read ahead, the next
+ * cache_readahead_kb are read into the cache asynchronously.
+ *
+ * A block is on one list at a time:
+ *   free       - not in use;
+ *   a1in, am   - clean (the target has the same data), can be reclaimed;
+ *   dirty      - has sectors newer than the target, oldest first;
+ *   none       - being written back or read ahead into.
+ */
+
+/* the 2Q queue a clean block belongs to */
+#define STACKBD_Q_A1IN  0
+#define STACKBD_Q_AM    1
+
+/* sequential streams tracked at a time */
+#define STACKBD_STREAMS 8
+
+struct stackbd_cblock {
+    struct hlist_node hash;
+    struct list_head list;
+    sector_t block;             /* block number on the virtual device */
+    struct page *page;
+    /* sector bitmaps */
+    unsigned long valid;        /* holds data */
+    unsigned long dirty;        /* newer than on the target */
+    unsigned long wb;           /* being written back */
+    unsigned char queue;        /* STACKBD_Q_* */
+    unsigned char fill;         /* being read ahead into */
+    unsigned char prefetched;   /* read ahead, not read yet */
+};
+
+/* the number of a block pushed out of a1in */
+struct stackbd_ghost {
+    struct hlist_node hash;
+    struct list_head list;
+    sector_t block;
+};
+
+struct stackbd_stream {
+    sector_t next;              /* where the next read is expected */
+    sector_t ra_end;            /* end of what has been read ahead */
+    unsigned int run;           /* sequential reads so far */
+    unsigned long used;         /* for replacing the least recently used */
+};
+
+struct stackbd_wbcache {
+    spinlock_t lock;
+    struct stackbd_cblock *blocks;
+    unsigned int nr_blocks;
+    struct hlist_head *hash;
+    unsigned int hash_bits;
+    struct list_head free;
+    struct list_head a1in;
+    struct list_head am;
+    struct list_head dirty;
+    unsigned int nr_a1in;           /* clean blocks on a1in */
+    unsigned int nr_am;
+    unsigned int nr_dirty;
+    unsigned int nr_wb;
+    unsigned int nr_fill;
+
+    /* a1out */
+    struct stackbd_ghost *ghosts;
+    struct hlist_head *ghost_hash;
+    struct list_head ghost_free;
+    struct list_head ghost_fifo;
+
+    struct stackbd_stream streams[STACKBD_STREAMS];
+    unsigned long stream_tick;
+
+    /* bumped by every write, to tell if a read raced with one */
+    unsigned long write_seq;
+    /* bumped when writeback or readahead completes blocks */
+    unsigned long events;
+
+    sector_t capacity;
+
+    /* limits of the bios below: boundary (power of 2, 0 - none), size, bvecs */
+    unsigned int boundary;
+    unsigned int max_sectors;
+    unsigned int max_segments;
+
+    /* one writeback pass at a time; the blocks of the current pass */
+    struct mutex wb_mutex;
+    struct stackbd_cblock **wb_vec;
+    struct task_struct *thread;
+    wait_queue_head_t wb_wait;      /* the writeback thread */
+    wait_queue_head_t space_wait;   /* writers out of blocks, or on a filling one */
+
+    /* statistics */
+    atomic_long_t read_hits;
+    atomic_long_t read_misses;
+    atomic_long_t read_fills;       /* blocks put in the cache on a miss */
+    atomic_long_t ra_blocks;        /* read ahead */
+    atomic_long_t ra_hits;          /* ... and then read */
+    atomic_long_t ra_wasted;        /* ... and reclaimed unread */
+    atomic_long_t writes;           /* absorbed */
+    atomic_long_t writes_through;   /* REQ_FUA */
+    atomic_long_t write_waits;      /* writers that had to wait for writeback */
+    atomic_long_t flushes;
+    atomic_long_t wb_passes;
+    atomic_long_t wb_bios;
+    atomic_long_t wb_blocks;
+    atomic_long_t wb_sectors;
+};
+
+/* stackbd_wbcache_bio() result: the bio has been completed by the cache */
+#define STACKBD_CACHE_DONE 1
+
+int stackbd_wbcache_init(struct stackbd_wbcache *c, unsigned int nr_blocks,
+        sector_t capacity, unsigned int boundary, unsigned int max_sectors,
+        unsigned int max_segments);
+
+void stackbd_wbcache_exit(struct stackbd_wbcache *c);
+
+int stackbd_wbcache_bio(struct stackbd_wbcache *c, struct bio *bio, int may_block);
+
+#endif /* STACKBD_H */
@@ -0,0 +1,384 @@
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/gfp.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/bitops.h>
+#include <linux/kthread.h>
+
+#include "stackbd.h"
+
+/*
+ * Write-intent bitmap of the mirror layout. See stackbd.h for the
+ * overview.
+ */
+
+/* how often idle regions are looked for, ms: a bit is cleared on the second look */
+static int bitmap_clear_ms = 5000;
+module_param(bitmap_clear_ms, int, S_IRUGO | S_IWUSR);
+
+#define BITMAP_MAGIC        "STBW"
+#define BITMAP_PAGE_SECTORS (PAGE_SIZE >> 9)
+#define BITMAP_PAGE_BITS    (PAGE_SIZE * 8)
+/* resync copy window: 256K */
+#define BITMAP_BUF_ORDER    (18 - PAGE_SHIFT)
+
+/* the bits follow the header page, as unsigned longs in host order */
+struct bitmap_header {
+    char magic[4];
+    __le32 region_sectors;
+    __le64 nr_regions;
+    __le32 faulty;              /* members that missed writes */
+};
+
+/* the page of the area (after the header page) that holds the bit of region r */
+static unsigned int bitmap_page(unsigned long r)
+{
+    return 1 + r / BITMAP_PAGE_BITS;
+}
+
+static void bitmap_regions(struct stackbd_bitmap *bm, sector_t sector, unsigned int sectors,
+        unsigned long *first, unsigned long *last)
+{
+    *first = sector >> bm->region_shift;
+    *last = (sector + sectors - 1) >> bm->region_shift;
+}
+
+static unsigned int bitmap_faulty(struct stackbd_bitmap *bm)
+{
+    unsigned int i, mask = 0;
+
+    for (i = 0; i < bm->nr; i++)
+        if (ACCESS_ONCE(bm->members[i].faulty))
+            mask |= 1 << i;
+    return mask;
+}
+
+/*
+ * Write the dirty pages of the area to every member that is in use. One
+ * writer at a time: whoever gets the mutex writes the bits of everyone
+ * who got in meanwhile, so the writes are batched under load.
+ */
+static int bitmap_flush(struct stackbd_bitmap *bm)
+{
+    struct stackbd_member *m;
+    unsigned int p, i, ok;
+    int rc = 0;
+
+    mutex_lock(&bm->io_mutex);
+
+    spin_lock_irq(&bm->lock);
+    bitmap_or(bm->busy, bm->busy, bm->dirty, bm->nr_pages);
+    bitmap_zero(bm->dirty, bm->nr_pages);
+    spin_unlock_irq(&bm->lock);
+
+    for (p = find_first_bit(bm->busy, bm->nr_pages); p < bm->nr_pages;
+            p = find_next_bit(bm->busy, bm->nr_pages, p + 1)) {
+        for (i = 0, ok = 0; i < bm->nr; i++) {
+            m = &bm->members[i];
+            if (m->faulty)
+                continue;
+            /* the bit has to be on the disk before the data write goes */
+            if (stackbd_sync_io(m->bdev, WRITE_FUA, bm->offset + p * BITMAP_PAGE_SECTORS,
+                        bm->buf + p * PAGE_SIZE, PAGE_SIZE)) {
+                printk("stackbd: bitmap write error on mirror member %u, member "
+                        "marked faulty\n", i);
+                m->faulty = 1;
+            } else
+                ok++;
+        }
+        atomic_long_inc(&bm->page_writes);
+        if (!ok)
+            rc = -EIO;
+    }
+
+    spin_lock_irq(&bm->lock);
+    bitmap_zero(bm->busy, bm->nr_pages);
+    spin_unlock_irq(&bm->lock);
+
+    mutex_unlock(&bm->io_mutex);
+    return rc;
+}
+
+int stackbd_bitmap_start_write(struct stackbd_bitmap *bm, sector_t sector,
+        unsigned int sectors, int may_block)
+{
+    unsigned long r, first, last, flags;
+    int need = 0, rc;
+
+    bitmap_regions(bm, sector, sectors, &first, &last);
+
+    spin_lock_irqsave(&bm->lock, flags);
+    /* a bit that is set, but not written out yet, has to be waited for as well */
+    for (r = first; r <= last; r++)
+        if (!test_bit(r, bm->bits) || test_bit(bitmap_page(r), bm->dirty) ||
+                test_bit(bitmap_page(r), bm->busy))
+            need = 1;
+    if (need && !may_block) {
+        spin_unlock_irqrestore(&bm->lock, flags);
+        return -EWOULDBLOCK;
+    }
+
+    for (r = first; r <= last; r++) {
+        bm->inflight[r]++;
+        clear_bit(r, bm->clear_pending);
+        if (!__test_and_set_bit(r, bm->bits)) {
+            __set_bit(bitmap_page(r), bm->dirty);
+            bm->nr_dirty++;
+            atomic_long_inc(&bm->bits_set);
+        }
+    }
+    spin_unlock_irqrestore(&bm->lock, flags);
+
+    if (need && (rc = bitmap_flush(bm))) {
+        stackbd_bitmap_end_write(bm, sector, sectors);
+        return rc;
+    }
+    return 0;
+}
+
+/* may be called from IRQ context */
+void stackbd_bitmap_end_write(struct stackbd_bitmap *bm, sector_t sector,
+        unsigned int sectors)
+{
+    unsigned long r, first, last, flags;
+
+    bitmap_regions(bm, sector, sectors, &first, &last);
+
+    spin_lock_irqsave(&bm->lock, flags);
+    for (r = first; r <= last; r++)
+        bm->inflight[r]--;
+    spin_unlock_irqrestore(&bm->lock, flags);
+}
+
+/*
+ * Clear the bits of the regions that have had no write in flight for a
+ * whole period. Nothing is cleared while a member is faulty: it misses
+ * the writes, and has to be resynced.
+ */
+static void bitmap_clear_idle(struct stackbd_bitmap *bm)
+{
+    struct bitmap_header *h = bm->buf;
+    unsigned int faulty;
+    unsigned long r;
+
+    spin_lock_irq(&bm->lock);
+    faulty = bitmap_faulty(bm);
+    if (faulty != le32_to_cpu(h->faulty)) {
+        h->faulty = cpu_to_le32(faulty);
+        __set_bit(0, bm->dirty);
+    }
+
+    if (!faulty)
+        for (r = find_first_bit(bm->bits, bm->nr_regions); r < bm->nr_regions;
+                r = find_next_bit(bm->bits, bm->nr_regions, r + 1)) {
+            if (bm->inflight[r])
+                clear_bit(r, bm->clear_pending);
+            else if (test_and_set_bit(r, bm->clear_pending)) {
+                clear_bit(r, bm->clear_pending);
+                __clear_bit(r, bm->bits);
+                __set_bit(bitmap_page(r), bm->dirty);
+                bm->nr_dirty--;
+                atomic_long_inc(&bm->bits_cleared);
+            }
+        }
+    spin_unlock_irq(&bm->lock);
+
+    bitmap_flush(bm);
+}
+
+static int bitmap_threadfn(void *data)
+{
+    struct stackbd_bitmap *bm = data;
+
+    while (!kthread_should_stop()) {
+        wait_event_interruptible_timeout(bm->wait, kthread_should_stop(),
+                msecs_to_jiffies(max(bitmap_clear_ms, 10)));
+        if (!kthread_should_stop())
+            bitmap_clear_idle(bm);
+    }
+
+    return 0;
+}
+
+/* copy the dirty regions over from the first member that did not miss writes */
+static int bitmap_resync(struct stackbd_bitmap *bm, unsigned int faulty)
+{
+    struct block_device *to[STACKBD_MAX_MEMBERS];
+    struct stackbd_copier cp;
+    unsigned long r, start = stackbd_now();
+    unsigned int src, i, nr_to = 0;
+    sector_t pos, end;
+    int rc = 0;
+
+    for (src = 0; src < bm->nr && (faulty & (1 << src)); src++)
+        ;
+    if (src == bm->nr) {
+        printk("stackbd: every mirror member missed writes, not resyncing\n");
+        return -EIO;
+    }
+    for (i = 0; i < bm->nr; i++)
+        if (i != src)
+            to[nr_to++] = bm->members[i].bdev;
+
+    /* nothing to make way for yet: the device isn't up */
+    memset(&cp, 0, sizeof(cp));
+    if (!(cp.buf = (void *) __get_free_pages(GFP_KERNEL, BITMAP_BUF_ORDER)))
+        return -ENOMEM;
+    cp.buf_sectors = (PAGE_SIZE << BITMAP_BUF_ORDER) >> 9;
+
+    for (r = find_first_bit(bm->bits, bm->nr_regions); r < bm->nr_regions && !rc;
+            r = find_next_bit(bm->bits, bm->nr_regions, r + 1)) {
+        pos = (sector_t) r << bm->region_shift;
+        end = min_t(sector_t, (sector_t) (r + 1) << bm->region_shift, bm->offset);
+        rc = stackbd_copy_range(&cp, bm->members[src].bdev, pos, to, nr_to, pos, end - pos);
+        atomic_long_inc(&bm->resynced);
+    }
+
+    free_pages((unsigned long) cp.buf, BITMAP_BUF_ORDER);
+    printk("stackbd: resynced %ld of %lu regions from member %u in %lu ms: %d\n",
+            atomic_long_read(&bm->resynced), bm->nr_regions, src,
+            (stackbd_now() - start) / NSEC_PER_MSEC, rc);
+    return rc;
+}
+
+/*
+ * Read every member's copy of the bitmap into bm->bits, ORed together.
+ * A member without a valid one has all of its regions dirty. Returns the
+ * members that missed writes.
+ */
+static unsigned int bitmap_load(struct stackbd_bitmap *bm, void *tmp)
+{
+    struct bitmap_header *h = tmp;
+    unsigned int i, faulty = 0;
+
+    bitmap_zero(bm->bits, bm->nr_regions);
+    for (i = 0; i < bm->nr; i++) {
+        if (stackbd_sync_io(bm->members[i].bdev, READ, bm->offset, tmp,
+                    bm->nr_pages * PAGE_SIZE) ||
+                memcmp(h->magic, BITMAP_MAGIC, sizeof(h->magic)) ||
+                le32_to_cpu(h->region_sectors) != bm->region_sectors ||
+                le64_to_cpu(h->nr_regions) != bm->nr_regions) {
+            printk("stackbd: no bitmap on mirror member %u, full resync\n", i);
+            bitmap_fill(bm->bits, bm->nr_regions);
+            continue;
+        }
+        faulty |= le32_to_cpu(h->faulty);
+        bitmap_or(bm->bits, bm->bits, tmp + PAGE_SIZE, bm->nr_regions);
+    }
+
+    return faulty;
+}
+
+int stackbd_bitmap_init(struct stackbd_bitmap *bm, struct stackbd_member *members, int nr,
+        sector_t *capacity, unsigned int region_sectors)
+{
+    struct bitmap_header *h;
+    unsigned int faulty;
+    void *tmp = NULL;
+    int rc;
+
+    memset(bm, 0, sizeof(*bm));
+    if (!is_power_of_2(region_sectors) || region_sectors < BITMAP_PAGE_SECTORS)
+        return -EINVAL;
+
+    /* the area is at the end of every member: header page, then the bits */
+    bm->members = members;
+    bm->nr = nr;
+    bm->region_sectors = region_sectors;
+    bm->region_shift = ilog2(region_sectors);
+    bm->nr_regions = DIV_ROUND_UP(*capacity, region_sectors);
+    bm->nr_pages = 1 + DIV_ROUND_UP(bm->nr_regions, BITMAP_PAGE_BITS);
+    if (*capacity <= (sector_t) bm->nr_pages * BITMAP_PAGE_SECTORS)
+        return -ENOSPC;
+    bm->offset = (*capacity - bm->nr_pages * BITMAP_PAGE_SECTORS) &
+        ~((sector_t) BITMAP_PAGE_SECTORS - 1);
+
+    spin_lock_init(&bm->lock);
+    mutex_init(&bm->io_mutex);
+    init_waitqueue_head(&bm->wait);
+
+    rc = -ENOMEM;
+    bm->order = get_order(bm->nr_pages * PAGE_SIZE);
+    bm->buf = (void *) __get_free_pages(GFP_KERNEL | __GFP_ZERO, bm->order);
+    tmp = (void *) __get_free_pages(GFP_KERNEL, bm->order);
+    bm->inflight = vmalloc(bm->nr_regions * sizeof(*bm->inflight));
+    bm->clear_pending = vmalloc(BITS_TO_LONGS(bm->nr_regions) * sizeof(long));
+    bm->dirty = kzalloc(BITS_TO_LONGS(bm->nr_pages) * sizeof(long), GFP_KERNEL);
+    bm->busy = kzalloc(BITS_TO_LONGS(bm->nr_pages) * sizeof(long), GFP_KERNEL);
+    if (!bm->buf || !tmp || !bm->inflight || !bm->clear_pending || !bm->dirty || !bm->busy)
+        goto error;
+    bm->bits = bm->buf + PAGE_SIZE;
+    memset(bm->inflight, 0, bm->nr_regions * sizeof(*bm->inflight));
+    bitmap_zero(bm->clear_pending, bm->nr_regions);
+
+    faulty = bitmap_load(bm, tmp);
+    if (!bitmap_empty(bm->bits, bm->nr_regions) && (rc = bitmap_resync(bm, faulty)))
+        goto error;
+
+    /* all in sync: a fresh bitmap goes to every member */
+    h = bm->buf;
+    memcpy(h->magic, BITMAP_MAGIC, sizeof(h->magic));
+    h->region_sectors = cpu_to_le32(region_sectors);
+    h->nr_regions = cpu_to_le64(bm->nr_regions);
+    h->faulty = 0;
+    bitmap_zero(bm->bits, bm->nr_regions);
+    bitmap_fill(bm->dirty, bm->nr_pages);
+    if ((rc = bitmap_flush(bm)))
+        goto error;
+
+    bm->thread = kthread_run(bitmap_threadfn, bm, "stackbd_bitmap");
+    if (IS_ERR(bm->thread)) {
+        rc = PTR_ERR(bm->thread);
+        goto error;
+    }
+
+    free_pages((unsigned long) tmp, bm->order);
+    *capacity = bm->offset;
+    printk("stackbd: write-intent bitmap: %lu regions of %u sectors, %u pages at %llu\n",
+            bm->nr_regions, region_sectors, bm->nr_pages, (unsigned long long) bm->offset);
+    return 0;
+
+error:
+    if (tmp)
+        free_pages((unsigned long) tmp, bm->order);
+    bm->thread = NULL;
+    stackbd_bitmap_exit(bm);
+    return rc;
+}
+
+void stackbd_bitmap_exit(struct stackbd_bitmap *bm)
+{
+    struct bitmap_header *h = bm->buf;
+
+    if (bm->thread) {
+        kthread_stop(bm->thread);
+        bm->thread = NULL;
+
+        /* a clean shutdown: everything is in sync, unless a member is faulty */
+        spin_lock_irq(&bm->lock);
+        h->faulty = cpu_to_le32(bitmap_faulty(bm));
+        __set_bit(0, bm->dirty);
+        if (!h->faulty) {
+            bm->nr_dirty = 0;
+            bitmap_zero(bm->bits, bm->nr_regions);
+            bitmap_fill(bm->dirty, bm->nr_pages);
+        }
+        spin_unlock_irq(&bm->lock);
+        bitmap_flush(bm);
+    }
+
+    if (bm->buf)
+        free_pages((unsigned long) bm->buf, bm->order);
+    vfree(bm->inflight);
+    vfree(bm->clear_pending);
+    kfree(bm->dirty);
+    kfree(bm->busy);
+    bm->buf = NULL;
+    bm->inflight = NULL;
+    bm->clear_pending = NULL;
+    bm->dirty = bm->busy = NULL;
+}
@@ -11,21 +11,28 @@
 #include <linux/blkdev.h>
 #include <linux/hdreg.h>
 #include <linux/kthread.h>
+#include <linux/delay.h>
+#include <linux/sched.h>
+#include <linux/bio.h>
+#include <linux/completion.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
 
 #include <trace/events/block.h>
 
-#define DEVNAME "stackbd"
+#include "stackbd.h"
+
 #define DEVNAME_0 "stackbd0"
+#define DEVNAME_SNAP "stackbd0s"
+#define PROC_ENTRY "stackbd"
 #define STACKBD_DO_IT 1000
+/* move the linear layout over to the device named by the argument, online */
+#define STACKBD_MIGRATE 1001
 
 #define STACKBD_BDEV_MODE (FMODE_READ | FMODE_WRITE | FMODE_EXCL)
 #define DEBUGGG printk("stackbd: %d\n", __LINE__);
-/*
- * We can tweak our hardware sector size, but the kernel talks to us
- * in terms of small sectors, always.
- */
-#define KERNEL_SECTOR_SIZE 512
-
+/* define to trace every bio passing through make_request */
+/* #define STACKBD_DEBUG 1 */
 
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -34,9 +41,107 @@ module_param(major_num, int, 0);
 static int LOGICAL_BLOCK_SIZE = 512;
 module_param(LOGICAL_BLOCK_SIZE, int, 0);
 
+/* the backing device, or a comma-separated list of them */
 char targetname[256];
 module_param_string(target, targetname, sizeof(targetname), 0);
 
+/*
+ * How the address space is laid out over the targets:
+ *  0 - linear: a single target;
+ *  1 - stripe (RAID0): chunks of stripe_sectors are spread over the
+ *      targets round-robin;
+ *  2 - mirror (RAID1): every target holds a full copy (stackbd_mirror.c);
+ *  3 - tier: a fast and a slow target, hot chunks are moved to the fast
+ *      one (stackbd_tier.c).
+ */
+#define LAYOUT_LINEAR   0
+#define LAYOUT_STRIPE   1
+#define LAYOUT_MIRROR   2
+#define LAYOUT_TIER     3
+
+static int layout = LAYOUT_LINEAR;
+module_param(layout, int, S_IRUGO);
+static int stripe_sectors = 128;
+module_param(stripe_sectors, int, S_IRUGO);
+/* tier layout: the unit of migration */
+static int tier_chunk_sectors = 2048;
+module_param(tier_chunk_sectors, int, S_IRUGO);
+
+/*
+ * Submission policy for incoming bios:
+ *  0 - always hand the bio over to the worker thread;
+ *  1 - adaptive: submit inline from make_request() when the device is idle,
+ *      defer to the worker under load or when the stack is getting deep;
+ *  2 - always submit inline.
+ */
+#define INLINE_NEVER    0
+#define INLINE_ADAPTIVE 1
+#define INLINE_ALWAYS   2
+
+static int inline_mode = INLINE_ADAPTIVE;
+module_param(inline_mode, int, S_IRUGO | S_IWUSR);
+/* adaptive mode: submit inline only while fewer clones than this are in flight */
+static int inline_max_inflight = 1;
+module_param(inline_max_inflight, int, S_IRUGO | S_IWUSR);
+/* adaptive mode: defer to the worker when less stack (bytes) than this is left */
+static int inline_min_stack = 2048;
+module_param(inline_min_stack, int, S_IRUGO | S_IWUSR);
+
+/*
+ * Thin provisioning: the target is split into a metadata area and a data
+ * area, and virtual chunks get physical chunks allocated on first write.
+ */
+static int thin = 0;
+module_param(thin, int, S_IRUGO);
+static int chunk_sectors = 128;
+module_param(chunk_sectors, int, S_IRUGO);
+static int meta_sectors = 256;
+module_param(meta_sectors, int, S_IRUGO);
+/* size of the thin device when first formatted, 0 - same as the data area */
+static ulong virtual_sectors = 0;
+module_param(virtual_sectors, ulong, S_IRUGO);
+
+/* size of the RAM write-back cache in front of the layout (MB), 0 - none */
+static int cache_mb = 0;
+module_param(cache_mb, int, S_IRUGO);
+
+/*
+ * null_io: the clones are completed in the remap path, after
+ * null_latency_us, instead of being sent to the targets. Measures what
+ * the stacking costs on its own; the targets still set the geometry and
+ * hold the metadata (thin map, bitmap, tier table).
+ */
+static int null_io = 0;
+module_param(null_io, int, S_IRUGO | S_IWUSR);
+static int null_latency_us = 0;
+module_param(null_latency_us, int, S_IRUGO | S_IWUSR);
+
+/*
+ * Mirror layout: keep a write-intent bitmap at the end of the members, so
+ * that only the regions written to at the time of a crash are resynced.
+ */
+static int mirror_bitmap = 0;
+module_param(mirror_bitmap, int, S_IRUGO);
+static int bitmap_region_sectors = 2048;
+module_param(bitmap_region_sectors, int, S_IRUGO);
+
+/*
+ * Writes of nothing but zeroes: 0 - written as they are; 1 - dropped when
+ * they are to unallocated thin chunks, and sent as discards to targets
+ * that read back zeroes after one.
+ */
+static int zero_detect = 0;
+module_param(zero_detect, int, S_IRUGO | S_IWUSR);
+
+/*
+ * Copy-on-write snapshot, taken at start: the device to keep the old
+ * contents of overwritten chunks in. The snapshot is the stackbd0s disk.
+ */
+static char cowname[256];
+module_param_string(cow_target, cowname, sizeof(cowname), 0);
+static int snap_chunk_sectors = 16;
+module_param(snap_chunk_sectors, int, S_IRUGO);
+
 /*
  * The internal representation of our device.
  */
@@ -44,84 +149,781 @@ static struct stackbd_t {
     sector_t capacity; /* Sectors */
     struct gendisk *gd;
     spinlock_t lock;
-    struct bio_list bio_list;    
+    /* bios waiting for the worker -- protected by lock */
+    struct stackbd_sched sched;
     struct task_struct *thread;
     int is_active;
     struct block_device *bdev_raw;
     /* Our request queue */
     struct request_queue *queue;
+
+    /* the targets; bdev_raw is the first one. After a migration, the slot
+       of the old linear target is left empty (NULL bdev) */
+    struct stackbd_member members[STACKBD_MAX_MEMBERS];
+    int nr_members;
+    unsigned int stripe_shift;
+
+    /* hedged reads whose timer went off -- protected by lock */
+    struct list_head hedge_list;
+    /* bios submitted to the targets and not completed yet */
+    atomic_t inflight;
+    /* woken when inflight drops to 0, for stackbd_exit() */
+    wait_queue_head_t idle_wait;
+    /* submission policy statistics */
+    atomic_long_t nr_inline;
+    atomic_long_t nr_deferred;
+    /* zero detection: bytes scanned and the time it took, bytes not written */
+    atomic_long_t zero_scanned;
+    atomic_long_t zero_scan_ns;
+    atomic_long_t zero_writes;
+    atomic_long_t zero_unmapped;
+    atomic_long_t zero_discarded;
+
+    /* bios must not cross multiples of this (sectors, power of 2), 0 - no limit */
+    unsigned int boundary;
+    /* virtual to physical translation, if thin */
+    struct stackbd_map map;
+    /* write-back cache, if cache_mb */
+    struct stackbd_wbcache cache;
+    /* hot/cold remapping, if LAYOUT_TIER */
+    struct stackbd_tier tier;
+    /* regions of the mirror with writes in flight, if mirror_bitmap */
+    struct stackbd_bitmap bitmap;
+    /* the target of LAYOUT_LINEAR, and moving it to another device */
+    struct stackbd_migrate mig;
+    /* the snapshot and its disk, if cow_target */
+    struct stackbd_snap snap;
+    struct gendisk *snap_gd;
+    struct request_queue *snap_queue;
+    unsigned int snap_boundary;
 } stackbd;
 
 static DECLARE_WAIT_QUEUE_HEAD(req_event);
 
 #define trace_block_bio_remap trace_block_remap
 
+/* nr: the number of references, one per clone to be submitted */
+struct stackbd_io *stackbd_io_alloc(struct bio *bio, int nr)
+{
+    struct stackbd_io *io;
+
+    io = kmalloc(sizeof(*io) + nr * sizeof(io->clone[0]), GFP_NOIO);
+    if (!io)
+        return NULL;
+
+    io->bio = bio;
+    atomic_set(&io->pending, nr);
+    atomic_set(&io->nr_ok, 0);
+    io->error = 0;
+    io->flags = 0;
+    io->done = 0;
+    io->ep = NULL;
+    atomic_inc(&stackbd.inflight);
+    return io;
+}
+
+/* a mirror read that failed can still be served by another member */
+static int stackbd_can_retry(struct bio *bio)
+{
+    int i;
+
+    if (layout != LAYOUT_MIRROR || bio_data_dir(bio) != READ)
+        return 0;
+
+    for (i = 0; i < stackbd.nr_members; i++)
+        if (!stackbd.members[i].faulty)
+            return 1;
+    return 0;
+}
+
+/* drop a reference, completing the original bio with the last one */
+void stackbd_io_put(struct stackbd_io *io, int error)
+{
+    unsigned long flags;
+
+    if (error)
+        io->error = error;
+
+    if (!atomic_dec_and_test(&io->pending))
+        return;
+
+    if (!io->done) {
+        if ((io->flags & STACKBD_IO_ANY_OK) && atomic_read(&io->nr_ok))
+            io->error = 0;
+
+        if (!io->error && (io->flags & STACKBD_IO_PREFLUSH)) {
+            /* the members' caches are flushed: now the data, through the worker */
+            io->bio->bi_rw &= ~REQ_FLUSH;
+            spin_lock_irqsave(&stackbd.lock, flags);
+            stackbd_sched_add(&stackbd.sched, io->bio, stackbd_bio_class(io->bio));
+            wake_up(&req_event);
+            spin_unlock_irqrestore(&stackbd.lock, flags);
+        } else if (io->error && stackbd_can_retry(io->bio)) {
+            /* the failed member is marked faulty, the worker goes elsewhere */
+            spin_lock_irqsave(&stackbd.lock, flags);
+            stackbd_sched_add(&stackbd.sched, io->bio, stackbd_bio_class(io->bio));
+            wake_up(&req_event);
+            spin_unlock_irqrestore(&stackbd.lock, flags);
+        } else {
+            bio_endio(io->bio, io->error);
+        }
+    }
+
+    if (io->ep)
+        stackbd_epoch_exit(io->ep, io->epoch);
+    if (io->flags & STACKBD_IO_BITMAP)
+        stackbd_bitmap_end_write(&stackbd.bitmap, io->sector, io->size >> 9);
+    kfree(io);
+    if (atomic_dec_and_test(&stackbd.inflight))
+        wake_up(&stackbd.idle_wait);
+}
+
 static void stackbd_endio(struct bio *cloned_bio, int error)
 {
-//FIXME:    struct bio *bio = cloned_bio->bi_private;
-//FIXME:  int uptodate = test_bit(BIO_UPTODATE, &cloned_bio->bi_flags);
+    struct stackbd_clone *c = cloned_bio->bi_private;
+    struct stackbd_io *io = c->io;
+    char name[BDEVNAME_SIZE];
+
+    if (!error && !test_bit(BIO_UPTODATE, &cloned_bio->bi_flags))
+        error = -EIO;
+
+#ifdef STACKBD_DEBUG
+    pr_info("%s: endio -- size: %u -- error: %d -- in_inter: %lu\n",
+        DEVNAME, cloned_bio->bi_size, error, in_interrupt());
+#endif
+
+    atomic_dec(&c->m->inflight);
+
+    if (!error) {
+        atomic_inc(&io->nr_ok);
+        if (bio_data_dir(cloned_bio) == READ)
+            stackbd_member_account(c->m, stackbd_now() - c->start);
+    } else if (layout == LAYOUT_MIRROR && !xchg(&c->m->faulty, 1)) {
+        printk("stackbd: I/O error %d on %s, member marked faulty\n",
+                error, bdevname(c->m->bdev, name));
+    } else if (layout == LAYOUT_LINEAR) {
+        error = stackbd_migrate_endio(&stackbd.mig, c->m, error);
+    }
+
+    if (c->bounce)
+        stackbd_mirror_read_done(c, cloned_bio, error);
+    else
+        bio_put(cloned_bio);
+
+    stackbd_io_put(io, error);
+}
+
+struct stackbd_sync {
+    struct completion done;
+    int error;
+};
+
+static void stackbd_sync_endio(struct bio *bio, int error)
+{
+    struct stackbd_sync *sync = bio->bi_private;
 
-    pr_info("%s: endio -- size: %u\n", DEVNAME, cloned_bio->bi_size);
+    if (!error && !test_bit(BIO_UPTODATE, &bio->bi_flags))
+        error = -EIO;
+    sync->error = error;
+    complete(&sync->done);
+}
 
 /*
-    pr_info("%s: endio -- size: %u -- up-to-date: %d-- error: %d -- in_inter: %lu\n", 
-        DEVNAME, cloned_bio->bi_size, uptodate, error, in_interrupt());
-*/
-    bio_put(cloned_bio);
+ * Synchronous I/O for the metadata kept on the target. The buffer must
+ * come from the page allocator or kmalloc(). Issued as a sequence of bios,
+ * each as large as the target queue accepts.
+ */
+int stackbd_sync_io(struct block_device *bdev, int rw, sector_t sector,
+        void *buf, unsigned int len)
+{
+    struct stackbd_sync sync;
+    struct bio *bio;
+    unsigned int off, n;
 
-#if 0
-    bio_endio(bio, error);
+    while (len)
+    {
+        bio = bio_alloc(GFP_NOIO, min_t(unsigned int, BIO_MAX_PAGES,
+                    DIV_ROUND_UP(offset_in_page(buf) + len, PAGE_SIZE)));
+        if (!bio)
+            return -ENOMEM;
+
+        bio->bi_bdev = bdev;
+        bio->bi_sector = sector;
+        bio->bi_end_io = stackbd_sync_endio;
+        bio->bi_private = &sync;
+
+        while (len)
+        {
+            off = offset_in_page(buf);
+            n = min_t(unsigned int, len, PAGE_SIZE - off);
+            if (bio_add_page(bio, virt_to_page(buf), n, off) != n)
+                break;
+            buf += n;
+            len -= n;
+        }
+
+        if (!bio->bi_size)
+        {
+            bio_put(bio);
+            return -EIO;
+        }
+        sector += bio->bi_size >> 9;
+
+        init_completion(&sync.done);
+        submit_bio(rw, bio);
+        wait_for_completion(&sync.done);
+        bio_put(bio);
+
+        if (sync.error)
+            return sync.error;
+    }
+
+    return 0;
+}
+
+#define STACKBD_COPY_BACKOFF_MS 10
+
+static void stackbd_copy_pause(struct stackbd_copier *cp, unsigned int ms)
+{
+    msleep(ms);
+    if (cp->throttled_ms)
+        atomic_long_add(ms, cp->throttled_ms);
+}
+
+int stackbd_copy_range(struct stackbd_copier *cp, struct block_device *from,
+        sector_t from_sector, struct block_device **to, int nr_to,
+        sector_t to_sector, sector_t sectors)
+{
+    /* the mirror resync runs at start-up, in the ioctl's context */
+    int kthread = current->flags & PF_KTHREAD;
+    unsigned long start, ns, elapsed;
+    unsigned int n;
+    sector_t done;
+    int i, mbps, rc;
+
+    for (done = 0; done < sectors; done += n)
+    {
+        /* foreground I/O first */
+        while (cp->inflight && atomic_read(cp->inflight) > ACCESS_ONCE(*cp->busy_inflight) &&
+                !(kthread && kthread_should_stop()))
+            stackbd_copy_pause(cp, STACKBD_COPY_BACKOFF_MS);
+        if (kthread && kthread_should_stop())
+            return -EINTR;
+
+        n = min_t(sector_t, sectors - done, cp->buf_sectors);
+        start = stackbd_now();
+        if (cp->window && (rc = cp->window(cp, from_sector + done, n)))
+            return rc;
+
+        rc = stackbd_sync_io(from, READ, from_sector + done, cp->buf, n << 9);
+        for (i = 0; i < nr_to && !rc; i++)
+            rc = stackbd_sync_io(to[i], WRITE, to_sector + done, cp->buf, n << 9);
+
+        if (cp->window_done)
+            cp->window_done(cp, from_sector + done, n);
+        if (rc)
+            return rc;
+        if (cp->copied_sectors)
+            atomic_long_add(n, cp->copied_sectors);
+
+        /* n sectors at mbps take n * 512 * 1000 / mbps ns */
+        mbps = cp->mbps ? ACCESS_ONCE(*cp->mbps) : 0;
+        if (mbps > 0)
+        {
+            ns = (unsigned long) n * KERNEL_SECTOR_SIZE * 1000 / mbps;
+            elapsed = stackbd_now() - start;
+            if (elapsed < ns)
+                stackbd_copy_pause(cp, DIV_ROUND_UP(ns - elapsed, NSEC_PER_MSEC));
+        }
+    }
+
+    return 0;
+}
+
+void stackbd_epoch_init(struct stackbd_epoch *ep)
+{
+    ep->cur = 0;
+    atomic_set(&ep->count[0], 0);
+    atomic_set(&ep->count[1], 0);
+    init_waitqueue_head(&ep->wait);
+}
 
-   pr_info("%s: endio -- size: %u -- up-to-date: %d-- error: %d -- in_inter: %lu -- comm: %s\n", 
-        DEVNAME, bio->bi_size, uptodate, error, in_interrupt(), current->comm);
+int stackbd_epoch_enter(struct stackbd_epoch *ep)
+{
+    int e;
+
+    for (;;)
+    {
+        e = ACCESS_ONCE(ep->cur);
+        atomic_inc(&ep->count[e]);
+        smp_mb__after_atomic_inc();
+        /* counted after the switch: the drain may have missed us */
+        if (ACCESS_ONCE(ep->cur) == e)
+            return e;
+        stackbd_epoch_exit(ep, e);
+    }
+}
+
+void stackbd_epoch_exit(struct stackbd_epoch *ep, int epoch)
+{
+    if (atomic_dec_and_test(&ep->count[epoch]))
+        wake_up(&ep->wait);
+}
+
+void stackbd_epoch_drain(struct stackbd_epoch *ep)
+{
+    int old = ep->cur;
+
+    smp_mb();
+    ACCESS_ONCE(ep->cur) = !old;
+    smp_mb();
+    wait_event(ep->wait, !atomic_read(&ep->count[old]));
+}
+
+struct stackbd_null {
+    struct hrtimer timer;
+    struct bio *bio;
+};
+
+static enum hrtimer_restart stackbd_null_timer(struct hrtimer *timer)
+{
+    struct stackbd_null *n = container_of(timer, struct stackbd_null, timer);
+
+    bio_endio(n->bio, 0);
+    kfree(n);
+    return HRTIMER_NORESTART;
+}
+
+/* null_io: complete b at once, or when the simulated latency is up */
+static void stackbd_null(struct bio *b)
+{
+    struct stackbd_null *n;
+
+    if (null_latency_us <= 0 || !(n = kmalloc(sizeof(*n), GFP_NOIO)))
+    {
+        bio_endio(b, 0);
+        return;
+    }
+
+    n->bio = b;
+    hrtimer_init(&n->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    n->timer.function = stackbd_null_timer;
+    hrtimer_start(&n->timer, ns_to_ktime((u64) null_latency_us * NSEC_PER_USEC),
+            HRTIMER_MODE_REL);
+}
+
+/*
+ * Submit b as clone i of io, to member m at the given sector. The original
+ * bio is not looked at: for hedged reads, it may already be completed.
+ */
+void stackbd_io_dispatch(struct stackbd_io *io, int i, struct stackbd_member *m,
+        sector_t sector, struct bio *b)
+{
+#ifdef STACKBD_DEBUG
+    printk("stackdb: Mapping sector: -> %llu, dev: -> %s\n",
+            (unsigned long long) sector, m->bdev->bd_disk->disk_name);
 #endif
+
+    io->clone[i].io = io;
+    io->clone[i].m = m;
+    io->clone[i].start = stackbd_now();
+
+    b->bi_sector = sector;
+    b->bi_bdev = m->bdev;
+    b->bi_end_io = stackbd_endio;
+    b->bi_private = &io->clone[i];
+
+    atomic_inc(&m->inflight);
+    atomic_long_inc(&m->ios);
+    atomic_long_add(bio_sectors(b), &m->sectors);
+
+    if (null_io)
+    {
+        /* bounce pages would be copied out as they are */
+        if (io->clone[i].bounce)
+            zero_fill_bio(b);
+        stackbd_null(b);
+        return;
+    }
+
+    /* stackbd_endio() completes the original bio */
+    generic_make_request(b);
 }
 
-static void stackbd_io_clone(struct bio *bio)
+/* m reads back zeroes after a discard of these sectors */
+static int stackbd_discard_zeroes(struct stackbd_member *m, sector_t sector,
+        unsigned int sectors)
 {
-    struct bio *cloned_bio = bio_clone(bio, GFP_NOIO); 
+    struct request_queue *q = bdev_get_queue(m->bdev);
+    unsigned int g = max(q->limits.discard_granularity >> 9, 1U);
+
+    /* a discard of part of a granule may be ignored altogether */
+    return blk_queue_discard(q) && queue_discard_zeroes_data(q) &&
+        sectors <= q->limits.max_discard_sectors &&
+        !sector_div(sector, g) && !(sectors % g);
+}
+
+/* submit a clone of the original bio as clone i of io */
+void stackbd_io_clone(struct stackbd_io *io, int i,
+        struct stackbd_member *m, sector_t sector)
+{
+    struct bio *bio = io->bio;
+    struct bio *cloned_bio;
+
+    if (io->flags & STACKBD_IO_PREFLUSH)
+    {
+        if ((cloned_bio = bio_alloc(GFP_NOIO, 0)))
+            cloned_bio->bi_rw = WRITE_FLUSH;
+    }
+    else if ((io->flags & STACKBD_IO_ZERO) &&
+            stackbd_discard_zeroes(m, sector, bio_sectors(bio)) &&
+            (cloned_bio = bio_alloc(GFP_NOIO, 0)))
+    {
+        cloned_bio->bi_rw = WRITE | REQ_DISCARD;
+        cloned_bio->bi_size = bio->bi_size;
+        atomic_long_add(bio->bi_size, &stackbd.zero_discarded);
+    }
+    else
+        cloned_bio = bio_clone(bio, GFP_NOIO);
+
+    if (!cloned_bio)
+    {
+        stackbd_io_put(io, -ENOMEM);
+        return;
+    }
 
-//    printk("stackdb: Mapping sector: %llu -> %llu, dev: %s -> %s\n",
-//            bio->bi_sector,
-//            lba != EMPTY_REAL_LBA ? lba : bio->bi_sector,
-//            bio->bi_bdev->bd_disk->disk_name,
-//            bdev_raw->bd_disk->disk_name);
-//
-//    if (lba != EMPTY_REAL_LBA)
-//        bio->bi_sector = lba;
 #if 0
-    trace_block_bio_remap(bdev_get_queue(stackbd.bdev_raw), bio,
+    trace_block_bio_remap(bdev_get_queue(m->bdev), bio,
             bio->bi_bdev->bd_dev, bio->bi_sector);
 #endif
 
-    cloned_bio->bi_bdev = stackbd.bdev_raw;
-    cloned_bio->bi_end_io = stackbd_endio;
-    cloned_bio->bi_private = bio;
+    io->clone[i].bounce = 0;
+    stackbd_io_dispatch(io, i, m, sector, cloned_bio);
+}
+
+/* the hedge timer of io went off -- hard IRQ context */
+void stackbd_queue_hedge(struct stackbd_io *io)
+{
+    unsigned long flags;
 
-    /* No need to call bio_endio() */
-    generic_make_request(cloned_bio);
+    spin_lock_irqsave(&stackbd.lock, flags);
+    list_add_tail(&io->list, &stackbd.hedge_list);
+    wake_up(&req_event);
+    spin_unlock_irqrestore(&stackbd.lock, flags);
 }
 
-static void stackbd_io_fn(struct bio *bio)
+/* stripe: translate sector to the member's address space */
+static struct stackbd_member *stackbd_stripe_map(sector_t *sector)
 {
-//    printk("stackdb: Mapping sector: %llu -> %llu, dev: %s -> %s\n",
-//            bio->bi_sector,
-//            lba != EMPTY_REAL_LBA ? lba : bio->bi_sector,
-//            bio->bi_bdev->bd_disk->disk_name,
-//            bdev_raw->bd_disk->disk_name);
-//
-//    if (lba != EMPTY_REAL_LBA)
-//        bio->bi_sector = lba;
+    unsigned int shift = stackbd.stripe_shift;
+    sector_t chunk = *sector >> shift;
+    sector_t offset = *sector & ((1 << shift) - 1);
+    unsigned int idx;
 
-    bio->bi_bdev = stackbd.bdev_raw;
+    /* sector_div() leaves the quotient in chunk, returns the remainder */
+    idx = sector_div(chunk, stackbd.nr_members);
+    *sector = (chunk << shift) + offset;
 
-    trace_block_bio_remap(bdev_get_queue(stackbd.bdev_raw), bio,
-            bio->bi_bdev->bd_dev, bio->bi_sector);
+    return &stackbd.members[idx];
+}
 
-    /* No need to call bio_endio() */
-    generic_make_request(bio);
+/* bytes of kernel stack left below the current frame */
+static unsigned long stackbd_stack_left(void)
+{
+    unsigned long sp = (unsigned long) &sp;
+
+    return sp - (unsigned long) end_of_stack(current);
 }
 
+/*
+ * Decide whether make_request() may submit the bio itself instead of
+ * waking up the worker. Inline submission saves a context switch and the
+ * wakeup latency, which dominate at low queue depth; the worker is still
+ * preferred when there is a backlog (so bios are not reordered behind it),
+ * and in contexts where the stack may already be deep: memory reclaim
+ * and atomic callers.
+ */
+static int stackbd_can_inline(void)
+{
+    switch (inline_mode)
+    {
+    case INLINE_NEVER:
+        return 0;
+    case INLINE_ALWAYS:
+        return 1;
+    }
+
+    if (in_interrupt() || irqs_disabled() || (current->flags & PF_MEMALLOC))
+        return 0;
+
+    if (stackbd_stack_left() < inline_min_stack)
+        return 0;
+
+    /* racy read: the worker backlog is only a hint */
+    if (ACCESS_ONCE(stackbd.sched.queued))
+        return 0;
+
+    return atomic_read(&stackbd.inflight) < inline_max_inflight;
+}
+
+/*
+ * Word-at-a-time scan: eight words are ORed together per test, so there
+ * is a single branch per 64 bytes (32 on 32-bit) of zeroes.
+ */
+static int stackbd_buf_is_zero(const void *buf, unsigned int len)
+{
+    const unsigned long *w = buf;
+    const unsigned char *b;
+    unsigned int n = len / sizeof(long);
+
+    for (; n >= 8; n -= 8, w += 8)
+        if (w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7])
+            return 0;
+    for (; n; n--, w++)
+        if (*w)
+            return 0;
+    for (b = (const unsigned char *) w; b < (const unsigned char *) buf + len; b++)
+        if (*b)
+            return 0;
+    return 1;
+}
+
+/* a write (not a flush or FUA write) with nothing but zeroes in it */
+static int stackbd_bio_is_zero(struct bio *bio)
+{
+    unsigned long flags, start;
+    struct bio_vec *bv;
+    int i, zero = 1;
+    char *data;
+
+    if (bio_data_dir(bio) != WRITE || !bio->bi_size ||
+            (bio->bi_rw & (REQ_FLUSH | REQ_FUA | REQ_DISCARD)))
+        return 0;
+
+    start = stackbd_now();
+    bio_for_each_segment(bv, bio, i)
+    {
+        data = bvec_kmap_irq(bv, &flags);
+        zero = stackbd_buf_is_zero(data, bv->bv_len);
+        bvec_kunmap_irq(data, &flags);
+        if (!zero)
+            break;
+    }
+
+    atomic_long_add(bio->bi_size, &stackbd.zero_scanned);
+    atomic_long_add(stackbd_now() - start, &stackbd.zero_scan_ns);
+    return zero;
+}
+
+/* remap the bio to the target and submit it -- see stackbd_io_submit() */
+static int stackbd_layout_submit(struct bio *bio, int may_block)
+{
+    sector_t sector = bio->bi_sector;
+    struct stackbd_member *m, *ms[2];
+    struct stackbd_io *io;
+    int i, rc, epoch;
+    int zero = zero_detect && stackbd_bio_is_zero(bio);
+    u64 pchunk;
+
+    if (zero)
+        atomic_long_inc(&stackbd.zero_writes);
+
+    /* an unallocated chunk reads back zeroes already */
+    if (thin && zero && stackbd_map_lookup(&stackbd.map,
+                bio->bi_sector >> stackbd.map.chunk_shift, &pchunk))
+    {
+        atomic_long_add(bio->bi_size, &stackbd.zero_unmapped);
+        bio_endio(bio, 0);
+        return 0;
+    }
+
+    /*
+     * A flush with data: striped or tiered, the data goes to one member,
+     * but the caches of all of them have to be flushed first. As dm does
+     * it, an empty flush goes to every member, and once they are all done
+     * the data follows without REQ_FLUSH (see stackbd_io_put()).
+     */
+    if ((bio->bi_rw & REQ_FLUSH) && bio->bi_size && stackbd.nr_members > 1 &&
+            (layout == LAYOUT_STRIPE || layout == LAYOUT_TIER))
+    {
+        if (!(io = stackbd_io_alloc(bio, stackbd.nr_members)))
+            goto nomem;
+        io->flags |= STACKBD_IO_PREFLUSH;
+        for (i = 0; i < stackbd.nr_members; i++)
+            stackbd_io_clone(io, i, &stackbd.members[i], 0);
+        return 0;
+    }
+
+    /* empty flushes have no sector to translate */
+    if (thin && bio->bi_size)
+    {
+        rc = stackbd_map_bio(&stackbd.map, bio, &sector, may_block);
+        if (rc == -EWOULDBLOCK)
+            return rc;
+        if (rc == STACKBD_MAP_DONE)
+            return 0;
+        if (rc < 0)
+        {
+            bio_endio(bio, rc);
+            return 0;
+        }
+    }
+
+    /* a migration sends writes and flushes to the new target as well */
+    if (layout == LAYOUT_LINEAR)
+    {
+        rc = stackbd_migrate_map(&stackbd.mig, bio, sector, may_block, ms, &epoch);
+        if (rc == -EWOULDBLOCK)
+            return rc;
+        if (!(io = stackbd_io_alloc(bio, rc)))
+        {
+            stackbd_epoch_exit(&stackbd.mig.epoch, epoch);
+            goto nomem;
+        }
+        io->ep = &stackbd.mig.epoch;
+        io->epoch = epoch;
+        if (zero)
+            io->flags |= STACKBD_IO_ZERO;
+        for (i = 0; i < rc; i++)
+            stackbd_io_clone(io, i, ms[i], sector);
+        return 0;
+    }
+
+    /* a flush without data has to reach every target */
+    if (!bio->bi_size)
+    {
+        if (!(io = stackbd_io_alloc(bio, stackbd.nr_members)))
+            goto nomem;
+        /* a mirror stays consistent as long as one member has the data */
+        if (layout == LAYOUT_MIRROR)
+            io->flags |= STACKBD_IO_ANY_OK;
+        for (i = 0; i < stackbd.nr_members; i++)
+        {
+            if (layout == LAYOUT_MIRROR && stackbd.members[i].faulty)
+                stackbd_io_put(io, -EIO);
+            else
+                stackbd_io_clone(io, i, &stackbd.members[i], 0);
+        }
+        return 0;
+    }
+
+    if (layout == LAYOUT_MIRROR)
+    {
+        if (mirror_bitmap && bio_data_dir(bio) == WRITE)
+        {
+            rc = stackbd_bitmap_start_write(&stackbd.bitmap, sector, bio_sectors(bio),
+                    may_block);
+            if (rc == -EWOULDBLOCK)
+                return rc;
+            if (rc)
+            {
+                bio_endio(bio, rc);
+                return 0;
+            }
+        }
+        stackbd_mirror_submit(stackbd.members, stackbd.nr_members, bio, sector,
+                mirror_bitmap ? &stackbd.bitmap : NULL);
+        return 0;
+    }
+
+    if (layout == LAYOUT_TIER)
+    {
+        rc = stackbd_tier_map(&stackbd.tier, bio, may_block, &m, &sector, &epoch);
+        if (rc == -EWOULDBLOCK)
+            return rc;
+        if (rc < 0)
+        {
+            bio_endio(bio, rc);
+            return 0;
+        }
+        if (!(io = stackbd_io_alloc(bio, 1)))
+        {
+            stackbd_epoch_exit(&stackbd.tier.epoch, epoch);
+            goto nomem;
+        }
+        /* the migration waits for the bio until it completes */
+        io->ep = &stackbd.tier.epoch;
+        io->epoch = epoch;
+        if (zero)
+            io->flags |= STACKBD_IO_ZERO;
+        stackbd_io_clone(io, 0, m, sector);
+        return 0;
+    }
+
+    m = stackbd_stripe_map(&sector);
+
+    if (!(io = stackbd_io_alloc(bio, 1)))
+        goto nomem;
+    if (zero)
+        io->flags |= STACKBD_IO_ZERO;
+    stackbd_io_clone(io, 0, m, sector);
+    return 0;
+
+nomem:
+    bio_endio(bio, -ENOMEM);
+    return 0;
+}
+
+void stackbd_lower_submit(struct bio *bio)
+{
+    stackbd_layout_submit(bio, 1);
+}
+
+/* the cache, then the layout -- see stackbd_io_submit() */
+static int stackbd_upper_io(struct bio *bio, int may_block)
+{
+    int rc;
+
+    if (cache_mb)
+    {
+        rc = stackbd_wbcache_bio(&stackbd.cache, bio, may_block);
+        if (rc == -EWOULDBLOCK)
+            return rc;
+        if (rc == STACKBD_CACHE_DONE)
+            return 0;
+    }
+
+    return stackbd_layout_submit(bio, may_block);
+}
+
+void stackbd_upper_submit(struct bio *bio)
+{
+    stackbd_upper_io(bio, 1);
+}
+
+/*
+ * Pass the bio through the snapshot, the cache and the layout, and submit
+ * it. Returns -EWOULDBLOCK when the bio can't be handled without sleeping
+ * and may_block is not set; the caller then passes it on to the worker
+ * thread. Otherwise the bio is taken care of, including errors.
+ */
+static int stackbd_io_submit(struct bio *bio, int may_block)
+{
+    /* the first write to a chunk waits for the old contents to be copied */
+    if (stackbd.snap_gd && bio_data_dir(bio) == WRITE &&
+            stackbd_snap_write(&stackbd.snap, bio) == STACKBD_SNAP_QUEUED)
+        return 0;
+
+    return stackbd_upper_io(bio, may_block);
+}
+
+/* send the hedged reads that are due; returns with stackbd.lock held */
+static void stackbd_run_hedges(void)
+{
+    struct stackbd_io *io;
+
+    spin_lock_irq(&stackbd.lock);
+    while (!list_empty(&stackbd.hedge_list))
+    {
+        io = list_first_entry(&stackbd.hedge_list, struct stackbd_io, list);
+        list_del(&io->list);
+        spin_unlock_irq(&stackbd.lock);
+
+        stackbd_mirror_hedge(stackbd.members, stackbd.nr_members, io);
+
+        spin_lock_irq(&stackbd.lock);
+    }
+}
 
 static int stackbd_threadfn(void *data)
 {
@@ -133,24 +935,130 @@ static int stackbd_threadfn(void *data)
     {
         /* wake_up() is after adding bio to list. No need for condition */ 
         wait_event_interruptible(req_event, kthread_should_stop() ||
-                !bio_list_empty(&stackbd.bio_list));
-
-        spin_lock_irq(&stackbd.lock);
-        if (bio_list_empty(&stackbd.bio_list))
-        {
-            spin_unlock_irq(&stackbd.lock);
-            continue;
-        }
+                ACCESS_ONCE(stackbd.sched.queued) ||
+                !list_empty(&stackbd.hedge_list));
 
-        bio = bio_list_pop(&stackbd.bio_list);
+        /* hedges first: they are late already */
+        stackbd_run_hedges();
+        bio = stackbd_sched_next(&stackbd.sched, stackbd_now());
         spin_unlock_irq(&stackbd.lock);
+        if (!bio)
+            continue;
 
-        stackbd_io_clone(bio);
+        stackbd_io_submit(bio, 1);
     }
 
+    /* drop the references of the timers that went off meanwhile */
+    stackbd_run_hedges();
+    spin_unlock_irq(&stackbd.lock);
+
     return 0;
 }
 
+/* the snapshot disk has chunks of its own */
+static unsigned int stackbd_queue_boundary(struct request_queue *q)
+{
+    return q == stackbd.snap_queue ? stackbd.snap_boundary : stackbd.boundary;
+}
+
+/* ask the merge_bvec_fn of the linear target, as dm-linear does */
+static int stackbd_target_mergeable(struct bvec_merge_data *bvm, sector_t sector,
+        struct bio_vec *biovec, int max)
+{
+    struct bvec_merge_data tbvm = *bvm;
+    struct stackbd_member *m;
+    struct request_queue *tq;
+
+    rcu_read_lock();
+    /* not started yet: the partition scan of add_disk() */
+    if ((m = rcu_dereference(stackbd.mig.target)) &&
+            (tq = bdev_get_queue(m->bdev))->merge_bvec_fn)
+    {
+        tbvm.bi_bdev = m->bdev;
+        tbvm.bi_sector = sector;
+        max = min(max, tq->merge_bvec_fn(tq, &tbvm, biovec));
+    }
+    rcu_read_unlock();
+
+    return max;
+}
+
+/*
+ * Keep bios built with bio_add_page() within a chunk, as the chunks
+ * are remapped independently. Same as raid0_mergeable_bvec().
+ */
+static int stackbd_mergeable_bvec(struct request_queue *q,
+        struct bvec_merge_data *bvm, struct bio_vec *biovec)
+{
+    sector_t sector = bvm->bi_sector + get_start_sect(bvm->bi_bdev);
+    unsigned int bio_sectors = bvm->bi_size >> 9;
+    unsigned int b = stackbd_queue_boundary(q);
+    int max = biovec->bv_len;
+
+    if (b)
+    {
+        max = (b - ((sector & (b - 1)) + bio_sectors)) << 9;
+        if (max < 0)
+            max = 0; /* bio_add_page() cannot handle a negative return */
+        if (max <= biovec->bv_len && bio_sectors == 0)
+            return biovec->bv_len;
+    }
+
+    /* the sectors are the same on the linear target: it may have a say too */
+    if (q == stackbd.queue && layout == LAYOUT_LINEAR && !thin)
+        max = stackbd_target_mergeable(bvm, sector, biovec, max);
+
+    return max;
+}
+
+static int stackbd_crosses_boundary(struct bio *bio, unsigned int b)
+{
+    return b && (bio->bi_sector & (b - 1)) + (bio->bi_size >> 9) > b;
+}
+
+/*
+ * Split a bio that crosses the chunk boundary and resubmit the halves.
+ * Only single-page bios get past stackbd_mergeable_bvec(), and those are
+ * all bio_split() can deal with.
+ */
+static void stackbd_split(struct bio *bio, unsigned int b)
+{
+    struct bio_pair *bp;
+
+    if (bio->bi_vcnt != 1 || bio->bi_idx != 0)
+    {
+        printk("stackbd: bio crosses chunk boundary, aborting\n");
+        bio_io_error(bio);
+        return;
+    }
+
+    bp = bio_split(bio, b - (bio->bi_sector & (b - 1)));
+    generic_make_request(&bp->bio1);
+    generic_make_request(&bp->bio2);
+    bio_pair_release(bp);
+}
+
+void stackbd_submit(struct bio *bio)
+{
+    unsigned long flags;
+    int c;
+
+    if (stackbd_can_inline() && stackbd_io_submit(bio, 0) != -EWOULDBLOCK)
+    {
+        atomic_long_inc(&stackbd.nr_inline);
+        return;
+    }
+
+    /* the class comes from the submitter: take it before the lock */
+    c = stackbd_bio_class(bio);
+
+    spin_lock_irqsave(&stackbd.lock, flags);
+    stackbd_sched_add(&stackbd.sched, bio, c);
+    wake_up(&req_event);
+    spin_unlock_irqrestore(&stackbd.lock, flags);
+    atomic_long_inc(&stackbd.nr_deferred);
+}
+
 /*
  * Handle an I/O request.
  */
@@ -158,17 +1066,19 @@ static int stackbd_threadfn(void *data)
 /* static void stackbd_make_request(struct request_queue *q, struct bio *bio) */
 static int stackbd_make_request(struct request_queue *q, struct bio *bio)
 {
+#ifdef STACKBD_DEBUG
     printk("stackbd: make request %-5s block %-12llu #pages %-4hu total-size "
             "%-10u\n", bio_data_dir(bio) == WRITE ? "write" : "read",
             (unsigned long long) bio->bi_sector, bio->bi_vcnt, bio->bi_size);
     printk("%s: bi_end_io = %p", DEVNAME, bio->bi_end_io);
+#endif
 
 //    printk("<%p> Make request %s %s %s\n", bio,
 //           bio->bi_rw & REQ_SYNC ? "SYNC" : "",
 //           bio->bi_rw & REQ_FLUSH ? "FLUSH" : "",
 //           bio->bi_rw & REQ_NOIDLE ? "NOIDLE" : "");
 //
-    spin_lock_irq(&stackbd.lock);
+    /* both are set up once, before the device goes active */
     if (!stackbd.bdev_raw)
     {
         printk("stackbd: Request before bdev_raw is ready, aborting\n");
@@ -179,15 +1089,20 @@ static int stackbd_make_request(struct request_queue *q, struct bio *bio)
         printk("stackbd: Device not active yet, aborting\n");
         goto abort;
     }
-    bio_list_add(&stackbd.bio_list, bio);
-    wake_up(&req_event);
-    spin_unlock_irq(&stackbd.lock);
+
+    if (stackbd_crosses_boundary(bio, stackbd.boundary))
+    {
+        stackbd_split(bio, stackbd.boundary);
+        /* FIXME:VER return; */
+        return 0;
+    }
+
+    stackbd_submit(bio);
 
     /* FIXME:VER return; */
     return 0;
 
 abort:
-    spin_unlock_irq(&stackbd.lock);
     printk("<%p> Abort request\n\n", bio);
     bio_io_error(bio);
     
@@ -232,50 +1147,430 @@ static struct block_device *stackbd_bdev_open(char dev_path[])
     return bdev_raw;
 }
 
+void stackbd_member_close(struct stackbd_member *m)
+{
+    blkdev_put(m->bdev, STACKBD_BDEV_MODE);
+    bdput(m->bdev);
+    m->bdev = NULL;
+}
+
+static void stackbd_close_members(void)
+{
+    struct stackbd_member *m;
+
+    while (stackbd.nr_members)
+    {
+        m = &stackbd.members[--stackbd.nr_members];
+        if (m->bdev)
+            stackbd_member_close(m);
+    }
+    stackbd.bdev_raw = NULL;
+}
+
+/* open the comma-separated list of targets */
+static int stackbd_open_members(char *dev_paths)
+{
+    struct stackbd_member *m;
+    char *paths, *s, *path;
+    int first = stackbd.nr_members;
+
+    if (!(paths = kstrdup(dev_paths, GFP_KERNEL)))
+        return -ENOMEM;
+
+    for (s = paths; (path = strsep(&s, ",")) != NULL; )
+    {
+        if (!*path)
+            continue;
+
+        if (stackbd.nr_members == STACKBD_MAX_MEMBERS)
+        {
+            printk("stackbd: too many targets, at most %d\n", STACKBD_MAX_MEMBERS);
+            goto error;
+        }
+
+        m = &stackbd.members[stackbd.nr_members];
+        if (!(m->bdev = stackbd_bdev_open(path)))
+            goto error;
+        m->capacity = get_capacity(m->bdev->bd_disk);
+        stackbd_member_init(m);
+        stackbd.nr_members++;
+    }
+
+    kfree(paths);
+    if (!stackbd.nr_members)
+        return -EINVAL;
+
+    stackbd.bdev_raw = stackbd.members[0].bdev;
+    return 0;
+
+error:
+    kfree(paths);
+    /* only the ones opened here */
+    while (stackbd.nr_members > first)
+        stackbd_member_close(&stackbd.members[--stackbd.nr_members]);
+    return -EFAULT;
+}
+
+/* reads of the snapshot disk */
+static int stackbd_snap_make_request(struct request_queue *q, struct bio *bio)
+{
+    if (stackbd_crosses_boundary(bio, stackbd.snap_boundary))
+    {
+        stackbd_split(bio, stackbd.snap_boundary);
+        /* FIXME:VER return; */
+        return 0;
+    }
+
+    stackbd_snap_read(&stackbd.snap, bio);
+    /* FIXME:VER return; */
+    return 0;
+}
+
+static struct block_device_operations stackbd_snap_ops = {
+    .owner  = THIS_MODULE,
+};
+
+static void stackbd_snap_teardown(void)
+{
+    if (stackbd.snap_gd)
+        put_disk(stackbd.snap_gd);
+    if (stackbd.snap_queue)
+        blk_cleanup_queue(stackbd.snap_queue);
+    stackbd.snap_gd = NULL;
+    stackbd.snap_queue = NULL;
+
+    stackbd_snap_exit(&stackbd.snap);
+    if (stackbd.snap.cow)
+    {
+        blkdev_put(stackbd.snap.cow, STACKBD_BDEV_MODE);
+        bdput(stackbd.snap.cow);
+        stackbd.snap.cow = NULL;
+    }
+}
+
+/* take the snapshot and set up its disk, to be added once we are active */
+static int stackbd_snap_setup(unsigned int max_sectors)
+{
+    struct block_device *cow;
+    struct gendisk *gd;
+
+    if (!(cow = stackbd_bdev_open(cowname)))
+        return -EFAULT;
+    /* the copies are read through the layout, a chunk at a time */
+    if ((stackbd.boundary && snap_chunk_sectors > stackbd.boundary) ||
+            snap_chunk_sectors > max_sectors ||
+            stackbd_snap_init(&stackbd.snap, cow, snap_chunk_sectors, stackbd.capacity))
+    {
+        printk("stackbd: bad snap_chunk_sectors %d\n", snap_chunk_sectors);
+        stackbd.snap.cow = cow;
+        stackbd_snap_teardown();
+        return -EINVAL;
+    }
+    stackbd.snap_boundary = snap_chunk_sectors;
+
+    if (!(stackbd.snap_queue = blk_alloc_queue(GFP_KERNEL)))
+        goto error;
+    blk_queue_make_request(stackbd.snap_queue, stackbd_snap_make_request);
+    blk_queue_merge_bvec(stackbd.snap_queue, stackbd_mergeable_bvec);
+    blk_queue_logical_block_size(stackbd.snap_queue, LOGICAL_BLOCK_SIZE);
+    blk_queue_max_hw_sectors(stackbd.snap_queue, max_sectors);
+
+    if (!(gd = alloc_disk(16)))
+        goto error;
+    gd->major = major_num;
+    gd->first_minor = 16;
+    gd->fops = &stackbd_snap_ops;
+    gd->private_data = &stackbd;
+    strcpy(gd->disk_name, DEVNAME_SNAP);
+    gd->queue = stackbd.snap_queue;
+    set_capacity(gd, (sector_t) stackbd.snap.nr_chunks << stackbd.snap.chunk_shift);
+    set_disk_ro(gd, 1);
+    stackbd.snap_gd = gd;
+    return 0;
+
+error:
+    stackbd.snap.cow = cow;
+    stackbd_snap_teardown();
+    return -ENOMEM;
+}
+
+/*
+ * Take over the limits of all the targets (block sizes, alignment,
+ * sizes, segments), so that the layers above build bios every target
+ * can take as they are, and say what I/O suits the layout.
+ */
+static void stackbd_stack_limits(void)
+{
+    struct request_queue *q = stackbd.queue;
+    struct request_queue *tq;
+    int i;
+
+    /* FIXME:VER from 3.3 on, blk_set_stacking_limits() */
+    blk_set_default_limits(&q->limits);
+    blk_queue_logical_block_size(q, LOGICAL_BLOCK_SIZE);
+
+    for (i = 0; i < stackbd.nr_members; i++)
+    {
+        tq = bdev_get_queue(stackbd.members[i].bdev);
+        disk_stack_limits(stackbd.gd, stackbd.members[i].bdev, 0);
+        /*
+         * Only the linear layout passes bvec merge queries on to the
+         * target; for the others, a page is all that is safe.
+         */
+        if (tq->merge_bvec_fn && layout != LAYOUT_LINEAR)
+            blk_queue_max_hw_sectors(q, PAGE_SIZE >> 9);
+    }
+
+    switch (layout)
+    {
+    case LAYOUT_STRIPE:
+        /* a chunk per member, a full stripe over all of them */
+        blk_queue_io_min(q, stripe_sectors << 9);
+        blk_queue_io_opt(q, (stripe_sectors << 9) * stackbd.nr_members);
+        break;
+    case LAYOUT_TIER:
+        blk_queue_io_opt(q, tier_chunk_sectors << 9);
+        break;
+    }
+    if (thin)
+        blk_queue_io_min(q, chunk_sectors << 9);
+
+    printk("stackbd: limits -- logical block: %u -- physical block: %u -- io_min: %u -- "
+            "io_opt: %u -- max segments: %u\n", queue_logical_block_size(q),
+            queue_physical_block_size(q), queue_io_min(q), queue_io_opt(q),
+            queue_max_segments(q));
+}
+
+/* can the target in m take what the queue lets through? */
+static int stackbd_limits_fit(struct stackbd_member *m)
+{
+    struct request_queue *q = stackbd.queue;
+    struct request_queue *tq = bdev_get_queue(m->bdev);
+
+    return queue_max_hw_sectors(tq) >= queue_max_hw_sectors(q) &&
+        queue_max_segments(tq) >= queue_max_segments(q) &&
+        queue_max_segment_size(tq) >= queue_max_segment_size(q) &&
+        queue_logical_block_size(tq) <= queue_logical_block_size(q) &&
+        !tq->merge_bvec_fn;
+}
+
 static int stackbd_start(char *dev_path)
 {
     unsigned max_sectors;
+    sector_t member_size;
+    int i;
 
-    if (!(stackbd.bdev_raw = stackbd_bdev_open(dev_path)))
+    if (stackbd_open_members(dev_path))
         return -EFAULT;
 
     /* Set up our internal device */
     stackbd.capacity = get_capacity(stackbd.bdev_raw->bd_disk);
     printk("stackbd: Device real capacity: %llu\n", (unsigned long long) stackbd.capacity);
 
+    switch (layout)
+    {
+    case LAYOUT_LINEAR:
+        if (stackbd.nr_members > 1)
+        {
+            printk("stackbd: linear layout takes a single target\n");
+            goto error_after_bdev;
+        }
+        stackbd_migrate_init(&stackbd.mig, &stackbd.members[0], &stackbd.inflight);
+        break;
+    case LAYOUT_STRIPE:
+        if (!is_power_of_2(stripe_sectors))
+        {
+            printk("stackbd: stripe_sectors must be a power of 2\n");
+            goto error_after_bdev;
+        }
+        /* the smallest member, rounded down to whole chunks, times the count */
+        member_size = stackbd.members[0].capacity;
+        for (i = 1; i < stackbd.nr_members; i++)
+            member_size = min(member_size, stackbd.members[i].capacity);
+        member_size &= ~((sector_t) stripe_sectors - 1);
+
+        stackbd.stripe_shift = ilog2(stripe_sectors);
+        stackbd.boundary = stripe_sectors;
+        stackbd.capacity = member_size * stackbd.nr_members;
+        printk("stackbd: Striping over %d targets, capacity: %llu\n",
+                stackbd.nr_members, (unsigned long long) stackbd.capacity);
+        break;
+    case LAYOUT_MIRROR:
+        /* every member holds all of it: the smallest one sets the size */
+        for (i = 1; i < stackbd.nr_members; i++)
+            stackbd.capacity = min(stackbd.capacity, stackbd.members[i].capacity);
+        if (mirror_bitmap && stackbd_bitmap_init(&stackbd.bitmap, stackbd.members,
+                    stackbd.nr_members, &stackbd.capacity, bitmap_region_sectors))
+        {
+            printk("stackbd: error setting up the write-intent bitmap\n");
+            goto error_after_bdev;
+        }
+        printk("stackbd: Mirroring over %d targets, capacity: %llu\n",
+                stackbd.nr_members, (unsigned long long) stackbd.capacity);
+        break;
+    case LAYOUT_TIER:
+        if (stackbd.nr_members != 2)
+        {
+            printk("stackbd: tier layout takes a fast and a slow target\n");
+            goto error_after_bdev;
+        }
+        if (stackbd_tier_init(&stackbd.tier, &stackbd.members[0], &stackbd.members[1],
+                    tier_chunk_sectors, &stackbd.inflight))
+        {
+            printk("stackbd: error setting up tiering\n");
+            goto error_after_bdev;
+        }
+        stackbd.boundary = tier_chunk_sectors;
+        stackbd.capacity = stackbd_tier_capacity(&stackbd.tier);
+        printk("stackbd: Tiering over 2 targets, capacity: %llu\n",
+                (unsigned long long) stackbd.capacity);
+        break;
+    default:
+        printk("stackbd: unknown layout %d\n", layout);
+        goto error_after_bdev;
+    }
+
+    if (thin && layout != LAYOUT_LINEAR)
+    {
+        printk("stackbd: thin provisioning needs the linear layout\n");
+        goto error_after_tier;
+    }
+
+    if (thin)
+    {
+        if (stackbd_map_init(&stackbd.map, stackbd.bdev_raw, chunk_sectors,
+                    meta_sectors, virtual_sectors))
+        {
+            printk("stackbd: error setting up the thin map\n");
+            goto error_after_tier;
+        }
+        stackbd.boundary = chunk_sectors;
+        stackbd.capacity = stackbd_map_capacity(&stackbd.map);
+        printk("stackbd: Thin device capacity: %llu\n", (unsigned long long) stackbd.capacity);
+    }
+
     set_capacity(stackbd.gd, stackbd.capacity);
 
-    max_sectors = queue_max_hw_sectors(bdev_get_queue(stackbd.bdev_raw));
-    blk_queue_max_hw_sectors(stackbd.queue, max_sectors);
+    stackbd_stack_limits();
+    /* what our own bios built a page per bvec (cache, snapshot) may hold */
+    max_sectors = min(queue_max_hw_sectors(stackbd.queue),
+            queue_max_segments(stackbd.queue) * (unsigned int) (PAGE_SIZE >> 9));
     printk("stackbd: Max sectors: %u\n", max_sectors);
 
+    if (cache_mb)
+    {
+        if (stackbd_wbcache_init(&stackbd.cache, cache_mb << (20 - PAGE_SHIFT),
+                    stackbd.capacity, stackbd.boundary, max_sectors,
+                    queue_max_segments(stackbd.queue)))
+        {
+            printk("stackbd: error setting up the cache\n");
+            goto error_after_map;
+        }
+    }
+
+    if (*cowname)
+    {
+        if (stackbd_snap_setup(max_sectors))
+        {
+            printk("stackbd: error setting up the snapshot\n");
+            goto error_after_cache;
+        }
+    }
+
     stackbd.thread = kthread_create(stackbd_threadfn, NULL,
            stackbd.gd->disk_name);
     if (IS_ERR(stackbd.thread))
     {
         printk("stackbd: error kthread_create <%lu>\n",
                PTR_ERR(stackbd.thread));
-        goto error_after_bdev;
+        goto error_after_snap;
     }
 
     printk("stackbd: done initializing successfully\n");
     stackbd.is_active = 1;
     wake_up_process(stackbd.thread);
 
+    /* the partition scan reads the snapshot through us */
+    if (stackbd.snap_gd)
+        add_disk(stackbd.snap_gd);
+
     return 0;
 
+error_after_snap:
+    stackbd_snap_teardown();
+error_after_cache:
+    stackbd_wbcache_exit(&stackbd.cache);
+error_after_map:
+    stackbd_map_exit(&stackbd.map);
+error_after_tier:
+    stackbd_tier_exit(&stackbd.tier);
+    if (mirror_bitmap)
+        stackbd_bitmap_exit(&stackbd.bitmap);
 error_after_bdev:
-    blkdev_put(stackbd.bdev_raw, STACKBD_BDEV_MODE);
-    bdput(stackbd.bdev_raw);
+    stackbd_close_members();
 
     return -EFAULT;
 }
 
+/* open the new target in a free slot and start copying to it */
+static int stackbd_migrate(char *dev_path)
+{
+    static DEFINE_MUTEX(migrate_mutex);
+    struct stackbd_member *m;
+    int i, rc;
+
+    if (!stackbd.is_active || layout != LAYOUT_LINEAR || thin)
+    {
+        printk("stackbd: only the linear layout without thin provisioning migrates\n");
+        return -EINVAL;
+    }
+
+    mutex_lock(&migrate_mutex);
+
+    rc = -EBUSY;
+    if (stackbd.mig.state == STACKBD_MIGRATE_COPYING)
+        goto out;
+
+    for (i = 0; i < stackbd.nr_members && stackbd.members[i].bdev; i++)
+        ;
+    if (i == STACKBD_MAX_MEMBERS)
+        goto out;
+    m = &stackbd.members[i];
+
+    rc = -EFAULT;
+    if (!(m->bdev = stackbd_bdev_open(dev_path)))
+        goto out;
+    m->capacity = get_capacity(m->bdev->bd_disk);
+    stackbd_member_init(m);
+
+    /* the queue limits were set up for the first target and stay */
+    rc = -EINVAL;
+    if (m->capacity < stackbd.capacity || !stackbd_limits_fit(m))
+    {
+        printk("stackbd: %s is too small or has tighter queue limits\n", dev_path);
+        stackbd_member_close(m);
+        goto out;
+    }
+
+    if (i == stackbd.nr_members)
+        stackbd.nr_members++;
+    if ((rc = stackbd_migrate_start(&stackbd.mig, m, stackbd.capacity)))
+        stackbd_member_close(m);
+    else
+        printk("stackbd: migrating to %s\n", dev_path);
+
+out:
+    mutex_unlock(&migrate_mutex);
+    return rc;
+}
+
 static int stackbd_ioctl(struct block_device *bdev, fmode_t mode,
 		     unsigned int cmd, unsigned long arg)
 {
+    static DEFINE_MUTEX(start_mutex);
     char dev_path[80];
 	void __user *argp = (void __user *)arg;    
+    int rc;
 
     switch (cmd)
     {
@@ -284,8 +1579,19 @@ static int stackbd_ioctl(struct block_device *bdev, fmode_t mode,
 
         if (copy_from_user(dev_path, argp, sizeof(dev_path)))
             return -EFAULT;
+        dev_path[sizeof(dev_path) - 1] = '\0';
+
+        /* once running, the targets only change by STACKBD_MIGRATE */
+        mutex_lock(&start_mutex);
+        rc = stackbd.is_active ? -EBUSY : stackbd_start(dev_path);
+        mutex_unlock(&start_mutex);
+        return rc;
+    case STACKBD_MIGRATE:
+        if (copy_from_user(dev_path, argp, sizeof(dev_path)))
+            return -EFAULT;
+        dev_path[sizeof(dev_path) - 1] = '\0';
 
-        return stackbd_start(dev_path);
+        return stackbd_migrate(dev_path);
     default:
         return -ENOTTY;
     }
@@ -318,13 +1624,239 @@ static struct block_device_operations stackbd_ops = {
         .ioctl  = stackbd_ioctl,
 };
 
+static unsigned long stackbd_percent(unsigned long n, unsigned long total)
+{
+    return total ? n * 100 / total : 0;
+}
+
+static void stackbd_cache_show(struct seq_file *sf, struct stackbd_wbcache *c)
+{
+    unsigned long hits = atomic_long_read(&c->read_hits);
+    unsigned long misses = atomic_long_read(&c->read_misses);
+    unsigned long bios = atomic_long_read(&c->wb_bios);
+    unsigned long sectors = atomic_long_read(&c->wb_sectors);
+    unsigned long ra = atomic_long_read(&c->ra_blocks);
+    unsigned long ra_hits = atomic_long_read(&c->ra_hits);
+
+    seq_printf(sf, "Cache: %u blocks -- a1in: %u -- am: %u -- dirty: %u -- "
+            "under writeback: %u\n", c->nr_blocks, ACCESS_ONCE(c->nr_a1in),
+            ACCESS_ONCE(c->nr_am), ACCESS_ONCE(c->nr_dirty), ACCESS_ONCE(c->nr_wb));
+    seq_printf(sf, "Cache reads: hits: %lu -- misses: %lu -- hit ratio: %lu%% -- "
+            "blocks filled: %ld\n", hits, misses, stackbd_percent(hits, hits + misses),
+            atomic_long_read(&c->read_fills));
+    seq_printf(sf, "Cache readahead: blocks: %lu -- read: %lu -- reclaimed unread: %ld -- "
+            "accuracy: %lu%%\n", ra, ra_hits, atomic_long_read(&c->ra_wasted),
+            stackbd_percent(ra_hits, ra));
+    seq_printf(sf, "Cache writes: absorbed: %ld -- FUA: %ld -- waited for space: %ld\n",
+            atomic_long_read(&c->writes), atomic_long_read(&c->writes_through),
+            atomic_long_read(&c->write_waits));
+    seq_printf(sf, "Cache writeback: flushes: %ld -- passes: %ld -- blocks: %ld -- "
+            "bios: %lu -- sectors/bio: %lu\n",
+            atomic_long_read(&c->flushes), atomic_long_read(&c->wb_passes),
+            atomic_long_read(&c->wb_blocks), bios, bios ? sectors / bios : 0);
+}
+
+static void stackbd_tier_show(struct seq_file *sf, struct stackbd_tier *t)
+{
+    unsigned long fast = atomic_long_read(&t->fast_ios);
+    unsigned long slow = atomic_long_read(&t->slow_ios);
+
+    seq_printf(sf, "Tier I/Os: fast: %lu (%lu%%) -- slow: %lu -- fast chunks in use: %u of %u\n",
+            fast, stackbd_percent(fast, fast + slow), slow,
+            ACCESS_ONCE(t->nr_fast), t->fchunks);
+    seq_printf(sf, "Tier migration: promotions: %ld -- demotions: %ld -- aborted: %ld -- "
+            "migrated: %ld MB -- throttled: %ld ms\n",
+            atomic_long_read(&t->promotions), atomic_long_read(&t->demotions),
+            atomic_long_read(&t->aborts), atomic_long_read(&t->migrated_sectors) >> 11,
+            atomic_long_read(&t->throttled_ms));
+}
+
+static void stackbd_snap_show(struct seq_file *sf, struct stackbd_snap *s)
+{
+    unsigned long copied = atomic_long_read(&s->cow_chunks_copied);
+    unsigned long writes = atomic_long_read(&s->cow_writes);
+
+    seq_printf(sf, "Snapshot: %s -- chunks copied: %lu of %lu -- store used: %lu%%\n",
+            ACCESS_ONCE(s->invalid) ? "invalid" : "valid", copied, s->nr_chunks,
+            stackbd_percent(copied, s->cow_chunks));
+    seq_printf(sf, "Snapshot writes delayed: %lu -- avg delay: %lu us -- "
+            "reads from store: %ld -- from origin: %ld\n",
+            writes, writes ? atomic_long_read(&s->cow_ns) / writes / NSEC_PER_USEC : 0,
+            atomic_long_read(&s->reads_cow), atomic_long_read(&s->reads_origin));
+}
+
+static void stackbd_migrate_show(struct seq_file *sf, struct stackbd_migrate *mg)
+{
+    static char *states[] = {"idle", "copying", "done", "failed"};
+    unsigned long copied = ACCESS_ONCE(mg->copied) >> 11;
+    unsigned long end = ACCESS_ONCE(mg->end_ns) ? : stackbd_now();
+    unsigned long ms = (end - mg->start_ns) / NSEC_PER_MSEC;
+
+    seq_printf(sf, "Migration: %s -- copied: %lu of %llu MB (%lu%%) -- rate: %lu MB/s\n",
+            states[mg->state], copied, (unsigned long long) mg->size >> 11,
+            stackbd_percent(ACCESS_ONCE(mg->copied), mg->size),
+            ms ? copied * 1000 / ms : 0);
+}
+
+static void stackbd_sched_show(struct seq_file *sf, struct stackbd_sched *s)
+{
+    struct stackbd_sched_class *cl;
+    int c, b;
+
+    seq_printf(sf, "%-5s %8s %8s %12s %9s\n", "class", "reads", "writes",
+            "dispatched", "expired");
+    for (c = 0; c < STACKBD_NR_CLASSES; c++)
+    {
+        cl = &s->classes[c];
+        seq_printf(sf, "%-5s %8u %8u %12lu %9lu\n", stackbd_class_names[c],
+                ACCESS_ONCE(cl->nr_queued[READ]), ACCESS_ONCE(cl->nr_queued[WRITE]),
+                ACCESS_ONCE(cl->dispatched), ACCESS_ONCE(cl->expired));
+    }
+
+    /* buckets of powers of two, by their upper bound */
+    for (c = 0; c < STACKBD_NR_CLASSES; c++)
+    {
+        cl = &s->classes[c];
+        if (!ACCESS_ONCE(cl->dispatched))
+            continue;
+        seq_printf(sf, "Wait %s (ns):", stackbd_class_names[c]);
+        for (b = 0; b < STACKBD_WAIT_BUCKETS; b++)
+            if (ACCESS_ONCE(cl->wait_hist[b]))
+                seq_printf(sf, " %llu: %lu", 1ULL << (b + 1), cl->wait_hist[b]);
+        seq_printf(sf, "\n");
+    }
+}
+
+static void stackbd_bitmap_show(struct seq_file *sf, struct stackbd_bitmap *bm)
+{
+    seq_printf(sf, "Bitmap: %lu regions of %u sectors -- dirty: %lu -- bits set: %ld -- "
+            "cleared: %ld -- page writes: %ld -- resynced at start: %ld\n",
+            bm->nr_regions, bm->region_sectors, ACCESS_ONCE(bm->nr_dirty),
+            atomic_long_read(&bm->bits_set), atomic_long_read(&bm->bits_cleared),
+            atomic_long_read(&bm->page_writes), atomic_long_read(&bm->resynced));
+}
+
+static void stackbd_zero_show(struct seq_file *sf)
+{
+    unsigned long mb = atomic_long_read(&stackbd.zero_scanned) >> 20;
+
+    seq_printf(sf, "Zero writes: %ld -- bytes elided: unallocated: %ld -- discarded: %ld -- "
+            "scan cost: %lu ns/GB\n", atomic_long_read(&stackbd.zero_writes),
+            atomic_long_read(&stackbd.zero_unmapped),
+            atomic_long_read(&stackbd.zero_discarded),
+            mb ? atomic_long_read(&stackbd.zero_scan_ns) / mb * 1024 : 0);
+}
+
+static int stackbd_proc_show(struct seq_file *sf, void *v)
+{
+    static char *layouts[] = {"linear", "stripe", "mirror", "tier"};
+    char name[BDEVNAME_SIZE];
+    struct stackbd_member *m;
+    unsigned long sectors, max = 0, total = 0;
+    int i;
+
+    seq_printf(sf, "Target device: %s\n", targetname);
+    if (!stackbd.is_active)
+        return 0;
+
+    seq_printf(sf, "Layout: %s -- members: %d", layouts[layout], stackbd.nr_members);
+    if (layout == LAYOUT_STRIPE)
+        seq_printf(sf, " -- chunk: %d sectors", stripe_sectors);
+    if (layout == LAYOUT_TIER)
+        seq_printf(sf, " -- chunk: %d sectors", tier_chunk_sectors);
+    seq_printf(sf, "\nCapacity: %llu sectors\n", (unsigned long long) stackbd.capacity);
+    seq_printf(sf, "In flight: %d\n", atomic_read(&stackbd.inflight));
+    seq_printf(sf, "Submitted inline: %ld -- deferred: %ld\n",
+            atomic_long_read(&stackbd.nr_inline),
+            atomic_long_read(&stackbd.nr_deferred));
+    stackbd_sched_show(sf, &stackbd.sched);
+    if (zero_detect || atomic_long_read(&stackbd.zero_scanned))
+        stackbd_zero_show(sf);
+
+    if (cache_mb)
+        stackbd_cache_show(sf, &stackbd.cache);
+
+    if (layout == LAYOUT_TIER)
+        stackbd_tier_show(sf, &stackbd.tier);
+
+    if (layout == LAYOUT_MIRROR && mirror_bitmap)
+        stackbd_bitmap_show(sf, &stackbd.bitmap);
+
+    if (stackbd.snap_gd)
+        stackbd_snap_show(sf, &stackbd.snap);
+
+    if (layout == LAYOUT_LINEAR && stackbd.mig.state != STACKBD_MIGRATE_IDLE)
+        stackbd_migrate_show(sf, &stackbd.mig);
+
+    if (thin)
+        seq_printf(sf, "Thin: allocated chunks: %llu of %llu -- unmapped reads: %ld\n",
+                (unsigned long long) stackbd.map.next_free,
+                (unsigned long long) stackbd.map.phys_chunks,
+                atomic_long_read(&stackbd.map.nr_unmapped_reads));
+
+    seq_printf(sf, "%-3s %-12s %12s %14s %9s\n", "#", "device", "I/Os", "sectors", "inflight");
+    for (i = 0; i < stackbd.nr_members; i++)
+    {
+        m = &stackbd.members[i];
+        if (!m->bdev)
+            continue;
+        sectors = atomic_long_read(&m->sectors);
+        total += sectors;
+        max = max(max, sectors);
+        seq_printf(sf, "%-3d %-12s %12ld %14lu %9d\n", i, bdevname(m->bdev, name),
+                atomic_long_read(&m->ios), sectors, atomic_read(&m->inflight));
+    }
+
+    /* 100% is an even spread; N * 100% means everything went to one member */
+    if (layout != LAYOUT_LINEAR && stackbd.nr_members > 1 && total)
+        seq_printf(sf, "Imbalance (max/mean sectors): %lu%%\n",
+                max * 100 * stackbd.nr_members / total);
+
+    if (layout != LAYOUT_MIRROR)
+        return 0;
+
+    seq_printf(sf, "%-3s %10s %10s %9s %9s %-6s\n", "#", "ewma(us)", "p99(us)",
+            "hedges", "won", "state");
+    for (i = 0; i < stackbd.nr_members; i++)
+    {
+        m = &stackbd.members[i];
+        seq_printf(sf, "%-3d %10lu %10lu %9ld %9ld %-6s\n", i,
+                ACCESS_ONCE(m->ewma_ns) / NSEC_PER_USEC, m->p99_ns / NSEC_PER_USEC,
+                atomic_long_read(&m->hedges), atomic_long_read(&m->hedge_wins),
+                m->faulty ? "faulty" : "ok");
+    }
+
+    return 0;
+}
+
+static int stackbd_proc_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, stackbd_proc_show, NULL);
+}
+
+static struct file_operations proc_fops = {
+    .owner      = THIS_MODULE,
+    .open       = stackbd_proc_open,
+    .read       = seq_read,
+    .llseek     = seq_lseek,
+    .release    = single_release,
+};
+
+static struct proc_dir_entry *proc_entry;
+
 static int __init stackbd_init(void)
 {
+    int rc;
+
     if (strcmp(targetname,"") == 0)
         return -EINVAL;
 
 	/* Set up our internal device */
 	spin_lock_init(&stackbd.lock);
+    INIT_LIST_HEAD(&stackbd.hedge_list);
+    init_waitqueue_head(&stackbd.idle_wait);
+    if (stackbd_sched_init(&stackbd.sched))
+        return -ENOMEM;
 
 	/* blk_alloc_queue() instead of blk_init_queue() so it won't set up the
      * queue for requests.
@@ -332,10 +1864,18 @@ static int __init stackbd_init(void)
     if (!(stackbd.queue = blk_alloc_queue(GFP_KERNEL)))
     {
         printk("stackbd: alloc_queue failed\n");
+        stackbd_sched_exit(&stackbd.sched);
         return -EFAULT;
     }
 
     blk_queue_make_request(stackbd.queue, stackbd_make_request);
+    blk_queue_merge_bvec(stackbd.queue, stackbd_mergeable_bvec);
+    /*
+     * Have flushes and FUA passed down to us rather than stripped: the
+     * cache (and the targets' own caches) must be flushed.
+     * FIXME:VER before 2.6.37 this was blk_queue_ordered()
+     */
+    blk_queue_flush(stackbd.queue, REQ_FLUSH | REQ_FUA);
 	blk_queue_logical_block_size(stackbd.queue, LOGICAL_BLOCK_SIZE);
 
 	/* Get registered */
@@ -358,26 +1898,60 @@ static int __init stackbd_init(void)
 
     printk("stackbd: init done\n");
 
-	return stackbd_start(targetname);
+	if ((rc = stackbd_start(targetname)))
+        goto error_after_add_disk;
+
+    proc_entry = proc_create(PROC_ENTRY, S_IRUGO, NULL, &proc_fops);
+    return 0;
 
+error_after_add_disk:
+	del_gendisk(stackbd.gd);
+	put_disk(stackbd.gd);
 error_after_redister_blkdev:
 	unregister_blkdev(major_num, DEVNAME);
 error_after_alloc_queue:
     blk_cleanup_queue(stackbd.queue);
+    stackbd_sched_exit(&stackbd.sched);
 
 	return -EFAULT;
 }
 
 static void __exit stackbd_exit(void)
 {
-    printk("stackbd: exit\n");
+    printk("stackbd: exit -- inline: %ld -- deferred: %ld\n",
+            atomic_long_read(&stackbd.nr_inline),
+            atomic_long_read(&stackbd.nr_deferred));
+
+    if (proc_entry)
+        remove_proc_entry(PROC_ENTRY, NULL);
+
+    if (stackbd.snap_gd)
+        del_gendisk(stackbd.snap_gd);
 
     if (stackbd.is_active)
     {
+        /*
+         * The losing clone of a hedged read, and the hedge timers that went
+         * off, outlive the original bio: the worker stays up to send or
+         * drop the hedges until every io is gone.
+         */
+        wait_event(stackbd.idle_wait, !atomic_read(&stackbd.inflight) &&
+                !ACCESS_ONCE(stackbd.sched.queued));
         kthread_stop(stackbd.thread);
-        blkdev_put(stackbd.bdev_raw, STACKBD_BDEV_MODE);
-        bdput(stackbd. bdev_raw);
+        stackbd_migrate_exit(&stackbd.mig);
+        /* the writes waiting for copies go through the cache */
+        stackbd_snap_teardown();
+        /* the cache writes back through the map */
+        stackbd_wbcache_exit(&stackbd.cache);
+        stackbd_map_exit(&stackbd.map);
+        stackbd_tier_exit(&stackbd.tier);
+        /* the last writes are done: the bitmap is left clean */
+        if (mirror_bitmap)
+            stackbd_bitmap_exit(&stackbd.bitmap);
+        stackbd_close_members();
     }
+    /* nothing is left queued unless the device was in use */
+    stackbd_sched_exit(&stackbd.sched);
 
 	del_gendisk(stackbd.gd);
 	put_disk(stackbd.gd);
@@ -0,0 +1,402 @@
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/gfp.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/crc32.h>
+#include <linux/rcupdate.h>
+
+#include "stackbd.h"
+
+/*
+ * Thin translation layer: virtual to physical chunk map of stackbd.
+ * See stackbd.h for the overview.
+ */
+
+#define META_MAGIC      0x4d425453      /* "STBM" */
+#define META_VERSION    1
+#define META_MAX_SECTORS 2048           /* 1M: the image must fit in one allocation */
+
+/* on-disk metadata: the header takes up sector 0, extents follow from sector 1 */
+struct stackbd_meta_hdr {
+    __le32 magic;
+    __le32 version;
+    __le32 chunk_sectors;
+    __le32 nr_extents;
+    __le64 virt_chunks;
+    __le64 next_free;
+    __le32 crc;         /* of the extent array */
+    __le32 pad;
+} __packed;
+
+struct stackbd_meta_extent {
+    __le64 vchunk;
+    __le64 pchunk;
+    __le32 nr;
+    __le32 pad;
+} __packed;
+
+#define META_EXTENTS(map) \
+    ((struct stackbd_meta_extent *) ((char *) (map)->meta_buf + KERNEL_SECTOR_SIZE))
+
+static inline sector_t chunk_to_sector(struct stackbd_map *map, u64 pchunk)
+{
+    return map->meta_sectors + ((sector_t) pchunk << map->chunk_shift);
+}
+
+static struct stackbd_table *stackbd_table_alloc(unsigned int nr, gfp_t gfp)
+{
+    struct stackbd_table *t;
+
+    t = kmalloc(sizeof(*t) + nr * sizeof(t->ext[0]), gfp);
+    if (t)
+        t->nr = nr;
+    return t;
+}
+
+static void stackbd_table_free_rcu(struct rcu_head *head)
+{
+    kfree(container_of(head, struct stackbd_table, rcu));
+}
+
+/* index of the last extent that starts at or before vchunk, -1 if none */
+static int stackbd_table_search(struct stackbd_table *t, u64 vchunk)
+{
+    int lo = 0, hi = (int) t->nr - 1, mid, res = -1;
+
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        if (t->ext[mid].vchunk <= vchunk) {
+            res = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return res;
+}
+
+static int stackbd_table_lookup(struct stackbd_table *t, u64 vchunk, u64 *pchunk)
+{
+    int i = stackbd_table_search(t, vchunk);
+
+    if (i < 0 || vchunk >= t->ext[i].vchunk + t->ext[i].nr)
+        return -ENOENT;
+
+    *pchunk = t->ext[i].pchunk + (vchunk - t->ext[i].vchunk);
+    return 0;
+}
+
+/*
+ * Build a copy of the table with (vchunk -> pchunk) added. The chunk is
+ * appended to the preceding extent when both sides are contiguous, which
+ * is the common case for sequential writers since the allocator hands out
+ * physical chunks in order. For the same reason, pchunk can never be
+ * contiguous with the following extent.
+ */
+static struct stackbd_table *stackbd_table_insert(struct stackbd_table *old,
+        u64 vchunk, u64 pchunk)
+{
+    struct stackbd_table *new;
+    int i = stackbd_table_search(old, vchunk);
+
+    if (i >= 0 && old->ext[i].vchunk + old->ext[i].nr == vchunk &&
+            old->ext[i].pchunk + old->ext[i].nr == pchunk && old->ext[i].nr < U32_MAX) {
+        if (!(new = stackbd_table_alloc(old->nr, GFP_NOIO)))
+            return NULL;
+        memcpy(new->ext, old->ext, old->nr * sizeof(old->ext[0]));
+        new->ext[i].nr++;
+        return new;
+    }
+
+    if (!(new = stackbd_table_alloc(old->nr + 1, GFP_NOIO)))
+        return NULL;
+    memcpy(new->ext, old->ext, (i + 1) * sizeof(old->ext[0]));
+    new->ext[i + 1].vchunk = vchunk;
+    new->ext[i + 1].pchunk = pchunk;
+    new->ext[i + 1].nr = 1;
+    memcpy(&new->ext[i + 2], &old->ext[i + 1], (old->nr - i - 1) * sizeof(old->ext[0]));
+    return new;
+}
+
+int stackbd_map_lookup(struct stackbd_map *map, u64 vchunk, u64 *pchunk)
+{
+    int rc;
+
+    rcu_read_lock();
+    rc = stackbd_table_lookup(rcu_dereference(map->table), vchunk, pchunk);
+    rcu_read_unlock();
+
+    return rc;
+}
+
+/* write the table out to the metadata area -- called with map->lock held */
+static int stackbd_meta_write(struct stackbd_map *map, struct stackbd_table *t)
+{
+    struct stackbd_meta_hdr *hdr = map->meta_buf;
+    struct stackbd_meta_extent *me = META_EXTENTS(map);
+    unsigned int i, len;
+
+    for (i = 0; i < t->nr; i++) {
+        me[i].vchunk = cpu_to_le64(t->ext[i].vchunk);
+        me[i].pchunk = cpu_to_le64(t->ext[i].pchunk);
+        me[i].nr = cpu_to_le32(t->ext[i].nr);
+        me[i].pad = 0;
+    }
+
+    len = t->nr * sizeof(*me);
+    hdr->magic = cpu_to_le32(META_MAGIC);
+    hdr->version = cpu_to_le32(META_VERSION);
+    hdr->chunk_sectors = cpu_to_le32(map->chunk_sectors);
+    hdr->nr_extents = cpu_to_le32(t->nr);
+    hdr->virt_chunks = cpu_to_le64(map->virt_chunks);
+    hdr->next_free = cpu_to_le64(map->next_free);
+    hdr->crc = cpu_to_le32(crc32_le(~0, (unsigned char *) me, len));
+    hdr->pad = 0;
+
+    /* the header and the used part of the extent array */
+    len = KERNEL_SECTOR_SIZE + roundup(len, KERNEL_SECTOR_SIZE);
+
+    /* the map must be durable before data is written to the new chunk */
+    return stackbd_sync_io(map->bdev, WRITE_FLUSH_FUA, 0, map->meta_buf, len);
+}
+
+/* load the table from the metadata area, or format the area if it is blank */
+static int stackbd_meta_read(struct stackbd_map *map, sector_t virt_sectors)
+{
+    struct stackbd_meta_hdr *hdr = map->meta_buf;
+    struct stackbd_meta_extent *me = META_EXTENTS(map);
+    struct stackbd_table *t;
+    unsigned int i, nr;
+    int rc;
+
+    rc = stackbd_sync_io(map->bdev, READ, 0, map->meta_buf,
+            map->meta_sectors * KERNEL_SECTOR_SIZE);
+    if (rc)
+        return rc;
+
+    if (le32_to_cpu(hdr->magic) != META_MAGIC) {
+        pr_info("%s: no thin metadata found, formatting\n", DEVNAME);
+
+        map->virt_chunks = virt_sectors ? virt_sectors >> map->chunk_shift : map->phys_chunks;
+        map->next_free = 0;
+        if (!(t = stackbd_table_alloc(0, GFP_KERNEL)))
+            return -ENOMEM;
+        if ((rc = stackbd_meta_write(map, t))) {
+            kfree(t);
+            return rc;
+        }
+        RCU_INIT_POINTER(map->table, t);
+        return 0;
+    }
+
+    nr = le32_to_cpu(hdr->nr_extents);
+    if (le32_to_cpu(hdr->version) != META_VERSION ||
+            le32_to_cpu(hdr->chunk_sectors) != map->chunk_sectors ||
+            nr > map->max_extents) {
+        pr_info("%s: thin metadata does not match the configuration\n", DEVNAME);
+        return -EINVAL;
+    }
+
+    if (le32_to_cpu(hdr->crc) != crc32_le(~0, (unsigned char *) me, nr * sizeof(*me))) {
+        pr_info("%s: thin metadata checksum mismatch\n", DEVNAME);
+        return -EIO;
+    }
+
+    map->virt_chunks = le64_to_cpu(hdr->virt_chunks);
+    map->next_free = le64_to_cpu(hdr->next_free);
+
+    /* the size is fixed when the area is formatted */
+    if (virt_sectors && virt_sectors >> map->chunk_shift != map->virt_chunks) {
+        pr_info("%s: virtual_sectors=%llu, but the thin map was made for %llu\n",
+                DEVNAME, (unsigned long long) virt_sectors,
+                (unsigned long long) map->virt_chunks << map->chunk_shift);
+        return -EINVAL;
+    }
+    if (map->next_free > map->phys_chunks) {
+        pr_info("%s: thin metadata claims %llu chunks, the target has %llu\n",
+                DEVNAME, (unsigned long long) map->next_free,
+                (unsigned long long) map->phys_chunks);
+        return -EINVAL;
+    }
+
+    if (!(t = stackbd_table_alloc(nr, GFP_KERNEL)))
+        return -ENOMEM;
+    for (i = 0; i < nr; i++) {
+        t->ext[i].vchunk = le64_to_cpu(me[i].vchunk);
+        t->ext[i].pchunk = le64_to_cpu(me[i].pchunk);
+        t->ext[i].nr = le32_to_cpu(me[i].nr);
+
+        /*
+         * Sorted, not overlapping, and within what has been handed out:
+         * the lookups and the allocator rely on all three.
+         */
+        if (!t->ext[i].nr ||
+                t->ext[i].vchunk >= map->virt_chunks ||
+                t->ext[i].nr > map->virt_chunks - t->ext[i].vchunk ||
+                t->ext[i].pchunk >= map->next_free ||
+                t->ext[i].nr > map->next_free - t->ext[i].pchunk ||
+                (i && t->ext[i].vchunk < t->ext[i - 1].vchunk + t->ext[i - 1].nr)) {
+            pr_info("%s: thin metadata extent %u is out of range\n", DEVNAME, i);
+            kfree(t);
+            return -EINVAL;
+        }
+    }
+    RCU_INIT_POINTER(map->table, t);
+
+    pr_info("%s: thin map loaded -- %u extents, %llu of %llu chunks allocated\n",
+            DEVNAME, nr, (unsigned long long) map->next_free,
+            (unsigned long long) map->phys_chunks);
+    return 0;
+}
+
+/*
+ * Allocate a physical chunk for vchunk and persist the map. Sleeps, so it
+ * is only called from the worker thread. Unless the write that triggered
+ * the allocation covers the whole chunk, the chunk is zeroed first so that
+ * the rest of it does not expose stale data.
+ */
+static int stackbd_map_alloc(struct stackbd_map *map, u64 vchunk, int zero, u64 *pchunk)
+{
+    struct stackbd_table *old, *new;
+    u64 p;
+    int rc;
+
+    mutex_lock(&map->lock);
+    old = rcu_dereference_protected(map->table, lockdep_is_held(&map->lock));
+
+    /* someone got here first */
+    if (!stackbd_table_lookup(old, vchunk, pchunk)) {
+        rc = 0;
+        goto out;
+    }
+
+    rc = -ENOSPC;
+    if (map->next_free >= map->phys_chunks)
+        goto out;
+
+    p = map->next_free;
+    if (zero && (rc = blkdev_issue_zeroout(map->bdev, chunk_to_sector(map, p),
+                    map->chunk_sectors, GFP_NOIO)))
+        goto out;
+
+    rc = -ENOMEM;
+    if (!(new = stackbd_table_insert(old, vchunk, p)))
+        goto out;
+
+    rc = -ENOSPC;
+    if (new->nr > map->max_extents)
+        goto out_free;
+
+    map->next_free++;
+    if ((rc = stackbd_meta_write(map, new))) {
+        map->next_free--;
+        goto out_free;
+    }
+
+    rcu_assign_pointer(map->table, new);
+    call_rcu(&old->rcu, stackbd_table_free_rcu);
+
+    atomic_long_inc(&map->nr_alloc);
+    *pchunk = p;
+    mutex_unlock(&map->lock);
+    return 0;
+
+out_free:
+    kfree(new);
+out:
+    mutex_unlock(&map->lock);
+    return rc;
+}
+
+/*
+ * Translate the bio's sector. The bio must not cross a chunk boundary.
+ * Returns 0 with the physical sector in *psector, STACKBD_MAP_DONE if the
+ * bio has been completed here (reads of unallocated chunks), -EWOULDBLOCK
+ * if a chunk has to be allocated and may_block is not set, or an error.
+ */
+int stackbd_map_bio(struct stackbd_map *map, struct bio *bio, sector_t *psector,
+        int may_block)
+{
+    u64 vchunk = bio->bi_sector >> map->chunk_shift;
+    sector_t offset = bio->bi_sector & (map->chunk_sectors - 1);
+    u64 pchunk;
+    int rc;
+
+    if (vchunk >= map->virt_chunks)
+        return -EIO;
+
+    if (!stackbd_map_lookup(map, vchunk, &pchunk))
+        goto mapped;
+
+    if (bio_data_dir(bio) == READ) {
+        /* never written to: a thin device reads back zeroes */
+        atomic_long_inc(&map->nr_unmapped_reads);
+        zero_fill_bio(bio);
+        bio_endio(bio, 0);
+        return STACKBD_MAP_DONE;
+    }
+
+    if (!may_block)
+        return -EWOULDBLOCK;
+
+    rc = stackbd_map_alloc(map, vchunk,
+            bio->bi_size < map->chunk_sectors * KERNEL_SECTOR_SIZE, &pchunk);
+    if (rc)
+        return rc;
+
+mapped:
+    *psector = chunk_to_sector(map, pchunk) + offset;
+    return 0;
+}
+
+int stackbd_map_init(struct stackbd_map *map, struct block_device *bdev,
+        unsigned int chunk_sectors, sector_t meta_sectors, sector_t virt_sectors)
+{
+    sector_t capacity = get_capacity(bdev->bd_disk);
+    int rc;
+
+    if (!is_power_of_2(chunk_sectors) || meta_sectors < 2 ||
+            meta_sectors > META_MAX_SECTORS || meta_sectors >= capacity)
+        return -EINVAL;
+
+    map->bdev = bdev;
+    map->chunk_sectors = chunk_sectors;
+    map->chunk_shift = ilog2(chunk_sectors);
+    map->meta_sectors = meta_sectors;
+    map->phys_chunks = (capacity - meta_sectors) >> map->chunk_shift;
+    map->max_extents = (meta_sectors - 1) * KERNEL_SECTOR_SIZE /
+        sizeof(struct stackbd_meta_extent);
+    mutex_init(&map->lock);
+    atomic_long_set(&map->nr_alloc, 0);
+    atomic_long_set(&map->nr_unmapped_reads, 0);
+
+    map->meta_order = get_order(meta_sectors * KERNEL_SECTOR_SIZE);
+    map->meta_buf = (void *) __get_free_pages(GFP_KERNEL | __GFP_ZERO, map->meta_order);
+    if (!map->meta_buf)
+        return -ENOMEM;
+
+    if ((rc = stackbd_meta_read(map, virt_sectors))) {
+        free_pages((unsigned long) map->meta_buf, map->meta_order);
+        map->meta_buf = NULL;
+        return rc;
+    }
+
+    return 0;
+}
+
+void stackbd_map_exit(struct stackbd_map *map)
+{
+    if (!map->meta_buf)
+        return;
+
+    /* wait for the tables retired by stackbd_map_alloc() */
+    rcu_barrier();
+    kfree(rcu_dereference_protected(map->table, 1));
+    free_pages((unsigned long) map->meta_buf, map->meta_order);
+    map->meta_buf = NULL;
+
+    pr_info("%s: thin map -- allocated chunks: %ld -- unmapped reads: %ld\n",
+            DEVNAME, atomic_long_read(&map->nr_alloc),
+            atomic_long_read(&map->nr_unmapped_reads));
+}
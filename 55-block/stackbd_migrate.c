@@ -0,0 +1,245 @@
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/kernel.h>
+#include <linux/gfp.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/kthread.h>
+
+#include "stackbd.h"
+
+/*
+ * Online migration of stackbd's linear target. See stackbd.h for the
+ * overview.
+ */
+
+/* copy bandwidth, MB/s, 0 - unlimited */
+static int migrate_mbps = 0;
+module_param(migrate_mbps, int, S_IRUGO | S_IWUSR);
+/* pause the copy while more foreground bios than this are in flight */
+static int migrate_busy_inflight = 8;
+module_param(migrate_busy_inflight, int, S_IRUGO | S_IWUSR);
+
+/* copy window: 256K */
+#define MIG_BUF_ORDER   (18 - PAGE_SHIFT)
+
+void stackbd_migrate_init(struct stackbd_migrate *mg, struct stackbd_member *target,
+        atomic_t *inflight)
+{
+    rcu_assign_pointer(mg->target, target);
+    rcu_assign_pointer(mg->dest, NULL);
+    mg->inflight = inflight;
+    stackbd_epoch_init(&mg->epoch);
+    mg->hold_start = mg->hold_end = 0;
+    init_waitqueue_head(&mg->wait);
+    mg->thread = NULL;
+    mg->src = mg->dst = NULL;
+    mg->state = STACKBD_MIGRATE_IDLE;
+}
+
+static int mig_held(struct stackbd_migrate *mg, sector_t sector, unsigned int sectors)
+{
+    return sector < ACCESS_ONCE(mg->hold_end) &&
+        sector + sectors > ACCESS_ONCE(mg->hold_start);
+}
+
+int stackbd_migrate_map(struct stackbd_migrate *mg, struct bio *bio, sector_t sector,
+        int may_block, struct stackbd_member **m, int *epoch)
+{
+    struct stackbd_member *dest;
+    int e;
+
+    for (;;) {
+        e = stackbd_epoch_enter(&mg->epoch);
+
+        rcu_read_lock();
+        m[0] = rcu_dereference(mg->target);
+        dest = rcu_dereference(mg->dest);
+        rcu_read_unlock();
+
+        if (!dest || bio_data_dir(bio) != WRITE)
+            break;
+        if (!mig_held(mg, sector, bio_sectors(bio))) {
+            m[1] = dest;
+            *epoch = e;
+            return 2;
+        }
+
+        stackbd_epoch_exit(&mg->epoch, e);
+        if (!may_block)
+            return -EWOULDBLOCK;
+        wait_event(mg->wait, !mig_held(mg, sector, bio_sectors(bio)));
+    }
+
+    /* both pointers stay valid until the epoch is drained */
+    *epoch = e;
+    return 1;
+}
+
+int stackbd_migrate_endio(struct stackbd_migrate *mg, struct stackbd_member *m,
+        int error)
+{
+    /* the write is done on the target: give up on the copy, not the write */
+    if (error && m == ACCESS_ONCE(mg->dst)) {
+        mg->error = error;
+        return 0;
+    }
+    return error;
+}
+
+/* before a window is copied: writes to it wait, those already sent are done */
+static int mig_window(struct stackbd_copier *cp, sector_t pos, unsigned int n)
+{
+    struct stackbd_migrate *mg = container_of(cp, struct stackbd_migrate, copier);
+
+    if (mg->error)
+        return mg->error;
+
+    mg->copied = pos;
+    mg->hold_start = pos;
+    mg->hold_end = pos + n;
+    stackbd_epoch_drain(&mg->epoch);
+    return 0;
+}
+
+static void mig_window_done(struct stackbd_copier *cp, sector_t pos, unsigned int n)
+{
+    struct stackbd_migrate *mg = container_of(cp, struct stackbd_migrate, copier);
+
+    mg->hold_end = mg->hold_start;
+    smp_mb();
+    wake_up(&mg->wait);
+}
+
+static int mig_copy(struct stackbd_migrate *mg)
+{
+    int rc;
+
+    rc = stackbd_copy_range(&mg->copier, mg->src->bdev, 0, &mg->dst->bdev, 1, 0, mg->size);
+    if (rc)
+        return rc;
+    mg->copied = mg->size;
+
+    /* FIXME:VER before 2.6.36 blkdev_issue_flush() took flags */
+    return blkdev_issue_flush(mg->dst->bdev, GFP_KERNEL, NULL);
+}
+
+static int mig_threadfn(void *data)
+{
+    struct stackbd_migrate *mg = data;
+    char name[BDEVNAME_SIZE];
+    struct stackbd_member *old;
+    int rc;
+
+    rc = mig_copy(mg);
+
+    /*
+     * A write to both targets may still fail on dst, after the last window
+     * and the flush: dst has everything only once all of them are done.
+     * Writes are held over the whole device meanwhile, so none goes to
+     * src alone before the cut-over.
+     */
+    mg->hold_start = 0;
+    mg->hold_end = mg->size;
+    stackbd_epoch_drain(&mg->epoch);
+    if (!rc)
+        rc = ACCESS_ONCE(mg->error);
+
+    if (!rc) {
+        /* cut over: new I/O goes to dst only, the old target is let go once idle */
+        old = mg->src;
+        rcu_assign_pointer(mg->target, mg->dst);
+        rcu_assign_pointer(mg->dest, NULL);
+    } else {
+        old = mg->dst;
+        rcu_assign_pointer(mg->dest, NULL);
+    }
+
+    mg->hold_end = mg->hold_start;
+    smp_mb();
+    wake_up(&mg->wait);
+
+    synchronize_rcu();
+    stackbd_epoch_drain(&mg->epoch);
+
+    mg->end_ns = stackbd_now();
+    printk("stackbd: migration to %s %s: %d\n", bdevname(mg->dst->bdev, name),
+            rc ? "failed" : "done", rc);
+    stackbd_member_close(old);
+
+    mg->dst = NULL;
+    mg->state = rc ? STACKBD_MIGRATE_FAILED : STACKBD_MIGRATE_DONE;
+
+    /* stackbd_migrate_start() or _exit() reaps us */
+    while (!kthread_should_stop()) {
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (!kthread_should_stop())
+            schedule();
+        __set_current_state(TASK_RUNNING);
+    }
+
+    return 0;
+}
+
+int stackbd_migrate_start(struct stackbd_migrate *mg, struct stackbd_member *dst,
+        sector_t size)
+{
+    struct stackbd_member *src;
+
+    if (mg->state == STACKBD_MIGRATE_COPYING)
+        return -EBUSY;
+    if (mg->thread) {
+        kthread_stop(mg->thread);
+        mg->thread = NULL;
+    }
+
+    if (!mg->buf && !(mg->buf = (void *) __get_free_pages(GFP_KERNEL, MIG_BUF_ORDER)))
+        return -ENOMEM;
+
+    src = rcu_dereference_protected(mg->target, 1);
+    mg->src = src;
+    mg->dst = dst;
+    mg->size = size;
+    mg->copied = 0;
+    mg->error = 0;
+    mg->start_ns = stackbd_now();
+    mg->end_ns = 0;
+
+    /* in windows of the buffer's size, each held against writes while it is copied */
+    memset(&mg->copier, 0, sizeof(mg->copier));
+    mg->copier.buf = mg->buf;
+    mg->copier.buf_sectors = (PAGE_SIZE << MIG_BUF_ORDER) >> 9;
+    mg->copier.inflight = mg->inflight;
+    mg->copier.busy_inflight = &migrate_busy_inflight;
+    mg->copier.mbps = &migrate_mbps;
+    mg->copier.window = mig_window;
+    mg->copier.window_done = mig_window_done;
+    mg->state = STACKBD_MIGRATE_COPYING;
+
+    /* from here on, writes go to both */
+    rcu_assign_pointer(mg->dest, dst);
+
+    mg->thread = kthread_run(mig_threadfn, mg, "stackbd_migrate");
+    if (IS_ERR(mg->thread)) {
+        rcu_assign_pointer(mg->dest, NULL);
+        synchronize_rcu();
+        stackbd_epoch_drain(&mg->epoch);
+        mg->state = STACKBD_MIGRATE_FAILED;
+        mg->dst = NULL;
+        return PTR_ERR(xchg(&mg->thread, NULL));
+    }
+
+    return 0;
+}
+
+void stackbd_migrate_exit(struct stackbd_migrate *mg)
+{
+    /* a copy in progress is given up on, the old target stays */
+    if (mg->thread)
+        kthread_stop(mg->thread);
+    mg->thread = NULL;
+
+    if (mg->buf)
+        free_pages((unsigned long) mg->buf, MIG_BUF_ORDER);
+    mg->buf = NULL;
+}
@@ -0,0 +1,329 @@
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/gfp.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/hrtimer.h>
+
+#include "stackbd.h"
+
+/*
+ * Mirror layout of stackbd: write fan-out and latency-aware read balancing,
+ * with optional hedged reads. See stackbd.h for the overview.
+ */
+
+/* weight of a new sample in the latency moving average: 1 / 2^ewma_shift */
+static int ewma_shift = 3;
+module_param(ewma_shift, int, S_IRUGO | S_IWUSR);
+
+/* send a second read to another member when the first one exceeds p99 */
+static int hedge = 0;
+module_param(hedge, int, S_IRUGO | S_IWUSR);
+/* hedged reads are bounced, so only hedge reads up to this size */
+static int hedge_max_sectors = 128;
+module_param(hedge_max_sectors, int, S_IRUGO | S_IWUSR);
+/* never hedge earlier than this */
+static int hedge_min_usecs = 50;
+module_param(hedge_min_usecs, int, S_IRUGO | S_IWUSR);
+
+/* halve the histogram every so many samples */
+#define LAT_DECAY 4096
+/* recompute p99 every so many samples */
+#define LAT_P99_EVERY 256
+
+static unsigned int lat_bucket(unsigned long ns)
+{
+    unsigned int l;
+
+    if (ns < 4)
+        return ns;
+
+    l = ilog2(ns);
+    return (l << 2) + ((ns >> (l - 2)) & 3);
+}
+
+/* the upper bound of a bucket */
+static unsigned long lat_bucket_ns(unsigned int b)
+{
+    unsigned int l = b >> 2;
+
+    if (l < 2)
+        return b + 1;
+
+    return (4UL + (b & 3) + 1) << (l - 2);
+}
+
+/* called with m->lat_lock held */
+static void stackbd_member_p99(struct stackbd_member *m)
+{
+    unsigned int b, sum = 0, rank = m->lat_total - m->lat_total / 100;
+
+    for (b = 0; b < STACKBD_LAT_BUCKETS; b++) {
+        sum += m->lat_hist[b];
+        if (sum >= rank)
+            break;
+    }
+    m->p99_ns = lat_bucket_ns(b);
+}
+
+void stackbd_member_init(struct stackbd_member *m)
+{
+    m->faulty = 0;
+    m->ewma_ns = 0;
+    m->p99_ns = 0;
+    m->lat_total = 0;
+    memset(m->lat_hist, 0, sizeof(m->lat_hist));
+    spin_lock_init(&m->lat_lock);
+}
+
+/* account a completed read -- may be called from IRQ context */
+void stackbd_member_account(struct stackbd_member *m, unsigned long ns)
+{
+    unsigned long flags;
+    long ewma = ACCESS_ONCE(m->ewma_ns);
+    unsigned int b;
+
+    /* racy on purpose: a lost update only makes the average a bit stale */
+    if (!ewma)
+        ewma = ns;
+    else
+        ewma += ((long) ns - ewma) >> ewma_shift;
+    m->ewma_ns = ewma;
+
+    spin_lock_irqsave(&m->lat_lock, flags);
+    m->lat_hist[lat_bucket(ns)]++;
+    if (++m->lat_total % LAT_P99_EVERY == 0)
+        stackbd_member_p99(m);
+    if (m->lat_total >= LAT_DECAY) {
+        m->lat_total = 0;
+        for (b = 0; b < STACKBD_LAT_BUCKETS; b++) {
+            m->lat_hist[b] >>= 1;
+            m->lat_total += m->lat_hist[b];
+        }
+    }
+    spin_unlock_irqrestore(&m->lat_lock, flags);
+}
+
+/*
+ * Pick the member to read from: the expected wait is the recent latency
+ * times the queue in front of us. Members that have not been sampled yet
+ * have ewma 0, so they get tried first.
+ */
+static struct stackbd_member *stackbd_mirror_pick(struct stackbd_member *members,
+        int nr, struct stackbd_member *except)
+{
+    struct stackbd_member *m, *best = NULL;
+    unsigned long score, best_score = ~0UL;
+    int i;
+
+    for (i = 0; i < nr; i++) {
+        m = &members[i];
+        if (m == except || m->faulty)
+            continue;
+
+        score = (ACCESS_ONCE(m->ewma_ns) + 1) * (atomic_read(&m->inflight) + 1);
+        if (score < best_score) {
+            best = m;
+            best_score = score;
+        }
+    }
+    return best;
+}
+
+static void stackbd_bounce_free(struct bio *b)
+{
+    int i;
+
+    /* bi_io_vec as built, completion may have moved bi_idx along */
+    for (i = 0; i < b->bi_vcnt; i++)
+        __free_page(b->bi_io_vec[i].bv_page);
+    bio_put(b);
+}
+
+/* a read bio of the same size as the original, into freshly allocated pages */
+static struct bio *stackbd_bounce_alloc(struct stackbd_io *io, struct stackbd_member *m)
+{
+    unsigned int len = io->size, n;
+    struct page *page;
+    struct bio *b;
+
+    if (!(b = bio_alloc(GFP_NOIO, DIV_ROUND_UP(len, PAGE_SIZE))))
+        return NULL;
+
+    b->bi_bdev = m->bdev;
+    b->bi_rw = io->rw;
+
+    while (len) {
+        n = min_t(unsigned int, len, PAGE_SIZE);
+        if (!(page = alloc_page(GFP_NOIO)))
+            goto error;
+        if (bio_add_page(b, page, n, 0) != n) {
+            __free_page(page);
+            goto error;
+        }
+        len -= n;
+    }
+    return b;
+
+error:
+    stackbd_bounce_free(b);
+    return NULL;
+}
+
+/* copy the data read into bounce bio src to the original bio dst */
+static void stackbd_bounce_copy(struct bio *dst, struct bio *src)
+{
+    struct bio_vec *bv;
+    unsigned long flags, off = 0;
+    unsigned int i, done, n;
+    char *d, *s;
+
+    bio_for_each_segment(bv, dst, i) {
+        d = bvec_kmap_irq(bv, &flags);
+        for (done = 0; done < bv->bv_len; done += n, off += n) {
+            /* the bounce pages are full pages, in order */
+            s = page_address(src->bi_io_vec[off >> PAGE_SHIFT].bv_page) +
+                (off & ~PAGE_MASK);
+            n = min_t(unsigned int, bv->bv_len - done, PAGE_SIZE - (off & ~PAGE_MASK));
+            memcpy(d + done, s, n);
+        }
+        bvec_kunmap_irq(d, &flags);
+    }
+}
+
+static int stackbd_bounce_clone(struct stackbd_io *io, int i,
+        struct stackbd_member *m, sector_t sector)
+{
+    struct bio *b = stackbd_bounce_alloc(io, m);
+
+    if (!b)
+        return -ENOMEM;
+
+    io->clone[i].bounce = 1;
+    stackbd_io_dispatch(io, i, m, sector, b);
+    return 0;
+}
+
+static enum hrtimer_restart stackbd_hedge_timer(struct hrtimer *timer)
+{
+    struct stackbd_io *io = container_of(timer, struct stackbd_io, timer);
+
+    /* can't submit from hard IRQ context: the worker sends the hedge */
+    stackbd_queue_hedge(io);
+    return HRTIMER_NORESTART;
+}
+
+/* the primary read is late -- worker thread context */
+void stackbd_mirror_hedge(struct stackbd_member *members, int nr,
+        struct stackbd_io *io)
+{
+    struct stackbd_member *m;
+
+    /*
+     * The clone inherits the timer's reference. The original bio may
+     * complete any time, so only the copies in io are used from here.
+     */
+    if (ACCESS_ONCE(io->done) ||
+            !(m = stackbd_mirror_pick(members, nr, io->clone[0].m)) ||
+            stackbd_bounce_clone(io, 1, m, io->sector)) {
+        stackbd_io_put(io, 0);
+        return;
+    }
+
+    atomic_long_inc(&m->hedges);
+}
+
+/*
+ * Completion of a bounced clone, before its reference is dropped: the
+ * first one to succeed hands its data over and completes the original bio,
+ * and cancels the hedge timer if that has not gone off yet.
+ */
+void stackbd_mirror_read_done(struct stackbd_clone *c, struct bio *b, int error)
+{
+    struct stackbd_io *io = c->io;
+
+    if (!error && !xchg(&io->done, 1)) {
+        stackbd_bounce_copy(io->bio, b);
+        if (c == &io->clone[1])
+            atomic_long_inc(&c->m->hedge_wins);
+
+        bio_endio(io->bio, 0);
+
+        if (c == &io->clone[0] && hrtimer_try_to_cancel(&io->timer) == 1)
+            stackbd_io_put(io, 0);
+    }
+
+    stackbd_bounce_free(b);
+}
+
+/* sector is the same on every member */
+void stackbd_mirror_submit(struct stackbd_member *members, int nr,
+        struct bio *bio, sector_t sector, struct stackbd_bitmap *bm)
+{
+    struct stackbd_member *m;
+    struct stackbd_io *io;
+    unsigned long delay;
+    int i;
+
+    if (bio_data_dir(bio) == WRITE) {
+        if (!(io = stackbd_io_alloc(bio, nr))) {
+            if (bm)
+                stackbd_bitmap_end_write(bm, sector, bio_sectors(bio));
+            goto nomem;
+        }
+
+        io->flags |= STACKBD_IO_ANY_OK;
+        if (bm) {
+            io->flags |= STACKBD_IO_BITMAP;
+            io->sector = sector;
+            io->size = bio->bi_size;
+        }
+        for (i = 0; i < nr; i++) {
+            if (members[i].faulty)
+                stackbd_io_put(io, -EIO);
+            else
+                stackbd_io_clone(io, i, &members[i], sector);
+        }
+        return;
+    }
+
+    if (!(m = stackbd_mirror_pick(members, nr, NULL))) {
+        bio_io_error(bio);
+        return;
+    }
+
+    if (hedge && bio_sectors(bio) <= hedge_max_sectors && m->p99_ns &&
+            stackbd_mirror_pick(members, nr, m)) {
+        /* one reference for the primary, one for the hedge timer */
+        if (!(io = stackbd_io_alloc(bio, 2)))
+            goto nomem;
+
+        io->flags |= STACKBD_IO_HEDGED;
+        io->sector = sector;
+        io->size = bio->bi_size;
+        io->rw = bio->bi_rw;
+        /* the completion may try to cancel the timer before it is started */
+        hrtimer_init(&io->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+        io->timer.function = stackbd_hedge_timer;
+
+        if (!stackbd_bounce_clone(io, 0, m, sector)) {
+            delay = max_t(unsigned long, m->p99_ns, hedge_min_usecs * NSEC_PER_USEC);
+            hrtimer_start(&io->timer, ns_to_ktime(delay), HRTIMER_MODE_REL);
+            return;
+        }
+
+        /* no memory for bouncing: go without the hedge */
+        io->flags &= ~STACKBD_IO_HEDGED;
+        atomic_set(&io->pending, 1);
+    } else if (!(io = stackbd_io_alloc(bio, 1))) {
+        goto nomem;
+    }
+
+    stackbd_io_clone(io, 0, m, sector);
+    return;
+
+nomem:
+    bio_endio(bio, -ENOMEM);
+}
@@ -0,0 +1,184 @@
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mempool.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/ioprio.h>
+#include <linux/iocontext.h>
+#include <linux/log2.h>
+#include <linux/sched.h>
+
+#include "stackbd.h"
+
+/*
+ * Priority queues of stackbd's worker. See stackbd.h for the overview.
+ */
+
+/* share of each class (RT, BE, idle) while all of them are busy */
+static int sched_weight[STACKBD_NR_CLASSES] = {8, 4, 1};
+module_param_array(sched_weight, int, NULL, S_IRUGO | S_IWUSR);
+/* sectors a class of weight 1 may dispatch per round */
+static int sched_quantum = 256;
+module_param(sched_quantum, int, S_IRUGO | S_IWUSR);
+/* how long reads and writes may wait before they go ahead of the rest, ms */
+static int sched_read_expire_ms = 50;
+module_param(sched_read_expire_ms, int, S_IRUGO | S_IWUSR);
+static int sched_write_expire_ms = 500;
+module_param(sched_write_expire_ms, int, S_IRUGO | S_IWUSR);
+
+/* entries kept for when GFP_ATOMIC fails */
+#define SCHED_MIN_ENTRIES   64
+
+char *stackbd_class_names[STACKBD_NR_CLASSES] = {"rt", "be", "idle"};
+
+/* called in the submitter's context, where there is one */
+int stackbd_bio_class(struct bio *bio)
+{
+    int prio = bio_prio(bio);
+
+    if (!ioprio_valid(prio) && !in_interrupt()) {
+        if (current->io_context)
+            prio = current->io_context->ioprio;
+        if (!ioprio_valid(prio))
+            prio = IOPRIO_PRIO_VALUE(task_nice_ioclass(current), 0);
+    }
+
+    switch (IOPRIO_PRIO_CLASS(prio)) {
+    case IOPRIO_CLASS_RT:
+        return STACKBD_CLASS_RT;
+    case IOPRIO_CLASS_IDLE:
+        return STACKBD_CLASS_IDLE;
+    }
+    return STACKBD_CLASS_BE;
+}
+
+static long sched_share(int c)
+{
+    return (long) max(sched_weight[c], 1) * max(sched_quantum, 1);
+}
+
+int stackbd_sched_init(struct stackbd_sched *s)
+{
+    int c;
+
+    memset(s, 0, sizeof(*s));
+    for (c = 0; c < STACKBD_NR_CLASSES; c++) {
+        INIT_LIST_HEAD(&s->classes[c].fifo[READ]);
+        INIT_LIST_HEAD(&s->classes[c].fifo[WRITE]);
+        s->classes[c].credit = sched_share(c);
+    }
+    bio_list_init(&s->overflow);
+
+    s->pool = mempool_create_kmalloc_pool(SCHED_MIN_ENTRIES,
+            sizeof(struct stackbd_sched_entry));
+    return s->pool ? 0 : -ENOMEM;
+}
+
+/* fails what the worker has left behind */
+void stackbd_sched_exit(struct stackbd_sched *s)
+{
+    struct bio *bio;
+
+    if (!s->pool)
+        return;
+
+    while ((bio = stackbd_sched_next(s, stackbd_now())))
+        bio_io_error(bio);
+
+    mempool_destroy(s->pool);
+    s->pool = NULL;
+}
+
+void stackbd_sched_add(struct stackbd_sched *s, struct bio *bio, int c)
+{
+    struct stackbd_sched_entry *e;
+    int dir = bio_data_dir(bio);
+
+    s->queued++;
+    if (!(e = mempool_alloc(s->pool, GFP_ATOMIC))) {
+        bio_list_add(&s->overflow, bio);
+        return;
+    }
+
+    e->bio = bio;
+    e->queued = stackbd_now();
+    list_add_tail(&e->list, &s->classes[c].fifo[dir]);
+    s->classes[c].nr_queued[dir]++;
+}
+
+static struct bio *sched_take(struct stackbd_sched *s, int c, int dir,
+        unsigned long now, int expired)
+{
+    struct stackbd_sched_class *cl = &s->classes[c];
+    struct stackbd_sched_entry *e;
+    unsigned long wait;
+    struct bio *bio;
+
+    e = list_first_entry(&cl->fifo[dir], struct stackbd_sched_entry, list);
+    list_del(&e->list);
+    cl->nr_queued[dir]--;
+    s->queued--;
+
+    bio = e->bio;
+    wait = now > e->queued ? now - e->queued : 0;
+    mempool_free(e, s->pool);
+
+    cl->credit -= max(bio_sectors(bio), 1U);
+    cl->dispatched++;
+    if (expired)
+        cl->expired++;
+    cl->wait_hist[min_t(unsigned int, wait ? ilog2(wait) : 0, STACKBD_WAIT_BUCKETS - 1)]++;
+
+    return bio;
+}
+
+/* the oldest bio of the class and direction has waited longer than ms */
+static int sched_expired(struct stackbd_sched *s, int c, int dir, unsigned long now, int ms)
+{
+    struct stackbd_sched_entry *e;
+
+    if (list_empty(&s->classes[c].fifo[dir]))
+        return 0;
+    e = list_first_entry(&s->classes[c].fifo[dir], struct stackbd_sched_entry, list);
+    return now - e->queued > (unsigned long) ms * NSEC_PER_MSEC;
+}
+
+struct bio *stackbd_sched_next(struct stackbd_sched *s, unsigned long now)
+{
+    struct stackbd_sched_class *cl;
+    int c, dir;
+
+    if (!bio_list_empty(&s->overflow)) {
+        s->queued--;
+        return bio_list_pop(&s->overflow);
+    }
+    if (!s->queued)
+        return NULL;
+
+    /* a read that waited too long goes first, whatever its class */
+    for (c = 0; c < STACKBD_NR_CLASSES; c++)
+        if (sched_expired(s, c, READ, now, sched_read_expire_ms))
+            return sched_take(s, c, READ, now, 1);
+    for (c = 0; c < STACKBD_NR_CLASSES; c++)
+        if (sched_expired(s, c, WRITE, now, sched_write_expire_ms))
+            return sched_take(s, c, WRITE, now, 1);
+
+    for (;;) {
+        for (c = 0; c < STACKBD_NR_CLASSES; c++) {
+            cl = &s->classes[c];
+            if (cl->credit <= 0 || !(cl->nr_queued[READ] + cl->nr_queued[WRITE]))
+                continue;
+            /* reads first: the writes have their deadline */
+            dir = cl->nr_queued[READ] ? READ : WRITE;
+            return sched_take(s, c, dir, now, 0);
+        }
+
+        /* the busy classes have used up their shares: a new round */
+        for (c = 0; c < STACKBD_NR_CLASSES; c++) {
+            cl = &s->classes[c];
+            cl->credit = min(cl->credit + sched_share(c), sched_share(c));
+        }
+    }
+}
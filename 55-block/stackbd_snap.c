@@ -0,0 +1,325 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/gfp.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/bitops.h>
+#include <linux/kthread.h>
+
+#include "stackbd.h"
+
+/*
+ * Copy-on-write snapshot of stackbd. See stackbd.h for the overview.
+ */
+
+/*
+ * Radix tree items: the place in the store, shifted clear of the bits
+ * the tree keeps for itself, and never NULL.
+ */
+static void *snap_item(unsigned long place)
+{
+    return (void *) ((place + 1) << 2);
+}
+
+static unsigned long snap_place(void *item)
+{
+    return ((unsigned long) item >> 2) - 1;
+}
+
+static void snap_invalidate(struct stackbd_snap *s, int error)
+{
+    if (!xchg(&s->invalid, 1))
+        printk("stackbd: snapshot invalidated: %d\n", error);
+}
+
+static void snap_read_endio(struct bio *bio, int error)
+{
+    struct stackbd_snap *s = bio->bi_private;
+
+    if (!error && !test_bit(BIO_UPTODATE, &bio->bi_flags))
+        error = -EIO;
+    s->error = error;
+    complete(&s->done);
+}
+
+/* read chunk c of the virtual device, as it is now, into s->buf */
+static int snap_read_chunk(struct stackbd_snap *s, unsigned long c)
+{
+    unsigned int i, nr = s->chunk_sectors >> (PAGE_SHIFT - 9);
+    struct bio_vec *bv;
+    struct bio *bio;
+
+    if (!(bio = bio_alloc(GFP_NOIO, nr)))
+        return -ENOMEM;
+
+    bio->bi_sector = (sector_t) c << s->chunk_shift;
+    bio->bi_rw = READ;
+    bio->bi_end_io = snap_read_endio;
+    bio->bi_private = s;
+    for (i = 0; i < nr; i++) {
+        bv = &bio->bi_io_vec[bio->bi_vcnt++];
+        bv->bv_page = virt_to_page(s->buf + i * PAGE_SIZE);
+        bv->bv_offset = 0;
+        bv->bv_len = PAGE_SIZE;
+        bio->bi_size += PAGE_SIZE;
+    }
+
+    init_completion(&s->done);
+    stackbd_upper_submit(bio);
+    wait_for_completion(&s->done);
+    bio_put(bio);
+
+    return s->error;
+}
+
+/* copy chunk c to the store -- snapshot thread */
+static int snap_copy(struct stackbd_snap *s, unsigned long c)
+{
+    unsigned long place = s->next_free;
+    int rc;
+
+    if (place == s->cow_chunks)
+        return -ENOSPC;
+
+    if ((rc = snap_read_chunk(s, c)) ||
+            (rc = stackbd_sync_io(s->cow, WRITE, (sector_t) place << s->chunk_shift,
+                                  s->buf, s->chunk_sectors * KERNEL_SECTOR_SIZE)) ||
+            (rc = radix_tree_insert(&s->index, c, snap_item(place))))
+        return rc;
+
+    s->next_free++;
+    /* the index entry first: readers look it up once they see the bit */
+    smp_wmb();
+    set_bit(c, s->copied);
+    atomic_long_inc(&s->cow_chunks_copied);
+    return 0;
+}
+
+/* the chunks bio writes to, clipped to the snapshot; 0 if none */
+static int snap_range(struct stackbd_snap *s, struct bio *bio,
+        unsigned long *first, unsigned long *last)
+{
+    *first = bio->bi_sector >> s->chunk_shift;
+    *last = (bio->bi_sector + bio_sectors(bio) - 1) >> s->chunk_shift;
+
+    if (!bio->bi_size || *first >= s->nr_chunks)
+        return 0;
+    *last = min(*last, s->nr_chunks - 1);
+    return 1;
+}
+
+/* make the copies bio is waiting for, then let it go -- snapshot thread */
+static void snap_cow(struct stackbd_snap *s, struct bio *bio)
+{
+    unsigned long c, first, last, start = stackbd_now();
+    int rc, copied = 0;
+
+    snap_range(s, bio, &first, &last);
+    for (c = first; c <= last && !s->invalid; c++) {
+        if (test_bit(c, s->copied))
+            continue;
+        if ((rc = snap_copy(s, c))) {
+            /* the snapshot is lost, not the write */
+            snap_invalidate(s, rc);
+            break;
+        }
+        copied = 1;
+    }
+
+    /* snapshot reads that went to the virtual device before the bits were set */
+    if (copied)
+        stackbd_epoch_drain(&s->epoch);
+
+    atomic_long_inc(&s->cow_writes);
+    atomic_long_add(stackbd_now() - start, &s->cow_ns);
+    stackbd_upper_submit(bio);
+}
+
+static int snap_threadfn(void *data)
+{
+    struct stackbd_snap *s = data;
+    struct bio *bio;
+
+    for (;;) {
+        wait_event_interruptible(s->wait, kthread_should_stop() ||
+                !bio_list_empty(&s->bios));
+
+        spin_lock_irq(&s->lock);
+        bio = bio_list_pop(&s->bios);
+        spin_unlock_irq(&s->lock);
+
+        if (bio)
+            snap_cow(s, bio);
+        else if (kthread_should_stop())
+            break;
+    }
+
+    return 0;
+}
+
+/*
+ * The copy is made by the snapshot thread: it waits for snapshot reads,
+ * which may be queued to the worker behind this write.
+ */
+int stackbd_snap_write(struct stackbd_snap *s, struct bio *bio)
+{
+    unsigned long c, first, last, flags;
+
+    if (!snap_range(s, bio, &first, &last) || ACCESS_ONCE(s->invalid))
+        return 0;
+
+    for (c = first; c <= last; c++)
+        if (!test_bit(c, s->copied))
+            break;
+    if (c > last)
+        return 0;
+
+    spin_lock_irqsave(&s->lock, flags);
+    bio_list_add(&s->bios, bio);
+    wake_up(&s->wait);
+    spin_unlock_irqrestore(&s->lock, flags);
+    return STACKBD_SNAP_QUEUED;
+}
+
+struct snap_read {
+    struct stackbd_snap *s;
+    struct bio *bio;
+    int epoch;                  /* read from the virtual device, or -1 */
+};
+
+static void snap_clone_endio(struct bio *clone, int error)
+{
+    struct snap_read *r = clone->bi_private;
+
+    if (!error && !test_bit(BIO_UPTODATE, &clone->bi_flags))
+        error = -EIO;
+
+    if (r->epoch >= 0)
+        stackbd_epoch_exit(&r->s->epoch, r->epoch);
+    bio_endio(r->bio, error);
+    bio_put(clone);
+    kfree(r);
+}
+
+/* bio does not cross a chunk boundary */
+void stackbd_snap_read(struct stackbd_snap *s, struct bio *bio)
+{
+    unsigned long c = bio->bi_sector >> s->chunk_shift;
+    struct snap_read *r;
+    struct bio *clone;
+    void *item;
+
+    if (bio_data_dir(bio) == WRITE || c >= s->nr_chunks || ACCESS_ONCE(s->invalid)) {
+        bio_io_error(bio);
+        return;
+    }
+    /* read-only: there is nothing to flush */
+    if (!bio->bi_size) {
+        bio_endio(bio, 0);
+        return;
+    }
+
+    if (!(r = kmalloc(sizeof(*r), GFP_NOIO)) || !(clone = bio_clone(bio, GFP_NOIO))) {
+        kfree(r);
+        bio_endio(bio, -ENOMEM);
+        return;
+    }
+    r->s = s;
+    r->bio = bio;
+    clone->bi_end_io = snap_clone_endio;
+    clone->bi_private = r;
+
+    r->epoch = stackbd_epoch_enter(&s->epoch);
+    if (test_bit(c, s->copied)) {
+        stackbd_epoch_exit(&s->epoch, r->epoch);
+        r->epoch = -1;
+
+        smp_rmb();
+        rcu_read_lock();
+        item = radix_tree_lookup(&s->index, c);
+        rcu_read_unlock();
+
+        clone->bi_bdev = s->cow;
+        clone->bi_sector = ((sector_t) snap_place(item) << s->chunk_shift) +
+            (bio->bi_sector & (s->chunk_sectors - 1));
+        atomic_long_inc(&s->reads_cow);
+        generic_make_request(clone);
+        return;
+    }
+
+    /* not written to since the snapshot: the virtual device has it */
+    atomic_long_inc(&s->reads_origin);
+    stackbd_submit(clone);
+}
+
+int stackbd_snap_init(struct stackbd_snap *s, struct block_device *cow,
+        unsigned int chunk_sectors, sector_t capacity)
+{
+    int rc;
+
+    if (!is_power_of_2(chunk_sectors) || chunk_sectors < PAGE_SIZE >> 9)
+        return -EINVAL;
+
+    s->cow = cow;
+    s->chunk_sectors = chunk_sectors;
+    s->chunk_shift = ilog2(chunk_sectors);
+    s->nr_chunks = capacity >> s->chunk_shift;
+    s->cow_chunks = get_capacity(cow->bd_disk) >> s->chunk_shift;
+    s->invalid = 0;
+    s->next_free = 0;
+    INIT_RADIX_TREE(&s->index, GFP_NOIO);
+    spin_lock_init(&s->lock);
+    bio_list_init(&s->bios);
+    init_waitqueue_head(&s->wait);
+    stackbd_epoch_init(&s->epoch);
+
+    s->copied = vmalloc(BITS_TO_LONGS(s->nr_chunks) * sizeof(long));
+    s->buf = (void *) __get_free_pages(GFP_KERNEL,
+            get_order(chunk_sectors * KERNEL_SECTOR_SIZE));
+    rc = -ENOMEM;
+    if (!s->copied || !s->buf)
+        goto error;
+    bitmap_zero(s->copied, s->nr_chunks);
+
+    s->thread = kthread_run(snap_threadfn, s, "stackbd_snap");
+    if (IS_ERR(s->thread)) {
+        rc = PTR_ERR(s->thread);
+        goto error;
+    }
+
+    printk("stackbd: snapshot of %lu chunks of %u sectors, COW store: %lu chunks\n",
+            s->nr_chunks, chunk_sectors, s->cow_chunks);
+    return 0;
+
+error:
+    vfree(s->copied);
+    if (s->buf)
+        free_pages((unsigned long) s->buf, get_order(chunk_sectors * KERNEL_SECTOR_SIZE));
+    s->copied = NULL;
+    return rc;
+}
+
+void stackbd_snap_exit(struct stackbd_snap *s)
+{
+    unsigned long c;
+
+    if (!s->copied)
+        return;
+
+    /* the writes still queued are let through first */
+    kthread_stop(s->thread);
+
+    for (c = find_first_bit(s->copied, s->nr_chunks); c < s->nr_chunks;
+            c = find_next_bit(s->copied, s->nr_chunks, c + 1))
+        radix_tree_delete(&s->index, c);
+
+    vfree(s->copied);
+    free_pages((unsigned long) s->buf, get_order(s->chunk_sectors * KERNEL_SECTOR_SIZE));
+    s->copied = NULL;
+
+    pr_info("%s: snapshot -- chunks copied: %ld of %lu -- writes delayed: %ld\n",
+            DEVNAME, atomic_long_read(&s->cow_chunks_copied), s->cow_chunks,
+            atomic_long_read(&s->cow_writes));
+}
@@ -0,0 +1,450 @@
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/gfp.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/crc32.h>
+#include <linux/kthread.h>
+
+#include "stackbd.h"
+
+/*
+ * Hot/cold tiering of stackbd. See stackbd.h for the overview.
+ */
+
+/* how often heat is halved and chunks are moved */
+static int tier_interval_ms = 1000;
+module_param(tier_interval_ms, int, S_IRUGO | S_IWUSR);
+/* migration bandwidth, MB/s, 0 - unlimited */
+static int tier_mbps = 20;
+module_param(tier_mbps, int, S_IRUGO | S_IWUSR);
+/* pause migration while more foreground bios than this are in flight */
+static int tier_busy_inflight = 8;
+module_param(tier_busy_inflight, int, S_IRUGO | S_IWUSR);
+/* heat a chunk needs to be promoted */
+static int tier_promote_min = 4;
+module_param(tier_promote_min, int, S_IRUGO | S_IWUSR);
+
+#define TIER_MAGIC      0x54425453      /* "STBT" */
+#define TIER_VERSION    1
+
+/* most chunks moved per interval */
+#define TIER_MOVES      16
+/* copies started over because of writes before giving up */
+#define TIER_RETRIES    3
+/* copy buffer: 64K */
+#define TIER_BUF_ORDER  (16 - PAGE_SHIFT)
+
+#define TIER_PER_SECTOR (KERNEL_SECTOR_SIZE / sizeof(__le32))
+
+/* on-disk header in sector 0 of the fast target; the remap table follows */
+struct stackbd_tier_hdr {
+    __le32 magic;
+    __le32 version;
+    __le32 chunk_sectors;
+    __le32 vchunks;
+    __le32 fchunks;
+    __le32 crc;         /* of the above */
+} __packed;
+
+static sector_t fast_sector(struct stackbd_tier *t, u32 f)
+{
+    return t->data_start + ((sector_t) f << t->chunk_shift);
+}
+
+/* wait for all the bios mapped before now -- tier thread only */
+static void tier_drain(struct stackbd_tier *t)
+{
+    stackbd_epoch_drain(&t->epoch);
+}
+
+/*
+ * Translate the bio's sector. The bio must not cross a chunk boundary.
+ * Returns 0 with the target and sector, and the epoch to be passed to
+ * stackbd_epoch_exit() on t->epoch on completion; -EWOULDBLOCK if the bio is a
+ * write that has to wait for a migration and may_block is not set.
+ */
+int stackbd_tier_map(struct stackbd_tier *t, struct bio *bio, int may_block,
+        struct stackbd_member **m, sector_t *sector, int *epoch)
+{
+    u32 v = bio->bi_sector >> t->chunk_shift, f;
+    sector_t offset = bio->bi_sector & (t->chunk_sectors - 1);
+    int e;
+
+    if (v >= t->vchunks)
+        return -EIO;
+
+    for (;;) {
+        e = stackbd_epoch_enter(&t->epoch);
+        if (bio_data_dir(bio) != WRITE || ACCESS_ONCE(t->mig_vchunk) != v)
+            break;
+        if (!ACCESS_ONCE(t->mig_hold)) {
+            t->mig_dirty = 1;
+            break;
+        }
+
+        stackbd_epoch_exit(&t->epoch, e);
+        if (!may_block)
+            return -EWOULDBLOCK;
+        wait_event(t->wait, ACCESS_ONCE(t->mig_vchunk) != v ||
+                !ACCESS_ONCE(t->mig_hold));
+    }
+
+    t->heat[v]++;
+
+    f = ACCESS_ONCE(t->table[v]);
+    if (f == STACKBD_TIER_SLOW) {
+        *m = t->slow;
+        *sector = bio->bi_sector;
+        atomic_long_inc(&t->slow_ios);
+    } else {
+        *m = t->fast;
+        *sector = fast_sector(t, f) + offset;
+        atomic_long_inc(&t->fast_ios);
+    }
+
+    *epoch = e;
+    return 0;
+}
+
+/* write out the sector of the remap table that holds v's entry, as f */
+static int tier_persist(struct stackbd_tier *t, u32 v, u32 f)
+{
+    __le32 *p = t->sector_buf;
+    u32 first = v - v % TIER_PER_SECTOR, i;
+
+    for (i = 0; i < TIER_PER_SECTOR; i++) {
+        if (first + i == v)
+            p[i] = cpu_to_le32(f);
+        else if (first + i < t->vchunks)
+            p[i] = cpu_to_le32(t->table[first + i]);
+        else
+            p[i] = cpu_to_le32(STACKBD_TIER_SLOW);
+    }
+
+    /* the flush makes the copied data durable before the entry is */
+    return stackbd_sync_io(t->fast->bdev, WRITE_FLUSH_FUA,
+            1 + first / TIER_PER_SECTOR, p, KERNEL_SECTOR_SIZE);
+}
+
+/*
+ * Copy chunk v to f on the fast target (promote) or from its fast chunk
+ * back home (demote), and switch the remap table entry over. Writes to v
+ * during the copy make it start over; they are held only while the copy
+ * is checked and the entry switched.
+ */
+static int tier_move(struct stackbd_tier *t, u32 v, u32 f, int promote)
+{
+    sector_t home = (sector_t) v << t->chunk_shift;
+    int tries, rc = -EBUSY;
+
+    t->mig_vchunk = v;
+
+    for (tries = 0; tries < TIER_RETRIES; tries++) {
+        /* writes that got in before this are done once the drain is */
+        t->mig_dirty = 0;
+        tier_drain(t);
+
+        if (promote)
+            rc = stackbd_copy_range(&t->copier, t->slow->bdev, home,
+                    &t->fast->bdev, 1, fast_sector(t, f), t->chunk_sectors);
+        else
+            rc = stackbd_copy_range(&t->copier, t->fast->bdev, fast_sector(t, f),
+                    &t->slow->bdev, 1, home, t->chunk_sectors);
+        if (rc)
+            break;
+
+        t->mig_hold = 1;
+        tier_drain(t);
+        if (!t->mig_dirty) {
+            /* FIXME:VER before 2.6.36 blkdev_issue_flush() took flags */
+            if (!promote)
+                rc = blkdev_issue_flush(t->slow->bdev, GFP_NOIO, NULL);
+            if (!rc)
+                rc = tier_persist(t, v, promote ? f : STACKBD_TIER_SLOW);
+            if (!rc)
+                ACCESS_ONCE(t->table[v]) = promote ? f : STACKBD_TIER_SLOW;
+            break;
+        }
+
+        rc = -EBUSY;
+        t->mig_hold = 0;
+        wake_up(&t->wait);
+    }
+
+    t->mig_hold = 0;
+    t->mig_vchunk = STACKBD_TIER_SLOW;
+    smp_mb();
+    wake_up(&t->wait);
+
+    if (rc == -EBUSY)
+        atomic_long_inc(&t->aborts);
+    else if (rc && rc != -EINTR)
+        printk("stackbd: tier: moving chunk %u failed: %d\n", v, rc);
+    return rc;
+}
+
+static int tier_promote(struct stackbd_tier *t, u32 v)
+{
+    u32 f;
+
+    for (f = 0; f < t->fchunks && t->owner[f] != STACKBD_TIER_SLOW; f++)
+        ;
+    if (f == t->fchunks || tier_move(t, v, f, 1))
+        return -EAGAIN;
+
+    t->owner[f] = v;
+    t->nr_fast++;
+    atomic_long_inc(&t->promotions);
+    return 0;
+}
+
+static int tier_demote(struct stackbd_tier *t, u32 v)
+{
+    u32 f = t->table[v];
+
+    if (tier_move(t, v, f, 0))
+        return -EAGAIN;
+
+    /* reads mapped to the fast chunk before the switch */
+    tier_drain(t);
+    t->owner[f] = STACKBD_TIER_SLOW;
+    t->nr_fast--;
+    atomic_long_inc(&t->demotions);
+    return 0;
+}
+
+/* promote the hottest slow chunk if it is worth it; returns 1 if one was */
+static int tier_rebalance(struct stackbd_tier *t)
+{
+    u32 v, h, hot = STACKBD_TIER_SLOW, cold = STACKBD_TIER_SLOW;
+    u32 hot_heat = 0, cold_heat = ~0U;
+
+    for (v = 0; v < t->vchunks; v++) {
+        h = ACCESS_ONCE(t->heat[v]);
+        if (t->table[v] == STACKBD_TIER_SLOW) {
+            if (h > hot_heat) {
+                hot = v;
+                hot_heat = h;
+            }
+        } else if (h < cold_heat) {
+            cold = v;
+            cold_heat = h;
+        }
+    }
+
+    if (hot == STACKBD_TIER_SLOW || hot_heat < tier_promote_min)
+        return 0;
+
+    /* full: push out a chunk that is at most half as hot */
+    if (t->nr_fast == t->fchunks) {
+        if (cold == STACKBD_TIER_SLOW || cold_heat >= hot_heat / 2)
+            return 0;
+        if (tier_demote(t, cold))
+            return 0;
+    }
+
+    return !tier_promote(t, hot);
+}
+
+static int tier_threadfn(void *data)
+{
+    struct stackbd_tier *t = data;
+    u32 v;
+    int i;
+
+    while (!kthread_should_stop()) {
+        schedule_timeout_interruptible(msecs_to_jiffies(tier_interval_ms));
+
+        for (i = 0; i < TIER_MOVES && !kthread_should_stop(); i++)
+            if (!tier_rebalance(t))
+                break;
+
+        for (v = 0; v < t->vchunks; v++)
+            t->heat[v] >>= 1;
+    }
+
+    return 0;
+}
+
+static u32 tier_hdr_crc(struct stackbd_tier_hdr *hdr)
+{
+    return crc32_le(~0, (unsigned char *) hdr, offsetof(struct stackbd_tier_hdr, crc));
+}
+
+/* load the remap table, or format the fast target if it has none */
+static int tier_load(struct stackbd_tier *t)
+{
+    struct stackbd_tier_hdr *hdr = t->sector_buf;
+    __le32 *p = t->buf;
+    unsigned int per_buf = (PAGE_SIZE << TIER_BUF_ORDER) / sizeof(*p);
+    u32 v, i, n, f;
+    int format, rc;
+
+    if ((rc = stackbd_sync_io(t->fast->bdev, READ, 0, hdr, KERNEL_SECTOR_SIZE)))
+        return rc;
+
+    format = le32_to_cpu(hdr->magic) != TIER_MAGIC;
+    if (format) {
+        pr_info("%s: no tier metadata found, formatting\n", DEVNAME);
+    } else if (le32_to_cpu(hdr->crc) != tier_hdr_crc(hdr) ||
+            le32_to_cpu(hdr->version) != TIER_VERSION ||
+            le32_to_cpu(hdr->chunk_sectors) != t->chunk_sectors ||
+            le32_to_cpu(hdr->vchunks) != t->vchunks ||
+            le32_to_cpu(hdr->fchunks) != t->fchunks) {
+        pr_info("%s: tier metadata does not match the configuration\n", DEVNAME);
+        return -EINVAL;
+    }
+
+    for (v = 0; v < t->vchunks; v += n) {
+        n = min(per_buf, t->vchunks - v);
+        if (format) {
+            for (i = 0; i < n; i++)
+                t->table[v + i] = STACKBD_TIER_SLOW;
+            continue;
+        }
+
+        if ((rc = stackbd_sync_io(t->fast->bdev, READ, 1 + v / TIER_PER_SECTOR, p,
+                        roundup(n * sizeof(*p), KERNEL_SECTOR_SIZE))))
+            return rc;
+        for (i = 0; i < n; i++) {
+            f = le32_to_cpu(p[i]);
+            if (f != STACKBD_TIER_SLOW &&
+                    (f >= t->fchunks || t->owner[f] != STACKBD_TIER_SLOW)) {
+                pr_info("%s: tier remap table is corrupt\n", DEVNAME);
+                return -EIO;
+            }
+            t->table[v + i] = f;
+            if (f != STACKBD_TIER_SLOW) {
+                t->owner[f] = v + i;
+                t->nr_fast++;
+            }
+        }
+    }
+
+    if (!format) {
+        pr_info("%s: tier remap table loaded -- %u of %u fast chunks in use\n",
+                DEVNAME, t->nr_fast, t->fchunks);
+        return 0;
+    }
+
+    /* an all-slow table, then the header that makes it valid */
+    for (i = 0; i < per_buf; i++)
+        p[i] = cpu_to_le32(STACKBD_TIER_SLOW);
+    for (v = 0; v < t->vchunks; v += n) {
+        n = min(per_buf, t->vchunks - v);
+        if ((rc = stackbd_sync_io(t->fast->bdev, WRITE, 1 + v / TIER_PER_SECTOR, p,
+                        roundup(n * sizeof(*p), KERNEL_SECTOR_SIZE))))
+            return rc;
+    }
+
+    memset(hdr, 0, KERNEL_SECTOR_SIZE);
+    hdr->magic = cpu_to_le32(TIER_MAGIC);
+    hdr->version = cpu_to_le32(TIER_VERSION);
+    hdr->chunk_sectors = cpu_to_le32(t->chunk_sectors);
+    hdr->vchunks = cpu_to_le32(t->vchunks);
+    hdr->fchunks = cpu_to_le32(t->fchunks);
+    hdr->crc = cpu_to_le32(tier_hdr_crc(hdr));
+    return stackbd_sync_io(t->fast->bdev, WRITE_FLUSH_FUA, 0, hdr, KERNEL_SECTOR_SIZE);
+}
+
+static void tier_free(struct stackbd_tier *t)
+{
+    vfree(t->table);
+    vfree(t->owner);
+    vfree(t->heat);
+    if (t->buf)
+        free_pages((unsigned long) t->buf, TIER_BUF_ORDER);
+    kfree(t->sector_buf);
+    t->table = NULL;
+}
+
+int stackbd_tier_init(struct stackbd_tier *t, struct stackbd_member *fast,
+        struct stackbd_member *slow, unsigned int chunk_sectors, atomic_t *inflight)
+{
+    sector_t table_sectors;
+    u32 f;
+    int rc;
+
+    if (!is_power_of_2(chunk_sectors) || chunk_sectors < PAGE_SIZE >> 9)
+        return -EINVAL;
+
+    t->fast = fast;
+    t->slow = slow;
+    t->inflight = inflight;
+    t->chunk_sectors = chunk_sectors;
+    t->chunk_shift = ilog2(chunk_sectors);
+    t->vchunks = min_t(sector_t, slow->capacity >> t->chunk_shift, STACKBD_TIER_SLOW - 1);
+
+    /* the data area starts chunk-aligned after the table */
+    table_sectors = DIV_ROUND_UP(t->vchunks, TIER_PER_SECTOR);
+    t->data_start = roundup(1 + table_sectors, (sector_t) chunk_sectors);
+    if (!t->vchunks || fast->capacity <= t->data_start + chunk_sectors) {
+        printk("stackbd: tier: the fast target is too small\n");
+        return -ENOSPC;
+    }
+    t->fchunks = (fast->capacity - t->data_start) >> t->chunk_shift;
+
+    t->nr_fast = 0;
+    t->mig_vchunk = STACKBD_TIER_SLOW;
+    t->mig_hold = t->mig_dirty = 0;
+    stackbd_epoch_init(&t->epoch);
+    init_waitqueue_head(&t->wait);
+
+    t->table = vmalloc(t->vchunks * sizeof(*t->table));
+    t->owner = vmalloc(t->fchunks * sizeof(*t->owner));
+    t->heat = vmalloc(t->vchunks * sizeof(*t->heat));
+    t->buf = (void *) __get_free_pages(GFP_KERNEL, TIER_BUF_ORDER);
+    t->sector_buf = kmalloc(KERNEL_SECTOR_SIZE, GFP_KERNEL);
+    rc = -ENOMEM;
+    if (!t->table || !t->owner || !t->heat || !t->buf || !t->sector_buf)
+        goto error;
+
+    /* a chunk at a time, the foreground first */
+    memset(&t->copier, 0, sizeof(t->copier));
+    t->copier.buf = t->buf;
+    t->copier.buf_sectors = (PAGE_SIZE << TIER_BUF_ORDER) >> 9;
+    t->copier.inflight = inflight;
+    t->copier.busy_inflight = &tier_busy_inflight;
+    t->copier.mbps = &tier_mbps;
+    t->copier.copied_sectors = &t->migrated_sectors;
+    t->copier.throttled_ms = &t->throttled_ms;
+
+    memset(t->heat, 0, t->vchunks * sizeof(*t->heat));
+    for (f = 0; f < t->fchunks; f++)
+        t->owner[f] = STACKBD_TIER_SLOW;
+
+    if ((rc = tier_load(t)))
+        goto error;
+
+    t->thread = kthread_run(tier_threadfn, t, "stackbd_tier");
+    if (IS_ERR(t->thread)) {
+        rc = PTR_ERR(t->thread);
+        goto error;
+    }
+
+    printk("stackbd: tiering %u chunks of %u sectors, %u fast chunks\n",
+            t->vchunks, t->chunk_sectors, t->fchunks);
+    return 0;
+
+error:
+    tier_free(t);
+    return rc;
+}
+
+void stackbd_tier_exit(struct stackbd_tier *t)
+{
+    if (!t->table)
+        return;
+
+    /* a move in progress gives up, the table stays as it was */
+    kthread_stop(t->thread);
+    tier_free(t);
+
+    pr_info("%s: tier -- promotions: %ld -- demotions: %ld -- migrated sectors: %ld\n",
+            DEVNAME, atomic_long_read(&t->promotions), atomic_long_read(&t->demotions),
+            atomic_long_read(&t->migrated_sectors));
+}
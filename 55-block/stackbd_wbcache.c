@@ -0,0 +1,983 @@
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/gfp.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/hash.h>
+#include <linux/sort.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/completion.h>
+
+#include "stackbd.h"
+
+/*
+ * Write-back and read cache of stackbd. See stackbd.h for the overview.
+ */
+
+/* start writing back when this share (%) of the cache is dirty */
+static int cache_dirty_ratio = 20;
+module_param(cache_dirty_ratio, int, S_IRUGO | S_IWUSR);
+/* write back whatever is dirty at least this often */
+static int cache_writeback_ms = 1000;
+module_param(cache_writeback_ms, int, S_IRUGO | S_IWUSR);
+/* how far to read ahead of sequential readers, 0 - don't */
+static int cache_readahead_kb = 128;
+module_param(cache_readahead_kb, int, S_IRUGO | S_IWUSR);
+
+/* most blocks taken by one writeback pass */
+#define WB_BATCH 256
+
+/* 2Q: a1in gets reclaimed from past 1/A1IN_SHARE of the cache */
+#define A1IN_SHARE 4
+/* a1out remembers 1/A1OUT_SHARE of the cache worth of blocks */
+#define A1OUT_SHARE 2
+
+#define CBLOCK_SECTORS  (PAGE_SIZE >> 9)
+#define CBLOCK_SHIFT    (PAGE_SHIFT - 9)
+
+/* what cache_walk() does with each piece of the bio */
+enum {
+    CACHE_HIT,          /* check that all of it is in the cache */
+    CACHE_STALE,        /* check that none of it is newer in the cache */
+    CACHE_READ,         /* copy out, all of it is there */
+    CACHE_WRITE,        /* copy in and mark dirty */
+    CACHE_WRITE_THROUGH,/* update the blocks there are, the target gets it too */
+    CACHE_FILL,         /* a read came back from the target: cache what's missing */
+    CACHE_FILL_PRESENT  /* same, but into the blocks there already are only */
+};
+
+static unsigned long sector_mask(unsigned int first, unsigned int nr)
+{
+    return (nr == BITS_PER_LONG ? ~0UL : (1UL << nr) - 1) << first;
+}
+
+static unsigned int cache_dirty_thresh(struct stackbd_wbcache *c)
+{
+    return c->nr_blocks * cache_dirty_ratio / 100;
+}
+
+static struct hlist_head *cblock_head(struct stackbd_wbcache *c, sector_t block)
+{
+    return &c->hash[hash_long((unsigned long) block, c->hash_bits)];
+}
+
+/* called with c->lock held */
+static struct stackbd_cblock *cblock_lookup(struct stackbd_wbcache *c, sector_t block)
+{
+    struct stackbd_cblock *b;
+    struct hlist_node *n;
+
+    /* FIXME:VER 3.9+ hlist_for_each_entry() has no node argument */
+    hlist_for_each_entry(b, n, cblock_head(c, block), hash)
+        if (b->block == block)
+            return b;
+    return NULL;
+}
+
+static struct hlist_head *ghost_head(struct stackbd_wbcache *c, sector_t block)
+{
+    return &c->ghost_hash[hash_long((unsigned long) block, c->hash_bits)];
+}
+
+/* remember a block pushed out of a1in, forgetting the oldest one if need be */
+static void ghost_add(struct stackbd_wbcache *c, sector_t block)
+{
+    struct stackbd_ghost *g;
+
+    if (!list_empty(&c->ghost_free)) {
+        g = list_first_entry(&c->ghost_free, struct stackbd_ghost, list);
+    } else {
+        g = list_first_entry(&c->ghost_fifo, struct stackbd_ghost, list);
+        hlist_del(&g->hash);
+    }
+
+    list_move_tail(&g->list, &c->ghost_fifo);
+    g->block = block;
+    hlist_add_head(&g->hash, ghost_head(c, block));
+}
+
+/* is the block remembered in a1out? it is forgotten if so */
+static int ghost_take(struct stackbd_wbcache *c, sector_t block)
+{
+    struct stackbd_ghost *g;
+    struct hlist_node *n;
+
+    hlist_for_each_entry(g, n, ghost_head(c, block), hash) {
+        if (g->block == block) {
+            hlist_del(&g->hash);
+            list_move(&g->list, &c->ghost_free);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* put a clean block on its 2Q queue */
+static void cblock_clean(struct stackbd_wbcache *c, struct stackbd_cblock *b)
+{
+    if (b->queue == STACKBD_Q_AM) {
+        list_add(&b->list, &c->am);
+        c->nr_am++;
+    } else {
+        list_add(&b->list, &c->a1in);
+        c->nr_a1in++;
+    }
+}
+
+/* take a clean block off its 2Q queue, if it is on one yet */
+static void cblock_unclean(struct stackbd_wbcache *c, struct stackbd_cblock *b)
+{
+    if (list_empty(&b->list))
+        return;
+
+    list_del_init(&b->list);
+    if (b->queue == STACKBD_Q_AM)
+        c->nr_am--;
+    else
+        c->nr_a1in--;
+}
+
+/*
+ * A block for caching block number 'block': a free one, or a clean one
+ * reclaimed 2Q-style. Comes on no list; the caller puts it on one.
+ * Called with c->lock held.
+ */
+static struct stackbd_cblock *cblock_get(struct stackbd_wbcache *c, sector_t block)
+{
+    struct stackbd_cblock *b;
+
+    if (!list_empty(&c->free)) {
+        b = list_first_entry(&c->free, struct stackbd_cblock, list);
+        list_del_init(&b->list);
+    } else {
+        if (c->nr_a1in && (c->nr_a1in > c->nr_blocks / A1IN_SHARE || !c->nr_am)) {
+            b = list_entry(c->a1in.prev, struct stackbd_cblock, list);
+            ghost_add(c, b->block);
+        } else if (c->nr_am) {
+            b = list_entry(c->am.prev, struct stackbd_cblock, list);
+        } else {
+            return NULL;
+        }
+
+        cblock_unclean(c, b);
+        hlist_del(&b->hash);
+        if (b->prefetched)
+            atomic_long_inc(&c->ra_wasted);
+    }
+
+    b->block = block;
+    b->valid = b->dirty = b->wb = 0;
+    b->fill = b->prefetched = 0;
+    b->queue = ghost_take(c, block) ? STACKBD_Q_AM : STACKBD_Q_A1IN;
+    hlist_add_head(&b->hash, cblock_head(c, block));
+    return b;
+}
+
+/* give back a block that never got any data */
+static void cblock_put(struct stackbd_wbcache *c, struct stackbd_cblock *b)
+{
+    hlist_del(&b->hash);
+    list_add(&b->list, &c->free);
+}
+
+/* copy the sectors in mask from the bio piece at data to the block */
+static void cblock_fill(struct stackbd_cblock *b, unsigned int off, char *data,
+        unsigned int n, unsigned long mask)
+{
+    char *p = page_address(b->page) + off;
+    unsigned int s;
+
+    for (s = 0; s < n >> 9; s++)
+        if (mask & (1UL << ((off >> 9) + s)))
+            memcpy(p + (s << 9), data + (s << 9), 512);
+}
+
+/*
+ * Go over the bio piece by piece, a piece being the part of a segment
+ * within one cache block. Called with c->lock held, so the blocks found
+ * can't be reclaimed under us; with CACHE_WRITE, the blocks already
+ * written to are dirty and are not reclaimed either. Writes return
+ * -EAGAIN on a block being read ahead into: the read would land over
+ * them.
+ */
+static int cache_walk(struct stackbd_wbcache *c, struct bio *bio, int op)
+{
+    sector_t sector = bio->bi_sector;
+    struct stackbd_cblock *b;
+    struct bio_vec *bv;
+    unsigned long flags, mask;
+    unsigned int i, done, off, n;
+    char *data, *p;
+    int fresh;
+
+    bio_for_each_segment(bv, bio, i) {
+        for (done = 0; done < bv->bv_len; done += n, sector += n >> 9) {
+            off = (sector & (CBLOCK_SECTORS - 1)) << 9;
+            n = min_t(unsigned int, bv->bv_len - done, PAGE_SIZE - off);
+            mask = sector_mask(off >> 9, n >> 9);
+            b = cblock_lookup(c, sector >> CBLOCK_SHIFT);
+
+            switch (op) {
+            case CACHE_HIT:
+                if (!b || (b->valid & mask) != mask)
+                    return -ENOENT;
+                continue;
+            case CACHE_STALE:
+                if (b && ((b->dirty | b->wb) & mask))
+                    return -EBUSY;
+                continue;
+            case CACHE_READ:
+                if (b->prefetched) {
+                    b->prefetched = 0;
+                    atomic_long_inc(&c->ra_hits);
+                }
+                /* a1in is a FIFO, only am is kept in LRU order */
+                if (b->queue == STACKBD_Q_AM && !b->dirty && !b->wb)
+                    list_move(&b->list, &c->am);
+                break;
+            case CACHE_WRITE:
+                if (!b && !(b = cblock_get(c, sector >> CBLOCK_SHIFT)))
+                    return -ENOSPC;
+                if (b->fill)
+                    return -EAGAIN;
+                if (!b->dirty && !b->wb) {
+                    cblock_unclean(c, b);
+                    list_add_tail(&b->list, &c->dirty);
+                    c->nr_dirty++;
+                }
+                b->valid |= mask;
+                b->dirty |= mask;
+                b->prefetched = 0;
+                break;
+            case CACHE_WRITE_THROUGH:
+                if (!b)
+                    continue;
+                if (b->fill)
+                    return -EAGAIN;
+                b->valid |= mask;
+                if (b->dirty && !(b->dirty &= ~mask) && !b->wb) {
+                    list_del_init(&b->list);
+                    c->nr_dirty--;
+                    cblock_clean(c, b);
+                }
+                break;
+            case CACHE_FILL:
+            case CACHE_FILL_PRESENT:
+                fresh = 0;
+                if (!b) {
+                    if (op == CACHE_FILL_PRESENT ||
+                            !(b = cblock_get(c, sector >> CBLOCK_SHIFT)))
+                        continue;
+                    fresh = 1;
+                }
+                /* what is valid is as new as what the target returned */
+                if (b->fill || !(mask &= ~b->valid))
+                    continue;
+
+                data = bvec_kmap_irq(bv, &flags) + done;
+                cblock_fill(b, off, data, n, mask);
+                bvec_kunmap_irq(data, &flags);
+
+                b->valid |= mask;
+                if (fresh) {
+                    cblock_clean(c, b);
+                    atomic_long_inc(&c->read_fills);
+                }
+                continue;
+            }
+
+            data = bvec_kmap_irq(bv, &flags) + done;
+            p = page_address(b->page) + off;
+            if (op == CACHE_READ)
+                memcpy(data, p, n);
+            else
+                memcpy(p, data, n);
+            bvec_kunmap_irq(data, &flags);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Writeback: bios are built by hand from the cache pages, so they have to
+ * keep to the limits of the layout below, which stackbd_mergeable_bvec()
+ * and stackbd_split() take care of for bios coming from above.
+ */
+
+struct wb_batch {
+    atomic_t pending;
+    struct completion done;
+    int error;
+};
+
+static void wb_batch_init(struct wb_batch *batch)
+{
+    /* one reference for the submitter, dropped by wb_batch_wait() */
+    atomic_set(&batch->pending, 1);
+    init_completion(&batch->done);
+    batch->error = 0;
+}
+
+static void wb_endio(struct bio *bio, int error)
+{
+    struct wb_batch *batch = bio->bi_private;
+
+    if (!error && !test_bit(BIO_UPTODATE, &bio->bi_flags))
+        error = -EIO;
+    if (error)
+        batch->error = error;
+
+    bio_put(bio);
+    if (atomic_dec_and_test(&batch->pending))
+        complete(&batch->done);
+}
+
+static struct bio *cache_bio_alloc(struct stackbd_wbcache *c, unsigned long rw,
+        sector_t sector, bio_end_io_t *end_io, void *private)
+{
+    struct bio *bio;
+
+    bio = bio_alloc(GFP_NOIO, rw & REQ_FLUSH ? 0 :
+            min_t(unsigned int, BIO_MAX_PAGES, c->max_segments));
+    if (!bio)
+        return NULL;
+
+    bio->bi_sector = sector;
+    bio->bi_rw = rw;
+    bio->bi_end_io = end_io;
+    bio->bi_private = private;
+    return bio;
+}
+
+static void wb_bio_submit(struct bio *bio, struct wb_batch *batch)
+{
+    atomic_inc(&batch->pending);
+    stackbd_lower_submit(bio);
+}
+
+static int wb_batch_wait(struct wb_batch *batch)
+{
+    if (!atomic_dec_and_test(&batch->pending))
+        wait_for_completion(&batch->done);
+    return batch->error;
+}
+
+/* can sectors [sector, sector + nr) be appended to bio? */
+static int cache_bio_fits(struct stackbd_wbcache *c, struct bio *bio,
+        sector_t sector, unsigned int nr)
+{
+    unsigned int size = bio->bi_size >> 9;
+
+    /*
+     * A run that starts and ends partway through a page spans one page more
+     * than its size in pages, so count the bvecs and not just the sectors.
+     * bi_max_vecs may be rounded up to the bvec pool's size.
+     */
+    if (bio->bi_sector + size != sector || bio->bi_vcnt == bio->bi_max_vecs ||
+            bio->bi_vcnt >= c->max_segments)
+        return 0;
+    if (size + nr > c->max_sectors)
+        return 0;
+    /* the pieces are within a block, and blocks don't cross the boundary */
+    return !c->boundary || (sector & (c->boundary - 1)) != 0;
+}
+
+static int cblock_cmp(const void *l, const void *r)
+{
+    sector_t a = (*(struct stackbd_cblock * const *) l)->block;
+    sector_t b = (*(struct stackbd_cblock * const *) r)->block;
+
+    return a < b ? -1 : a > b;
+}
+
+/*
+ * Write back up to max blocks from the head of the dirty list and wait
+ * for them. Returns the number of blocks written or an error; the blocks
+ * of a failed pass stay dirty. Called with wb_mutex held.
+ */
+static int cache_writeback(struct stackbd_wbcache *c, unsigned int max)
+{
+    struct stackbd_cblock **v = c->wb_vec, *b;
+    struct wb_batch batch;
+    struct bio_vec *bv;
+    struct bio *bio = NULL;
+    unsigned long flags, sectors = 0;
+    unsigned int nr = 0, nr_bios = 0, i, first, len;
+    sector_t sector;
+
+    spin_lock_irqsave(&c->lock, flags);
+    while (nr < max && nr < WB_BATCH && !list_empty(&c->dirty)) {
+        b = list_first_entry(&c->dirty, struct stackbd_cblock, list);
+        list_del_init(&b->list);
+        b->wb = b->dirty;
+        b->dirty = 0;
+        c->nr_dirty--;
+        c->nr_wb++;
+        v[nr++] = b;
+    }
+    spin_unlock_irqrestore(&c->lock, flags);
+
+    if (!nr)
+        return 0;
+
+    /* in block order, so that adjacent blocks end up in the same bio */
+    sort(v, nr, sizeof(*v), cblock_cmp, NULL);
+
+    wb_batch_init(&batch);
+    for (i = 0; i < nr; i++) {
+        b = v[i];
+        /* each run of dirty sectors in the block is a piece */
+        for (first = 0; first < CBLOCK_SECTORS; first += len) {
+            if (!(b->wb & (1UL << first))) {
+                len = 1;
+                continue;
+            }
+            for (len = 1; first + len < CBLOCK_SECTORS &&
+                    (b->wb & (1UL << (first + len))); len++)
+                ;
+
+            sector = (b->block << CBLOCK_SHIFT) + first;
+            if (bio && !cache_bio_fits(c, bio, sector, len)) {
+                wb_bio_submit(bio, &batch);
+                bio = NULL;
+            }
+            if (!bio) {
+                if (!(bio = cache_bio_alloc(c, WRITE, sector, wb_endio, &batch))) {
+                    batch.error = -ENOMEM;
+                    goto submitted;
+                }
+                nr_bios++;
+            }
+
+            bv = &bio->bi_io_vec[bio->bi_vcnt++];
+            bv->bv_page = b->page;
+            bv->bv_offset = first << 9;
+            bv->bv_len = len << 9;
+            bio->bi_size += len << 9;
+            sectors += len;
+        }
+    }
+    if (bio)
+        wb_bio_submit(bio, &batch);
+
+submitted:
+    wb_batch_wait(&batch);
+
+    spin_lock_irqsave(&c->lock, flags);
+    for (i = 0; i < nr; i++) {
+        b = v[i];
+        if (batch.error)
+            b->dirty |= b->wb;
+        b->wb = 0;
+        c->nr_wb--;
+        if (b->dirty) {
+            list_add_tail(&b->list, &c->dirty);
+            c->nr_dirty++;
+        } else {
+            cblock_clean(c, b);
+        }
+    }
+    c->events++;
+    spin_unlock_irqrestore(&c->lock, flags);
+    wake_up(&c->space_wait);
+
+    atomic_long_inc(&c->wb_passes);
+    atomic_long_add(nr_bios, &c->wb_bios);
+    atomic_long_add(nr, &c->wb_blocks);
+    atomic_long_add(sectors, &c->wb_sectors);
+
+    if (batch.error) {
+        printk("stackbd: cache writeback error %d\n", batch.error);
+        return batch.error;
+    }
+    return nr;
+}
+
+/*
+ * Write back the blocks that are dirty now. Blocks dirtied meanwhile go
+ * to the tail of the dirty list, so writers can't keep us going forever.
+ * Called with wb_mutex held.
+ */
+static int cache_writeback_all(struct stackbd_wbcache *c)
+{
+    unsigned int todo = ACCESS_ONCE(c->nr_dirty);
+    int rc = 0;
+
+    while (todo && (rc = cache_writeback(c, todo)) > 0)
+        todo -= min_t(unsigned int, todo, rc);
+
+    return rc < 0 ? rc : 0;
+}
+
+/* write back everything, then have the target flush its own cache */
+static int cache_sync(struct stackbd_wbcache *c)
+{
+    struct wb_batch batch;
+    struct bio *bio;
+    int rc;
+
+    mutex_lock(&c->wb_mutex);
+    if (!(rc = cache_writeback_all(c))) {
+        wb_batch_init(&batch);
+        if ((bio = cache_bio_alloc(c, WRITE_FLUSH, 0, wb_endio, &batch)))
+            wb_bio_submit(bio, &batch);
+        else
+            batch.error = -ENOMEM;
+        rc = wb_batch_wait(&batch);
+    }
+    mutex_unlock(&c->wb_mutex);
+
+    return rc;
+}
+
+static int cache_threadfn(void *data)
+{
+    struct stackbd_wbcache *c = data;
+    unsigned int thresh;
+    int rc;
+
+    while (!kthread_should_stop()) {
+        thresh = cache_dirty_thresh(c);
+        wait_event_interruptible_timeout(c->wb_wait, kthread_should_stop() ||
+                (c->nr_dirty && (c->nr_dirty >= thresh ||
+                                 waitqueue_active(&c->space_wait))),
+                msecs_to_jiffies(cache_writeback_ms));
+
+        mutex_lock(&c->wb_mutex);
+        rc = cache_writeback_all(c);
+        mutex_unlock(&c->wb_mutex);
+
+        /* don't spin on a failing target */
+        if (rc)
+            schedule_timeout_interruptible(msecs_to_jiffies(cache_writeback_ms));
+    }
+
+    return 0;
+}
+
+/*
+ * Readahead: blocks are read into directly, and are kept off the lists
+ * (so they can't be reclaimed) until the read completes.
+ */
+
+static void cache_fill_endio(struct bio *bio, int error)
+{
+    struct stackbd_wbcache *c = bio->bi_private;
+    struct stackbd_cblock *b;
+    unsigned long flags;
+    int i;
+
+    if (!error && !test_bit(BIO_UPTODATE, &bio->bi_flags))
+        error = -EIO;
+
+    spin_lock_irqsave(&c->lock, flags);
+    for (i = 0; i < bio->bi_vcnt; i++) {
+        b = (struct stackbd_cblock *) page_private(bio->bi_io_vec[i].bv_page);
+        b->fill = 0;
+        c->nr_fill--;
+        if (error) {
+            cblock_put(c, b);
+            continue;
+        }
+        b->valid = sector_mask(0, CBLOCK_SECTORS);
+        b->prefetched = 1;
+        cblock_clean(c, b);
+    }
+    c->events++;
+    spin_unlock_irqrestore(&c->lock, flags);
+
+    wake_up(&c->space_wait);
+    bio_put(bio);
+}
+
+/* read [start, end) into the cache, the blocks that are not there yet */
+static void cache_readahead(struct stackbd_wbcache *c, sector_t start, sector_t end)
+{
+    struct stackbd_cblock *b;
+    struct bio_vec *bv;
+    struct bio *bio = NULL;
+    unsigned long flags;
+    sector_t block, sector;
+    int full = 0;
+
+    for (block = start >> CBLOCK_SHIFT; block < end >> CBLOCK_SHIFT && !full; block++) {
+        sector = block << CBLOCK_SHIFT;
+
+        spin_lock_irqsave(&c->lock, flags);
+        if (cblock_lookup(c, block)) {
+            b = NULL;
+        } else if ((b = cblock_get(c, block))) {
+            b->fill = 1;
+            c->nr_fill++;
+        } else {
+            full = 1;
+        }
+        spin_unlock_irqrestore(&c->lock, flags);
+
+        if (bio && (!b || !cache_bio_fits(c, bio, sector, CBLOCK_SECTORS))) {
+            stackbd_lower_submit(bio);
+            bio = NULL;
+        }
+        if (!b)
+            continue;
+
+        if (!bio && !(bio = cache_bio_alloc(c, READ, sector, cache_fill_endio, c))) {
+            spin_lock_irqsave(&c->lock, flags);
+            b->fill = 0;
+            c->nr_fill--;
+            cblock_put(c, b);
+            spin_unlock_irqrestore(&c->lock, flags);
+            break;
+        }
+
+        bv = &bio->bi_io_vec[bio->bi_vcnt++];
+        bv->bv_page = b->page;
+        bv->bv_offset = 0;
+        bv->bv_len = PAGE_SIZE;
+        bio->bi_size += PAGE_SIZE;
+        atomic_long_inc(&c->ra_blocks);
+    }
+
+    if (bio)
+        stackbd_lower_submit(bio);
+}
+
+/*
+ * Follow sequential readers. Returns 1 and the range to read ahead when
+ * a reader is into the second half of what has been read ahead for it.
+ * Called with c->lock held.
+ */
+static int cache_stream(struct stackbd_wbcache *c, struct bio *bio,
+        sector_t *ra_start, sector_t *ra_end)
+{
+    sector_t end = bio->bi_sector + bio_sectors(bio);
+    sector_t ra = (sector_t) max(cache_readahead_kb, 0) << 1;
+    struct stackbd_stream *s = NULL;
+    int i;
+
+    for (i = 0; i < STACKBD_STREAMS; i++) {
+        if (c->streams[i].run && c->streams[i].next == bio->bi_sector) {
+            s = &c->streams[i];
+            break;
+        }
+    }
+
+    /* a new stream replaces the least recently used one */
+    if (!s) {
+        s = &c->streams[0];
+        for (i = 1; i < STACKBD_STREAMS; i++)
+            if (c->streams[i].used < s->used)
+                s = &c->streams[i];
+        s->run = 0;
+        s->ra_end = 0;
+    }
+
+    s->next = end;
+    s->run++;
+    s->used = ++c->stream_tick;
+
+    if (!ra || s->run < 2 || s->ra_end > end + ra / 2)
+        return 0;
+
+    *ra_start = max(s->ra_end, end) & ~((sector_t) CBLOCK_SECTORS - 1);
+    *ra_end = min(end + ra, c->capacity);
+    s->ra_end = *ra_end;
+    return *ra_start < *ra_end;
+}
+
+/*
+ * A read that missed goes on to the target with its completion hooked,
+ * to put what comes back in the cache.
+ */
+struct cache_read {
+    struct stackbd_wbcache *c;
+    bio_end_io_t *end_io;
+    void *private;
+    unsigned long write_seq;
+};
+
+static void cache_read_endio(struct bio *bio, int error)
+{
+    struct cache_read *r = bio->bi_private;
+    struct stackbd_wbcache *c = r->c;
+    unsigned long flags;
+
+    bio->bi_end_io = r->end_io;
+    bio->bi_private = r->private;
+
+    if (!error && test_bit(BIO_UPTODATE, &bio->bi_flags)) {
+        spin_lock_irqsave(&c->lock, flags);
+        /*
+         * After a write, the data we have may be older than the target's:
+         * the write may have been written back and reclaimed meanwhile.
+         * Then only blocks still in the cache are safe to fill, as they
+         * have the newer sectors marked valid.
+         */
+        cache_walk(c, bio, c->write_seq == r->write_seq ?
+                CACHE_FILL : CACHE_FILL_PRESENT);
+        spin_unlock_irqrestore(&c->lock, flags);
+    }
+
+    kfree(r);
+    bio_endio(bio, error);
+}
+
+/*
+ * Returns STACKBD_CACHE_DONE when the bio has been completed here, 0 when
+ * it has to go on to the target, and -EWOULDBLOCK when that can't be
+ * decided without sleeping and may_block is not set.
+ */
+int stackbd_wbcache_bio(struct stackbd_wbcache *c, struct bio *bio, int may_block)
+{
+    struct cache_read *r;
+    unsigned long flags, seq;
+    sector_t ra_start, ra_end;
+    unsigned int dirty;
+    int rc, ra, stale = 0;
+
+    if (bio->bi_rw & REQ_FLUSH) {
+        if (!may_block)
+            return -EWOULDBLOCK;
+
+        atomic_long_inc(&c->flushes);
+        if ((rc = cache_sync(c)) || !bio->bi_size) {
+            bio_endio(bio, rc);
+            return STACKBD_CACHE_DONE;
+        }
+        /* done with the flush, now the data */
+        bio->bi_rw &= ~REQ_FLUSH;
+    }
+
+    if (bio_data_dir(bio) == WRITE && (bio->bi_rw & REQ_FUA)) {
+        if (!may_block)
+            return -EWOULDBLOCK;
+
+        /*
+         * Write through. No writeback is in flight while we hold wb_mutex,
+         * so it can't land older data over ours, and the sectors are clean
+         * from here on.
+         */
+        mutex_lock(&c->wb_mutex);
+        for (;;) {
+            spin_lock_irqsave(&c->lock, flags);
+            rc = cache_walk(c, bio, CACHE_WRITE_THROUGH);
+            c->write_seq++;
+            seq = c->events;
+            spin_unlock_irqrestore(&c->lock, flags);
+
+            if (!rc)
+                break;
+            /* a block is being read ahead into */
+            wait_event(c->space_wait, ACCESS_ONCE(c->events) != seq);
+        }
+        mutex_unlock(&c->wb_mutex);
+
+        atomic_long_inc(&c->writes_through);
+        return 0;
+    }
+
+    if (bio_data_dir(bio) == WRITE) {
+        for (;;) {
+            spin_lock_irqsave(&c->lock, flags);
+            rc = cache_walk(c, bio, CACHE_WRITE);
+            c->write_seq++;
+            dirty = c->nr_dirty;
+            seq = c->events;
+            spin_unlock_irqrestore(&c->lock, flags);
+
+            if (dirty >= cache_dirty_thresh(c))
+                wake_up(&c->wb_wait);
+            if (!rc)
+                break;
+
+            /*
+             * No clean block left, or a block is being read ahead into.
+             * What has been copied so far is dirty and stays; copying it
+             * again on retry does no harm.
+             */
+            if (!may_block)
+                return -EWOULDBLOCK;
+            atomic_long_inc(&c->write_waits);
+            if (rc == -ENOSPC)
+                wake_up(&c->wb_wait);
+            wait_event(c->space_wait, ACCESS_ONCE(c->events) != seq);
+        }
+
+        atomic_long_inc(&c->writes);
+        bio_endio(bio, 0);
+        return STACKBD_CACHE_DONE;
+    }
+
+    spin_lock_irqsave(&c->lock, flags);
+    if (!(rc = cache_walk(c, bio, CACHE_HIT)))
+        cache_walk(c, bio, CACHE_READ);
+    else
+        stale = cache_walk(c, bio, CACHE_STALE);
+
+    /* come back from the worker, seen by the stream detector only once */
+    if (stale && !may_block) {
+        spin_unlock_irqrestore(&c->lock, flags);
+        return -EWOULDBLOCK;
+    }
+    ra = cache_stream(c, bio, &ra_start, &ra_end);
+    seq = c->write_seq;
+    spin_unlock_irqrestore(&c->lock, flags);
+
+    if (ra)
+        cache_readahead(c, ra_start, ra_end);
+
+    if (!rc) {
+        atomic_long_inc(&c->read_hits);
+        bio_endio(bio, 0);
+        return STACKBD_CACHE_DONE;
+    }
+
+    /* partly in the cache, and the target is behind on that part */
+    if (stale) {
+        mutex_lock(&c->wb_mutex);
+        rc = cache_writeback_all(c);
+        mutex_unlock(&c->wb_mutex);
+        if (rc) {
+            bio_endio(bio, rc);
+            return STACKBD_CACHE_DONE;
+        }
+    }
+
+    /* without memory for the hook, the read just isn't cached */
+    if ((r = kmalloc(sizeof(*r), GFP_NOIO))) {
+        r->c = c;
+        r->end_io = bio->bi_end_io;
+        r->private = bio->bi_private;
+        r->write_seq = seq;
+        bio->bi_end_io = cache_read_endio;
+        bio->bi_private = r;
+    }
+
+    atomic_long_inc(&c->read_misses);
+    return 0;
+}
+
+static void cache_free(struct stackbd_wbcache *c)
+{
+    unsigned int i;
+
+    for (i = 0; i < c->nr_blocks; i++) {
+        set_page_private(c->blocks[i].page, 0);
+        __free_page(c->blocks[i].page);
+    }
+    vfree(c->blocks);
+    vfree(c->hash);
+    vfree(c->ghosts);
+    vfree(c->ghost_hash);
+    kfree(c->wb_vec);
+    c->blocks = NULL;
+}
+
+/*
+ * capacity is the size of the device, boundary, max_sectors and
+ * max_segments are the limits of the layout below; all of the memory is
+ * allocated here.
+ */
+int stackbd_wbcache_init(struct stackbd_wbcache *c, unsigned int nr_blocks,
+        sector_t capacity, unsigned int boundary, unsigned int max_sectors,
+        unsigned int max_segments)
+{
+    struct stackbd_cblock *b;
+    unsigned int i, nr_ghosts = nr_blocks / A1OUT_SHARE;
+
+    BUILD_BUG_ON(CBLOCK_SECTORS > BITS_PER_LONG);
+
+    if (boundary && boundary < CBLOCK_SECTORS) {
+        printk("stackbd: the cache needs chunks of at least %lu sectors\n",
+                CBLOCK_SECTORS);
+        return -EINVAL;
+    }
+    if (nr_blocks < 4 || max_sectors < CBLOCK_SECTORS || !max_segments)
+        return -EINVAL;
+
+    spin_lock_init(&c->lock);
+    mutex_init(&c->wb_mutex);
+    INIT_LIST_HEAD(&c->free);
+    INIT_LIST_HEAD(&c->a1in);
+    INIT_LIST_HEAD(&c->am);
+    INIT_LIST_HEAD(&c->dirty);
+    INIT_LIST_HEAD(&c->ghost_free);
+    INIT_LIST_HEAD(&c->ghost_fifo);
+    init_waitqueue_head(&c->wb_wait);
+    init_waitqueue_head(&c->space_wait);
+    c->nr_a1in = c->nr_am = c->nr_dirty = c->nr_wb = c->nr_fill = 0;
+    c->write_seq = c->events = 0;
+    memset(c->streams, 0, sizeof(c->streams));
+    c->stream_tick = 0;
+    c->capacity = capacity;
+    c->boundary = boundary;
+    c->max_sectors = max_sectors;
+    c->max_segments = max_segments;
+
+    /* about two blocks per bucket */
+    c->hash_bits = ilog2(nr_blocks) - 1;
+    c->hash = vmalloc(sizeof(*c->hash) << c->hash_bits);
+    c->blocks = vmalloc(sizeof(*c->blocks) * nr_blocks);
+    c->wb_vec = kmalloc(sizeof(*c->wb_vec) * WB_BATCH, GFP_KERNEL);
+    c->ghosts = vmalloc(sizeof(*c->ghosts) * nr_ghosts);
+    c->ghost_hash = vmalloc(sizeof(*c->ghost_hash) << c->hash_bits);
+    c->nr_blocks = 0;
+    if (!c->hash || !c->blocks || !c->wb_vec || !c->ghosts || !c->ghost_hash)
+        goto error;
+
+    for (i = 0; i < (1U << c->hash_bits); i++) {
+        INIT_HLIST_HEAD(&c->hash[i]);
+        INIT_HLIST_HEAD(&c->ghost_hash[i]);
+    }
+    for (i = 0; i < nr_ghosts; i++) {
+        INIT_HLIST_NODE(&c->ghosts[i].hash);
+        list_add_tail(&c->ghosts[i].list, &c->ghost_free);
+    }
+
+    for (i = 0; i < nr_blocks; i++) {
+        b = &c->blocks[i];
+        if (!(b->page = alloc_page(GFP_KERNEL)))
+            goto error;
+        /* readahead completion finds the block by the page */
+        set_page_private(b->page, (unsigned long) b);
+        INIT_HLIST_NODE(&b->hash);
+        list_add_tail(&b->list, &c->free);
+        c->nr_blocks++;
+    }
+
+    c->thread = kthread_run(cache_threadfn, c, "stackbd_wb");
+    if (IS_ERR(c->thread)) {
+        printk("stackbd: error starting the writeback thread <%lu>\n",
+                PTR_ERR(c->thread));
+        goto error;
+    }
+
+    printk("stackbd: cache of %u blocks\n", c->nr_blocks);
+    return 0;
+
+error:
+    cache_free(c);
+    return -ENOMEM;
+}
+
+/* write back all that is dirty, and let go of the memory */
+void stackbd_wbcache_exit(struct stackbd_wbcache *c)
+{
+    int rc;
+
+    if (!c->blocks)
+        return;
+
+    kthread_stop(c->thread);
+    if ((rc = cache_sync(c)))
+        printk("stackbd: cache writeback on exit failed: %d, data lost\n", rc);
+    /* readahead may still be in flight */
+    wait_event(c->space_wait, !ACCESS_ONCE(c->nr_fill));
+
+    cache_free(c);
+}
@@ -0,0 +1,255 @@
+#ifndef TFIFO_H
+#define TFIFO_H
+
+#include <linux/slab.h>
+#include <linux/log2.h>
+#include <linux/string.h>
+#include <linux/cache.h>
+#include <linux/kernel.h>
+#include <linux/compiler.h>
+#include <asm/barrier.h>
+
+/*
+ * A typed FIFO: ififo for any element type, the way kfifo's typed API
+ * works. DEFINE_TFIFO(name, type) generates struct name and name_*()
+ * functions that store type by value, so u64 timestamps or whole records
+ * go in without truncation or a pointer per item.
+ *
+ * The layout is ififo's: a power of 2 of slots, free-running in/out
+ * indices masked on access, at most size items. The buffer follows the
+ * struct a whole number of cache lines into the allocation (which kmalloc()
+ * aligns to a line), so an element whose size is a power of 2 up to the
+ * line size never straddles two lines.
+ *
+ * Everything is static: the element size and alignment are known at
+ * compile time in every function. The single item calls are inline; the
+ * bulk copies are not, as gcc may turn an inlined memcpy() whose length is
+ * a multiple of 8 into rep movsq, which costs more than the call for the
+ * batches of tens of items they usually move.
+ *
+ * The writer side (put/get) needs a lock if there is more than one writer.
+ * name_snapshot() doesn't: it copies the newest items while the writer
+ * goes on, see below.
+ *
+ * A window of the newest items is kept with name_put_overwrite() alone: it
+ * always puts, dropping the oldest item when the fifo is full. The writer
+ * then moves out as well as in, so nobody else may get() -- readers take
+ * snapshots, and need no lock for that.
+ */
+
+/* snapshot copies that may be spoilt by the writer before the tail is kept */
+#define TFIFO_SNAPSHOT_TRIES 3
+
+#define TFIFO_BUF_OFFSET(fifotype, type)                                        \
+    ALIGN(sizeof(struct fifotype), max_t(size_t, __alignof__(type), L1_CACHE_BYTES))
+
+#define DEFINE_TFIFO(name, type)                                                \
+struct name {                                                                   \
+    unsigned int in;                                                            \
+    unsigned int out;                                                           \
+    unsigned int size;                                                          \
+    unsigned int mask;                                                          \
+    /* items put_overwrite() has dropped */                                     \
+    unsigned long dropped;                                                      \
+    type *buffer;                                                               \
+};                                                                              \
+                                                                                \
+static inline int name##_alloc(struct name **fifo, unsigned int size, gfp_t gfp_mask) \
+{                                                                               \
+    struct name *self;                                                          \
+    unsigned int slots;                                                         \
+                                                                                \
+    if (!size || size > (1U << 31))                                             \
+        return -EINVAL;                                                         \
+    slots = roundup_pow_of_two(size);                                           \
+                                                                                \
+    self = kzalloc(TFIFO_BUF_OFFSET(name, type) + (size_t) slots * sizeof(type), gfp_mask); \
+    if (!self)                                                                  \
+        return -ENOMEM;                                                         \
+                                                                                \
+    self->size = size;                                                          \
+    self->mask = slots - 1;                                                     \
+    self->buffer = (type *) ((char *) self + TFIFO_BUF_OFFSET(name, type));     \
+    *fifo = self;                                                               \
+    return 0;                                                                   \
+}                                                                               \
+                                                                                \
+static inline void name##_free(struct name *fifo)                               \
+{                                                                               \
+    kfree(fifo);                                                                \
+}                                                                               \
+                                                                                \
+static inline int name##_len(struct name *fifo)                                 \
+{                                                                               \
+    return fifo->in - fifo->out;                                                \
+}                                                                               \
+                                                                                \
+static inline int name##_is_empty(struct name *fifo)                            \
+{                                                                               \
+    return fifo->in == fifo->out;                                               \
+}                                                                               \
+                                                                                \
+static inline int name##_is_full(struct name *fifo)                             \
+{                                                                               \
+    return fifo->in - fifo->out == fifo->size;                                  \
+}                                                                               \
+                                                                                \
+static inline int name##_put(struct name *fifo, type value)                     \
+{                                                                               \
+    if (name##_is_full(fifo))                                                   \
+        return 0;                                                               \
+                                                                                \
+    /* in and out go before the slot is reused, the slot before in: snapshot */ \
+    smp_wmb();                                                                  \
+    fifo->buffer[fifo->in & fifo->mask] = value;                                \
+    smp_wmb();                                                                  \
+    ACCESS_ONCE(fifo->in) = fifo->in + 1;                                       \
+    return 1;                                                                   \
+}                                                                               \
+                                                                                \
+/*                                                                              \
+ * Put that makes room if need be: the oldest item goes to *old (if old is      \
+ * not NULL) and 1 is returned. The writer moves out before it reuses the       \
+ * slot, as get() would, so a snapshot that sees the new item never takes      \
+ * the slot for the old one.                                                    \
+ */                                                                             \
+static inline int name##_put_overwrite(struct name *fifo, type value, type *old) \
+{                                                                               \
+    unsigned int in = fifo->in;                                                 \
+    int full = in - fifo->out == fifo->size;                                    \
+                                                                                \
+    if (full) {                                                                 \
+        if (old)                                                                \
+            *old = fifo->buffer[fifo->out & fifo->mask];                        \
+        ACCESS_ONCE(fifo->out) = fifo->out + 1;                                 \
+        fifo->dropped++;                                                        \
+    }                                                                           \
+                                                                                \
+    smp_wmb();                                                                  \
+    fifo->buffer[in & fifo->mask] = value;                                      \
+    smp_wmb();                                                                  \
+    ACCESS_ONCE(fifo->in) = in + 1;                                             \
+    return full;                                                                \
+}                                                                               \
+                                                                                \
+static inline unsigned long name##_dropped(struct name *fifo)                   \
+{                                                                               \
+    return ACCESS_ONCE(fifo->dropped);                                          \
+}                                                                               \
+                                                                                \
+/* value may be NULL: the item is dropped */                                    \
+static inline int name##_get(struct name *fifo, type *value)                    \
+{                                                                               \
+    if (name##_is_empty(fifo))                                                  \
+        return 0;                                                               \
+                                                                                \
+    if (value)                                                                  \
+        *value = fifo->buffer[fifo->out & fifo->mask];                          \
+    ACCESS_ONCE(fifo->out) = fifo->out + 1;                                     \
+    return 1;                                                                   \
+}                                                                               \
+                                                                                \
+static inline int name##_get_at(struct name *fifo, type *value, int pos)        \
+{                                                                               \
+    if (pos < 0 || pos >= name##_len(fifo))                                     \
+        return 0;                                                               \
+                                                                                \
+    *value = fifo->buffer[(fifo->out + pos) & fifo->mask];                      \
+    return 1;                                                                   \
+}                                                                               \
+                                                                                \
+/* n items from index from on: at most two memcpy()s */                         \
+static noinline __maybe_unused void name##_copy_out(struct name *fifo,         \
+        type *buf, unsigned int from, unsigned int n)                           \
+{                                                                               \
+    unsigned int off = from & fifo->mask;                                       \
+    unsigned int l = min(n, fifo->mask + 1 - off);                              \
+                                                                                \
+    memcpy(buf, fifo->buffer + off, l * sizeof(type));                          \
+    memcpy(buf + l, fifo->buffer, (n - l) * sizeof(type));                      \
+}                                                                               \
+                                                                                \
+static noinline __maybe_unused unsigned int name##_put_n(struct name *fifo,    \
+        const type *buf, unsigned int n)                                        \
+{                                                                               \
+    unsigned int off = fifo->in & fifo->mask;                                   \
+    unsigned int l;                                                             \
+                                                                                \
+    n = min(n, fifo->size - name##_len(fifo));                                  \
+    l = min(n, fifo->mask + 1 - off);                                           \
+                                                                                \
+    smp_wmb();                                                                  \
+    memcpy(fifo->buffer + off, buf, l * sizeof(type));                          \
+    memcpy(fifo->buffer, buf + l, (n - l) * sizeof(type));                      \
+    smp_wmb();                                                                  \
+    ACCESS_ONCE(fifo->in) = fifo->in + n;                                       \
+    return n;                                                                   \
+}                                                                               \
+                                                                                \
+/* buf may be NULL: the items are dropped */                                    \
+static inline unsigned int name##_get_n(struct name *fifo, type *buf,           \
+        unsigned int n)                                                         \
+{                                                                               \
+    n = min(n, (unsigned int) name##_len(fifo));                                \
+                                                                                \
+    if (buf)                                                                    \
+        name##_copy_out(fifo, buf, fifo->out, n);                               \
+    ACCESS_ONCE(fifo->out) = fifo->out + n;                                     \
+    return n;                                                                   \
+}                                                                               \
+                                                                                \
+/* count items from position idx on (0 - the oldest), or as many as there are */ \
+static inline void name##_copy(struct name *fifo, type *buf, int idx, int count) \
+{                                                                               \
+    int flen = name##_len(fifo);                                                \
+                                                                                \
+    if (idx < 0 || count <= 0 || idx >= flen)                                   \
+        return;                                                                 \
+    if (idx + count > flen)                                                     \
+        count = flen - idx;                                                     \
+                                                                                \
+    name##_copy_out(fifo, buf, fifo->out + idx, count);                         \
+}                                                                               \
+                                                                                \
+/*                                                                              \
+ * Copy the newest max items, or as many as there are, with no lock against     \
+ * the writer; returns how many were copied, the oldest in buf[0]. The          \
+ * indices are the sequence count: the item at position pos stays in its slot   \
+ * until the put at pos + slots, which the writer starts only after it has      \
+ * published in = pos + slots and out > pos. So after the copy, an item is      \
+ * spoilt only if both have got that far. Spoilt items mean another copy, or    \
+ * after a few tries, returning what is left.                                   \
+ */                                                                             \
+static inline unsigned int name##_snapshot(struct name *fifo, type *buf,        \
+        unsigned int max)                                                       \
+{                                                                               \
+    unsigned int in, out, n, tries = 0;                                         \
+    int lost;                                                                   \
+    unsigned int slots = fifo->mask + 1;                                        \
+                                                                                \
+    for (;;) {                                                                  \
+        out = ACCESS_ONCE(fifo->out);                                           \
+        smp_rmb();                                                              \
+        in = ACCESS_ONCE(fifo->in);                                             \
+        smp_rmb();                                                              \
+                                                                                \
+        n = min(max, in - out);                                                 \
+        name##_copy_out(fifo, buf, in - n, n);                                  \
+                                                                                \
+        smp_rmb();                                                              \
+        /* how far past the oldest item copied out and the writer are */        \
+        lost = min((int) (ACCESS_ONCE(fifo->out) - (in - n)),                   \
+                (int) (ACCESS_ONCE(fifo->in) + 1 - slots - (in - n)));          \
+        if (lost <= 0)                                                          \
+            return n;                                                           \
+        if (++tries == TFIFO_SNAPSHOT_TRIES)                                    \
+            break;                                                              \
+    }                                                                           \
+                                                                                \
+    /* the writer keeps lapping us: keep what is left */                        \
+    lost = min_t(unsigned int, lost, n);                                        \
+    memmove(buf, buf + lost, (n - lost) * sizeof(type));                        \
+    return n - lost;                                                            \
+}
+
+#endif /* TFIFO_H */
@@ -0,0 +1,92 @@
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+
+#include "wagg.h"
+
+int wagg_alloc(struct wagg **wa, unsigned int size, gfp_t gfp_mask)
+{
+    struct wagg *self;
+    unsigned int slots;
+
+    if (!size || size > (1U << 31))
+        return -EINVAL;
+    slots = roundup_pow_of_two(size);
+
+    /* the struct, then the entries of min, then those of max */
+    self = kzalloc(sizeof(struct wagg) + 2 * slots * sizeof(struct wagg_entry), gfp_mask);
+    if (!self)
+        return -ENOMEM;
+
+    self->size = size;
+    self->mask = slots - 1;
+    self->min.entries = (struct wagg_entry *) (self + 1);
+    self->max.entries = self->min.entries + slots;
+    *wa = self;
+    return 0;
+}
+
+void wagg_free(struct wagg *wa)
+{
+    kfree(wa);
+}
+
+/* beats(a, b): with a in the window, b can't be the extreme */
+static void wagg_push(struct wagg *wa, struct wagg_deque *dq, u64 value,
+        int (*beats)(u64, u64))
+{
+    struct wagg_entry *e;
+
+    while (dq->tail != dq->head &&
+            beats(value, dq->entries[(dq->tail - 1) & wa->mask].value))
+        dq->tail--;
+
+    e = &dq->entries[dq->tail & wa->mask];
+    e->value = value;
+    e->seq = wa->next;
+    dq->tail++;
+}
+
+static void wagg_pop(struct wagg *wa, struct wagg_deque *dq)
+{
+    if (dq->head != dq->tail && (int) (dq->entries[dq->head & wa->mask].seq - wa->first) < 0)
+        dq->head++;
+}
+
+static int wagg_le(u64 a, u64 b)
+{
+    return a <= b;
+}
+
+static int wagg_ge(u64 a, u64 b)
+{
+    return a >= b;
+}
+
+void wagg_add(struct wagg *wa, u64 value)
+{
+    wagg_push(wa, &wa->min, value, wagg_le);
+    wagg_push(wa, &wa->max, value, wagg_ge);
+    wa->sum += value;
+    wa->next++;
+}
+
+void wagg_remove(struct wagg *wa, u64 value)
+{
+    if (!wagg_count(wa))
+        return;
+
+    wa->sum -= value;
+    wa->first++;
+    /* only the front can be that sample: the ones before it are gone already */
+    wagg_pop(wa, &wa->min);
+    wagg_pop(wa, &wa->max);
+}
+
+u64 wagg_mean(struct wagg *wa)
+{
+    unsigned int n = wagg_count(wa);
+
+    return n ? div_u64(wa->sum, n) : 0;
+}
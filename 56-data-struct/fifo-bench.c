@@ -0,0 +1,189 @@
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+
+#include "ififo.h"
+
+/*
+ * Times ififo against the modulo-indexed ring it replaced (kept below as
+ * ofifo). Everything happens at load time; the results go to the log.
+ */
+
+static int size = 100000;
+module_param(size, int, 0);
+static int ops = 10000000;
+module_param(ops, int, 0);
+/* items per ififo_put_n()/ififo_get_n() call */
+static int batch = 64;
+module_param(batch, int, 0);
+
+#define MODNAME "fifobench"
+
+/* the old ififo: size + 1 slots, one left empty, indices wrapped with % */
+struct ofifo {
+    unsigned int in;
+    unsigned int out;
+    unsigned int size;
+    int *buffer;
+};
+
+static struct ofifo *ofifo_alloc(unsigned int size)
+{
+    struct ofifo *self;
+
+    self = kzalloc(sizeof(struct ofifo) + (size + 1) * sizeof(int), GFP_KERNEL);
+    if (!self)
+        return NULL;
+    self->size = size + 1;
+    self->buffer = (int *) (self + 1);
+    return self;
+}
+
+static noinline int ofifo_is_full(struct ofifo *fifo)
+{
+    return (fifo->in + 1) % fifo->size == fifo->out;
+}
+
+static noinline int ofifo_put(struct ofifo *fifo, int value)
+{
+    if (ofifo_is_full(fifo))
+        return 0;
+    fifo->buffer[fifo->in] = value;
+    fifo->in = (fifo->in + 1) % fifo->size;
+    return 1;
+}
+
+static noinline int ofifo_get(struct ofifo *fifo, int *value)
+{
+    if (fifo->in == fifo->out)
+        return 0;
+    if (value)
+        *value = fifo->buffer[fifo->out];
+    fifo->out = (fifo->out + 1) % fifo->size;
+    return 1;
+}
+
+static void report(const char *what, int n, u64 ns)
+{
+    printk("%s: %-28s %6llu ns/op  %8llu Kops/s\n", MODNAME, what,
+            div_u64(ns, max(n, 1)), div64_u64((u64) n * 1000000, max(ns, 1ULL)));
+}
+
+/* the way blkstat keeps its window: drop the oldest when full, then put */
+static void bench_window(struct ififo *fifo, struct ofifo *ofifo)
+{
+    ktime_t start;
+    int i;
+
+    start = ktime_get();
+    for (i = 0; i < ops; i++) {
+        if (ofifo_is_full(ofifo))
+            ofifo_get(ofifo, NULL);
+        ofifo_put(ofifo, i);
+    }
+    report("old window put", ops, ktime_to_ns(ktime_sub(ktime_get(), start)));
+
+    start = ktime_get();
+    for (i = 0; i < ops; i++) {
+        if (ififo_is_full(fifo))
+            ififo_get(fifo, NULL);
+        ififo_put(fifo, i);
+    }
+    report("new window put", ops, ktime_to_ns(ktime_sub(ktime_get(), start)));
+}
+
+/* fill up, then drain, one item at a time */
+static void bench_fill_drain(struct ififo *fifo, struct ofifo *ofifo)
+{
+    ktime_t start;
+    int i, done, val;
+    long sum = 0;
+
+    while (ofifo_get(ofifo, NULL));
+    while (ififo_get(fifo, NULL));
+
+    start = ktime_get();
+    for (done = 0; done < ops; ) {
+        for (i = 0; ofifo_put(ofifo, i); i++);
+        while (ofifo_get(ofifo, &val))
+            sum += val;
+        done += 2 * i;
+    }
+    report("old put/get", done, ktime_to_ns(ktime_sub(ktime_get(), start)));
+
+    start = ktime_get();
+    for (done = 0; done < ops; ) {
+        for (i = 0; ififo_put(fifo, i); i++);
+        while (ififo_get(fifo, &val))
+            sum += val;
+        done += 2 * i;
+    }
+    report("new put/get", done, ktime_to_ns(ktime_sub(ktime_get(), start)));
+
+    if (sum == 42)
+        printk("%s: %ld\n", MODNAME, sum);
+}
+
+/* the same, in batches */
+static void bench_bulk(struct ififo *fifo)
+{
+    ktime_t start;
+    int *buf;
+    int done, n;
+
+    if (!(buf = kmalloc(batch * sizeof(int), GFP_KERNEL)))
+        return;
+    for (n = 0; n < batch; n++)
+        buf[n] = n;
+
+    start = ktime_get();
+    for (done = 0; done < ops; ) {
+        while ((n = ififo_put_n(fifo, buf, batch)))
+            done += n;
+        while ((n = ififo_get_n(fifo, buf, batch)))
+            done += n;
+    }
+    report("new put_n/get_n (per item)", done, ktime_to_ns(ktime_sub(ktime_get(), start)));
+
+    kfree(buf);
+}
+
+static int __init fifobench_init(void)
+{
+    struct ififo *fifo;
+    struct ofifo *ofifo;
+    int ret;
+
+    if (size <= 0 || ops <= 0 || batch <= 0)
+        return -EINVAL;
+
+    if ((ret = ififo_alloc(&fifo, size, GFP_KERNEL)))
+        return ret;
+    if (!(ofifo = ofifo_alloc(size))) {
+        ififo_free(fifo);
+        return -ENOMEM;
+    }
+
+    printk("%s: size %d, %d ops, batch %d\n", MODNAME, size, ops, batch);
+    bench_window(fifo, ofifo);
+    bench_fill_drain(fifo, ofifo);
+    bench_bulk(fifo);
+
+    kfree(ofifo);
+    ififo_free(fifo);
+    return 0;
+}
+
+static void __exit fifobench_exit(void)
+{ 
+    printk("%s: exit complete\n", MODNAME);
+}
+
+module_init(fifobench_init);
+module_exit(fifobench_exit);
+
+MODULE_AUTHOR("Oleg Rosowiecki");
+MODULE_DESCRIPTION("ififo benchmark");
+MODULE_LICENSE("GPL");
@@ -4,6 +4,16 @@
 #include <linux/slab.h>
 
 #include "ififo.h"
+#include "tfifo.h"
+
+/* a typed fifo of whole records */
+struct sample {
+    u64 time;
+    u32 sectors;
+    u32 op;
+};
+
+DEFINE_TFIFO(samplefifo, struct sample)
 
 static int size = 10;
 module_param(size, int, 0);
@@ -57,6 +67,50 @@ static void add_half(struct ififo *fifo, int value)
         add_one(fifo, value);
 }
 
+/* fill the fifo in batches of 3 and take them out in batches of 4 */
+static void bulk(struct ififo *fifo)
+{
+    int vals[4] = {0};
+    int i, n, total = 0;
+
+    do {
+        for (i = 0; i < 3; i++)
+            vals[i] = total + i + 1;
+        total += (n = ififo_put_n(fifo, vals, 3));
+    } while (n == 3);
+    printk("%s: bulk put %d items\n", MODNAME, total);
+
+    while ((n = ififo_get_n(fifo, vals, 4)))
+        for (i = 0; i < n; i++)
+            printk("item = %d\n", vals[i]);
+}
+
+static void records(void)
+{
+    struct samplefifo *sfifo;
+    struct sample smp;
+    int i;
+
+    if (samplefifo_alloc(&sfifo, 4, GFP_KERNEL))
+        return;
+
+    for (i = 0; i < 6; i++) {
+        smp.time = (u64) (i + 1) << 32;
+        smp.sectors = 8 << i;
+        smp.op = i & 1;
+        if (samplefifo_is_full(sfifo))
+            samplefifo_get(sfifo, NULL);
+        samplefifo_put(sfifo, smp);
+    }
+
+    printk("%s: records, %zu bytes each\n", MODNAME, sizeof(smp));
+    while (samplefifo_get(sfifo, &smp))
+        printk("time = %llu, sectors = %u, op = %u\n",
+                (unsigned long long) smp.time, smp.sectors, smp.op);
+
+    samplefifo_free(sfifo);
+}
+
 static int __init fifo_init(void)
 {
     int i, val, ret;
@@ -99,6 +153,9 @@ static int __init fifo_init(void)
         printk("item[%d] = %d\n", i++, val);
     
     printk("queue size now is %d\n", ififo_len(fifo));
+
+    bulk(fifo);
+    records();
  
     printk("%s: init complete\n", MODNAME);
     return 0;
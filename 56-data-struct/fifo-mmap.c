@@ -0,0 +1,303 @@
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/init.h>
+#include <linux/cdev.h>
+#include <linux/device.h>           /* class_create() */
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/log2.h>
+#include <linux/bitops.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <asm/barrier.h>
+
+#include "ififo_mmap.h"
+
+/*
+ * An ififo_spsc whose pages are mapped by the reader: /dev/fifommap is a
+ * header page with the indices (struct ififo_mmap_header) followed by the
+ * slots. An hrtimer puts batch samples every period_us; the reader takes
+ * them straight from its mapping and gives the slots back by storing out,
+ * without a system call as long as there is something to take. poll() is
+ * only for sleeping when the ring is empty. test2/t_fifommap is a reader.
+ */
+
+/* slots in the ring, rounded up to a power of 2 */
+static int size = 65536;
+module_param(size, int, S_IRUGO);
+static int period_us = 100;
+module_param(period_us, int, S_IRUGO);
+/* samples put per timer shot */
+static int batch = 1;
+module_param(batch, int, S_IRUGO);
+
+#define MODNAME "fifommap"
+
+struct fifommap {
+    struct ififo_mmap_header *hdr;
+    struct ififo_mmap_sample *slots;
+    unsigned long pages;            /* header page + data pages */
+
+    /*
+     * The producer keeps its own in and mask: the header page is the
+     * reader's to write, and nothing it puts there may send us outside
+     * the ring.
+     */
+    unsigned int in;
+    unsigned int mask;
+    u64 seq;
+    u64 dropped;
+
+    struct hrtimer timer;
+    ktime_t period;
+    wait_queue_head_t wq;
+    unsigned long busy;             /* bit 0: there is a reader */
+};
+
+static struct fifommap ring;
+
+static struct cdev *cdev;
+static dev_t fifommap_dev;
+static struct class *fifommap_class;
+
+/*
+ * ififo_spsc_put(), with out read from the reader's page. A reader that
+ * writes nonsense to out gets nonsense back, but in still only moves
+ * forward and the slot written is always one of ours.
+ */
+static void fifommap_put(struct fifommap *f, u64 ns)
+{
+    struct ififo_mmap_sample *s;
+    unsigned int in = f->in;
+
+    if (in - smp_load_acquire(&f->hdr->out) > f->mask) {
+        ACCESS_ONCE(f->hdr->dropped) = ++f->dropped;
+        f->seq++;
+        return;
+    }
+
+    s = &f->slots[in & f->mask];
+    s->seq = f->seq++;
+    s->ns = ns;
+    ACCESS_ONCE(f->in) = in + 1;
+    smp_store_release(&f->hdr->in, in + 1);
+}
+
+static enum hrtimer_restart fifommap_timer(struct hrtimer *timer)
+{
+    struct fifommap *f = container_of(timer, struct fifommap, timer);
+    u64 ns = ktime_to_ns(ktime_get());
+    int i;
+
+    for (i = 0; i < batch; i++)
+        fifommap_put(f, ns);
+
+    /* in is out before we look for sleepers: pairs with fifommap_poll() */
+    smp_mb();
+    if (waitqueue_active(&f->wq))
+        wake_up_interruptible(&f->wq);
+
+    hrtimer_forward_now(timer, f->period);
+    return HRTIMER_RESTART;
+}
+
+/*
+ * vmalloc() memory isn't physically contiguous, so unlike the buffer of
+ * 51-cdev-fops/mmap.c it can't go to remap_pfn_range() in one piece: the
+ * pages are handed out one by one as the reader first touches them. This
+ * is the fault signature of 2.6.23 - 4.10. FIXME:VER
+ */
+static int fifommap_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+    struct fifommap *f = vma->vm_private_data;
+    struct page *page;
+
+    if (vmf->pgoff >= f->pages)
+        return VM_FAULT_SIGBUS;
+
+    page = vmalloc_to_page((char *) f->hdr + (vmf->pgoff << PAGE_SHIFT));
+    get_page(page);
+    vmf->page = page;
+    return 0;
+}
+
+static const struct vm_operations_struct fifommap_vm_ops = {
+    .fault =    fifommap_fault,
+};
+
+static int fifommap_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct fifommap *f = file->private_data;
+    unsigned long pages = (vma->vm_end - vma->vm_start) >> PAGE_SHIFT;
+
+    if (vma->vm_pgoff >= f->pages || pages > f->pages - vma->vm_pgoff)
+        return -EINVAL;         /*  can't map beyond the ring */
+
+    /* a private mapping would keep the reader's out to itself */
+    if (!(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
+
+    pr_debug("%s: mapping range: %lx - %lx at page %lu\n",
+        MODNAME, vma->vm_start, vma->vm_end, vma->vm_pgoff);
+
+    /* VM_DONTDUMP is there since 3.7, VM_RESERVED before that FIXME:VER */
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+    vma->vm_ops = &fifommap_vm_ops;
+    vma->vm_private_data = f;
+    return 0;
+}
+
+static unsigned int fifommap_poll(struct file *file, poll_table *wait)
+{
+    struct fifommap *f = file->private_data;
+
+    poll_wait(file, &f->wq, wait);
+
+    /* either the timer sees us on the queue or we see its in */
+    smp_mb();
+    if (ACCESS_ONCE(f->in) != ACCESS_ONCE(f->hdr->out))
+        return POLLIN | POLLRDNORM;
+    return 0;
+}
+
+/* one reader at a time: there is only one out */
+static int fifommap_open(struct inode *inode, struct file *file)
+{
+    if (test_and_set_bit_lock(0, &ring.busy))
+        return -EBUSY;
+
+    /* start from the next sample, not from where the last reader left */
+    smp_store_release(&ring.hdr->out, ACCESS_ONCE(ring.in));
+    file->private_data = &ring;
+    return 0;
+}
+
+/* only once the last mapping is gone too: it holds the file */
+static int fifommap_release(struct inode *inode, struct file *file)
+{
+    clear_bit_unlock(0, &ring.busy);
+    return 0;
+}
+
+static struct file_operations fifommap_fops = {
+    .owner =    THIS_MODULE,
+    .open =     fifommap_open,
+    .release =  fifommap_release,
+    .mmap =     fifommap_mmap,
+    .poll =     fifommap_poll,
+};
+
+static int ring_alloc(struct fifommap *f)
+{
+    unsigned int slots = roundup_pow_of_two(size);
+
+    f->pages = 1 + PAGE_ALIGN(slots * sizeof(struct ififo_mmap_sample)) / PAGE_SIZE;
+    /* zeroed, and marked as fit for mapping to userspace */
+    f->hdr = vmalloc_user(f->pages << PAGE_SHIFT);
+    if (!f->hdr)
+        return -ENOMEM;
+    f->slots = (struct ififo_mmap_sample *) ((char *) f->hdr + PAGE_SIZE);
+    f->mask = slots - 1;
+
+    f->hdr->magic = IFIFO_MMAP_MAGIC;
+    f->hdr->mask = f->mask;
+    f->hdr->sample_size = sizeof(struct ififo_mmap_sample);
+    f->hdr->data_offset = PAGE_SIZE;
+
+    init_waitqueue_head(&f->wq);
+    return 0;
+}
+
+static int __init fifommap_init(void)
+{
+    int rc;
+
+    if (size <= 0 || size > (1 << 24) || period_us <= 0 || batch <= 0) {
+        pr_info("%s: bad size, period_us or batch\n", MODNAME);
+        return -EINVAL;
+    }
+
+    rc = ring_alloc(&ring);
+    if (rc < 0)
+        return rc;
+
+    /* allocate one character device */
+    rc = alloc_chrdev_region(&fifommap_dev, 0, 1, MODNAME);
+    if (rc < 0) {
+        pr_debug("%s: alloc_chrdev_region() failed: result code = %d\n",
+            MODNAME, rc);
+        rc = -EBUSY;
+        goto fail_chrdev;
+    }
+
+    fifommap_class = class_create(THIS_MODULE, MODNAME);
+    if (IS_ERR(fifommap_class)) {
+        rc = PTR_ERR(fifommap_class);
+        goto fail_class_create;
+    }
+
+    cdev = cdev_alloc();
+    if (!cdev) {
+        pr_debug("%s: cdev_alloc() failed\n", MODNAME);
+        rc = -ENOMEM;
+        goto fail_cdev_alloc;
+    }
+
+    cdev->ops = &fifommap_fops;
+    rc = cdev_add(cdev, fifommap_dev, 1);
+    if (rc < 0) {
+        pr_debug("%s: cdev_add() failed: result code = %d\n", MODNAME, rc);
+        rc = -EBUSY;
+        goto fail_cdev_add;
+    }
+
+    device_create(fifommap_class, NULL, fifommap_dev, NULL, MODNAME);
+
+    ring.period = ktime_set(0, (unsigned long) period_us * NSEC_PER_USEC);
+    hrtimer_init(&ring.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    ring.timer.function = fifommap_timer;
+    hrtimer_start(&ring.timer, ring.period, HRTIMER_MODE_REL);
+
+    pr_info("%s: init complete - major: %d, minor: %d, %u slots in %lu pages\n",
+            MODNAME, MAJOR(fifommap_dev), MINOR(fifommap_dev),
+            ring.mask + 1, ring.pages);
+    return 0;
+
+fail_cdev_add:
+    cdev_del(cdev);
+
+fail_cdev_alloc:
+    class_destroy(fifommap_class);
+
+fail_class_create:
+    unregister_chrdev_region(fifommap_dev, 1);
+
+fail_chrdev:
+    vfree(ring.hdr);
+    return rc;
+}
+
+static void __exit fifommap_exit(void)
+{
+    hrtimer_cancel(&ring.timer);
+
+    device_destroy(fifommap_class, fifommap_dev);
+    cdev_del(cdev);
+    class_destroy(fifommap_class);
+    unregister_chrdev_region(fifommap_dev, 1);
+    vfree(ring.hdr);
+
+    pr_info("%s: exit complete - %llu samples, %llu dropped\n",
+            MODNAME, ring.seq, ring.dropped);
+}
+
+module_init(fifommap_init);
+module_exit(fifommap_exit);
+
+MODULE_AUTHOR("Oleg Rosowiecki");
+MODULE_DESCRIPTION("A ring of samples mapped to userspace");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,195 @@
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/cpumask.h>
+#include <linux/jiffies.h>
+
+#include "ififo.h"
+
+/*
+ * Stress test of the lock-free fifos, run at load time. Producer threads,
+ * one per CPU, put numbered items: the top 8 bits are the producer, the
+ * rest is its sequence number. The consumer (the loading process) checks
+ * that it gets every item of every producer exactly once and in order.
+ * The SPSC fifo is run with the first producer only. The module fails to
+ * load if anything is wrong.
+ */
+
+static int size = 1024;
+module_param(size, int, 0);
+/* items per producer */
+static int items = 1000000;
+module_param(items, int, 0);
+/* 0 - one per online CPU */
+static int producers = 0;
+module_param(producers, int, 0);
+static int timeout_secs = 60;
+module_param(timeout_secs, int, 0);
+
+#define MODNAME "fifostress"
+
+#define MAX_PRODUCERS   256
+#define SEQ_BITS        24
+#define SEQ_MASK        ((1 << SEQ_BITS) - 1)
+
+struct producer {
+    int id;
+    struct completion done;
+};
+
+static struct ififo_spsc *spsc;
+static struct ififo_mpsc *mpsc;
+static struct producer *prods;
+static volatile int stop;
+
+static int (*put)(int value);
+
+static int spsc_put(int value)
+{
+    return ififo_spsc_put(spsc, value);
+}
+
+static int mpsc_put(int value)
+{
+    return ififo_mpsc_put(mpsc, value);
+}
+
+static int producer_fn(void *data)
+{
+    struct producer *p = data;
+    int i;
+
+    for (i = 0; i < items && !stop; i++) {
+        while (!put((int) ((unsigned int) p->id << SEQ_BITS | i)) && !stop)
+            cond_resched();
+    }
+
+    complete_and_exit(&p->done, 0);
+}
+
+static int run(const char *name, int (*get)(int *value), int nprods)
+{
+    struct task_struct *tsk;
+    unsigned long deadline = jiffies + timeout_secs * HZ;
+    long total, got = 0;
+    int *next, i, cpu, val, id, errors = 0, started = 0;
+
+    if (!(next = kcalloc(nprods, sizeof(int), GFP_KERNEL)))
+        return -ENOMEM;
+
+    stop = 0;
+    i = 0;
+    for_each_online_cpu(cpu) {
+        if (i == nprods)
+            break;
+        prods[i].id = i;
+        init_completion(&prods[i].done);
+        tsk = kthread_create(producer_fn, &prods[i], "fifostress/%d", i);
+        if (IS_ERR(tsk))
+            break;
+        kthread_bind(tsk, cpu);
+        wake_up_process(tsk);
+        started = ++i;
+    }
+    /* there may be fewer producers than asked for */
+    total = (long) items * started;
+
+    while (got < total) {
+        if (!get(&val)) {
+            if (time_after(jiffies, deadline)) {
+                printk("%s: %s: timed out with %ld of %ld items\n", MODNAME, name, got, total);
+                errors++;
+                break;
+            }
+            cond_resched();
+            continue;
+        }
+
+        got++;
+        id = (unsigned int) val >> SEQ_BITS;
+        if (id >= started) {
+            if (errors++ < 10)
+                printk("%s: %s: item %#x from no producer\n", MODNAME, name, val);
+            continue;
+        }
+        if ((val & SEQ_MASK) != next[id]) {
+            if (errors++ < 10)
+                printk("%s: %s: producer %d: got %d, expected %d\n",
+                        MODNAME, name, id, val & SEQ_MASK, next[id]);
+        }
+        next[id] = (val & SEQ_MASK) + 1;
+    }
+
+    stop = 1;
+    for (i = 0; i < started; i++)
+        wait_for_completion(&prods[i].done);
+
+    /* nothing may be left over */
+    if (get(&val)) {
+        printk("%s: %s: item %#x after the last one\n", MODNAME, name, val);
+        errors++;
+    }
+
+    printk("%s: %s: %d producer(s), %ld items, %d error(s)\n",
+            MODNAME, name, started, got, errors);
+    kfree(next);
+    return errors ? -EIO : 0;
+}
+
+static int spsc_get(int *value)
+{
+    return ififo_spsc_get(spsc, value);
+}
+
+static int mpsc_get(int *value)
+{
+    return ififo_mpsc_get(mpsc, value);
+}
+
+static int __init fifostress_init(void)
+{
+    int ret, nprods = producers ? producers : num_online_cpus();
+
+    nprods = min3(nprods, (int) num_online_cpus(), MAX_PRODUCERS);
+    if (size <= 0 || items <= 0 || items > SEQ_MASK || nprods <= 0)
+        return -EINVAL;
+
+    if (!(prods = kcalloc(nprods, sizeof(struct producer), GFP_KERNEL)))
+        return -ENOMEM;
+    if ((ret = ififo_spsc_alloc(&spsc, size, GFP_KERNEL)))
+        goto out_prods;
+    if ((ret = ififo_mpsc_alloc(&mpsc, size, GFP_KERNEL)))
+        goto out_spsc;
+
+    put = spsc_put;
+    if ((ret = run("spsc", spsc_get, 1)))
+        goto out;
+
+    put = mpsc_put;
+    ret = run("mpsc", mpsc_get, nprods);
+
+out:
+    ififo_mpsc_free(mpsc);
+out_spsc:
+    ififo_spsc_free(spsc);
+out_prods:
+    kfree(prods);
+    return ret;
+}
+
+static void __exit fifostress_exit(void)
+{ 
+    printk("%s: exit complete\n", MODNAME);
+}
+
+module_init(fifostress_init);
+module_exit(fifostress_exit);
+
+MODULE_AUTHOR("Oleg Rosowiecki");
+MODULE_DESCRIPTION("lock-free ififo stress test");
+MODULE_LICENSE("GPL");
@@ -1,107 +1,137 @@
 #include <linux/slab.h>
+#include <linux/log2.h>
+#include <linux/string.h>
+#include <linux/atomic.h>
+#include <asm/barrier.h>
 
 #include "ififo.h" 
 
-int ififo_alloc(struct ififo **fifo, unsigned int size, gfp_t gfp_mask)
+/* 
+ * Lock-free variants. smp_load_acquire()/smp_store_release() are there
+ * since 3.14 -- before that, smp_rmb() after reading and smp_wmb() before
+ * writing the other side's index do it. FIXME:VER
+ */
+
+int ififo_spsc_alloc(struct ififo_spsc **fifo, unsigned int size, gfp_t gfp_mask)
 {
-    struct ififo *self;
+    struct ififo_spsc *self;
+    unsigned int slots;
+
+    if (!size || size > (1U << 31))
+        return -EINVAL;
+    slots = roundup_pow_of_two(size);
 
-    self = kzalloc(sizeof(struct ififo) + (size + 1) * sizeof(int), gfp_mask);
+    self = kzalloc(sizeof(struct ififo_spsc) + slots * sizeof(int), gfp_mask);
     if (!self)
         return -ENOMEM;
 
-    self->size = size + 1;
-    self->in = self->out = 0;
-
-    /* the data buffer is located just after the newly allocated struct ififo */
+    self->mask = slots - 1;
     self->buffer = (int *) (self + 1);
     *fifo = self;
     return 0;
 }
 
-void ififo_free(struct ififo *fifo)
+void ififo_spsc_free(struct ififo_spsc *fifo)
 {
-    kfree(fifo);    
+    kfree(fifo);
 }
 
-int ififo_len(struct ififo *fifo)
+int ififo_spsc_put(struct ififo_spsc *fifo, int value)
 {
-    int x = 0;
-    if (fifo->in < fifo->out)
-        x = fifo->size;
+    unsigned int in = fifo->in;
+
+    /* the consumer is done with the slot once it has moved out past it */
+    if (in - smp_load_acquire(&fifo->out) > fifo->mask)
+        return 0;
 
-    return (x + fifo->in - fifo->out);
+    fifo->buffer[in & fifo->mask] = value;
+    smp_store_release(&fifo->in, in + 1);
+    return 1;
 }
 
-int ififo_is_empty(struct ififo *fifo)
+int ififo_spsc_get(struct ififo_spsc *fifo, int *value)
 {
-    return fifo->out == fifo->in;
+    unsigned int out = fifo->out;
+
+    if (smp_load_acquire(&fifo->in) == out)
+        return 0;
+
+    if (value)
+        *value = fifo->buffer[out & fifo->mask];
+    smp_store_release(&fifo->out, out + 1);
+    return 1;
 }
 
-int ififo_is_full(struct ififo *fifo)
+int ififo_mpsc_alloc(struct ififo_mpsc **fifo, unsigned int size, gfp_t gfp_mask)
 {
-    return ififo_len(fifo) == fifo->size - 1;
+    struct ififo_mpsc *self;
+    unsigned int i, slots;
+
+    if (!size || size > (1U << 31))
+        return -EINVAL;
+    slots = roundup_pow_of_two(size);
+
+    self = kzalloc(sizeof(struct ififo_mpsc) + slots * sizeof(struct ififo_mpsc_slot), gfp_mask);
+    if (!self)
+        return -ENOMEM;
+
+    self->mask = slots - 1;
+    self->slots = (struct ififo_mpsc_slot *) (self + 1);
+    for (i = 0; i < slots; i++)
+        self->slots[i].seq = i;
+    *fifo = self;
+    return 0;
 }
 
-int ififo_put(struct ififo *fifo, int value)
+void ififo_mpsc_free(struct ififo_mpsc *fifo)
 {
-    if (ififo_is_full(fifo))
-        return 0;
-
-    fifo->buffer[fifo->in] = value;
-    fifo->in = (fifo->in + 1)  % fifo->size;
-    return 1;
+    kfree(fifo);
 }
 
-int ififo_get(struct ififo *fifo, int *value)
+int ififo_mpsc_put(struct ififo_mpsc *fifo, int value)
 {
-    if (ififo_is_empty(fifo))
-        return 0;
-    
-    if (value)
-        *value = fifo->buffer[fifo->out];
-    fifo->out = (fifo->out + 1) % fifo->size;
+    struct ififo_mpsc_slot *slot;
+    unsigned int pos, prev;
+    int diff;
+
+    pos = ACCESS_ONCE(fifo->in);
+    for (;;) {
+        slot = &fifo->slots[pos & fifo->mask];
+        diff = (int) (smp_load_acquire(&slot->seq) - pos);
+
+        if (diff == 0) {
+            /* our turn, if nobody else has taken it meanwhile */
+            prev = cmpxchg(&fifo->in, pos, pos + 1);
+            if (prev == pos)
+                break;
+            pos = prev;
+        } else if (diff < 0) {
+            /* the item of the last lap is still there: full */
+            return 0;
+        } else {
+            /* another producer has got the slot: try the next one */
+            pos = ACCESS_ONCE(fifo->in);
+        }
+    }
+
+    slot->value = value;
+    smp_store_release(&slot->seq, pos + 1);
     return 1;
-} 
+}
 
-int ififo_get_at(struct ififo *fifo, int *value, int pos)
+int ififo_mpsc_get(struct ififo_mpsc *fifo, int *value)
 {
-    int tgt;
+    unsigned int out = fifo->out;
+    struct ififo_mpsc_slot *slot = &fifo->slots[out & fifo->mask];
 
-    if (pos >= ififo_len(fifo))
+    /* empty, or the producer hasn't filled the slot in yet */
+    if (smp_load_acquire(&slot->seq) != out + 1)
         return 0;
 
-    tgt = (fifo->out + pos) % fifo->size;
-
-    *value = fifo->buffer[tgt];
+    if (value)
+        *value = slot->value;
+    /* free for the producer one lap later */
+    smp_store_release(&slot->seq, out + fifo->mask + 1);
+    ACCESS_ONCE(fifo->out) = out + 1;
     return 1;
-} 
-
-void ififo_copy(struct ififo *fifo, int *buf, int idx, int count)
-{
-    unsigned int tgtb, tgte, len, flen;
-
-    if (ififo_is_empty(fifo))
-        return;
-
-    flen = ififo_len(fifo);
-    if (idx + count > flen)
-        count = flen - idx;
-
-    tgtb = (fifo->out + idx) % fifo->size;
-    tgte = (tgtb + count) % fifo->size;
-
-    if (tgtb < tgte) {
-        len = tgte - tgtb;
-        memcpy(buf, &fifo->buffer[tgtb], len);
-    } else {
-        len = fifo->size - tgtb;
-        printk("copying from %d: %d items\n", tgtb, len);
-        memcpy(buf, &fifo->buffer[tgtb], len * sizeof(int));
-        buf += len;
-        tgtb = 0;
-        len = tgte;
-        printk("copying from %d: %d items\n", tgtb, len);
-        memcpy(buf, &fifo->buffer[tgtb], len * sizeof(int));
-    }
 }
@@ -2,30 +2,80 @@
 #define IFIFO_H
 
 #include <linux/slab.h>
+#include <linux/cache.h>
 
-struct ififo {
-    unsigned int in;
-    unsigned int out;
-    unsigned int size;
+#include "tfifo.h"
+
+/* A FIFO of ints: ififo_alloc(), ififo_put(), ififo_get() etc. -- see tfifo.h */
+DEFINE_TFIFO(ififo, int)
+
+/*
+ * Lock-free variants, for a producer in IRQ context and a reader in process
+ * context (or any other mix) without a lock around the fifo. Both hold a
+ * power of 2 of items: size is rounded up.
+ *
+ * ififo_spsc: one producer and one consumer. Each side owns its index and
+ * publishes it with a release store, which the other side reads with an
+ * acquire load: the item is in place before in moves past it, and read
+ * before out gives its slot back.
+ */
+struct ififo_spsc {
+    unsigned int in ____cacheline_aligned_in_smp;
+    unsigned int out ____cacheline_aligned_in_smp;
+    unsigned int mask;
     int *buffer;
 };
 
-int ififo_alloc(struct ififo **fifo, unsigned int size, gfp_t gfp_mask);
+int ififo_spsc_alloc(struct ififo_spsc **fifo, unsigned int size, gfp_t gfp_mask);
+
+void ififo_spsc_free(struct ififo_spsc *fifo);
+
+/* exact on either side, a guess anywhere else */
+static inline int ififo_spsc_len(struct ififo_spsc *fifo)
+{
+    return ACCESS_ONCE(fifo->in) - ACCESS_ONCE(fifo->out);
+}
 
-void ififo_free(struct ififo *fifo);
+/* producer side only */
+int ififo_spsc_put(struct ififo_spsc *fifo, int value);
 
-int ififo_len(struct ififo *fifo);
+/* consumer side only */
+int ififo_spsc_get(struct ififo_spsc *fifo, int *value);
 
-int ififo_is_empty(struct ififo *fifo);
+/*
+ * ififo_mpsc: any number of producers, one consumer. A producer claims a
+ * position by moving in with cmpxchg(); each slot has a sequence number
+ * that says whose turn it is: pos - the slot is free for the producer at
+ * pos, pos + 1 - it holds that producer's item, pos + size - free again,
+ * for the producer one lap later. A producer interrupted between claiming
+ * and filling its slot holds up the consumer (the fifo looks empty from
+ * there on) but never the other producers.
+ */
+struct ififo_mpsc_slot {
+    unsigned int seq;
+    int value;
+};
+
+struct ififo_mpsc {
+    unsigned int in ____cacheline_aligned_in_smp;
+    unsigned int out ____cacheline_aligned_in_smp;
+    unsigned int mask;
+    struct ififo_mpsc_slot *slots;
+};
 
-int ififo_is_full(struct ififo *fifo);
+int ififo_mpsc_alloc(struct ififo_mpsc **fifo, unsigned int size, gfp_t gfp_mask);
 
-int ififo_put(struct ififo *fifo, int value);
+void ififo_mpsc_free(struct ififo_mpsc *fifo);
 
-int ififo_get(struct ififo *fifo, int *value);
+static inline int ififo_mpsc_len(struct ififo_mpsc *fifo)
+{
+    return ACCESS_ONCE(fifo->in) - ACCESS_ONCE(fifo->out);
+}
 
-int ififo_get_at(struct ififo *fifo, int *value, int pos);
+/* any context, any number of callers */
+int ififo_mpsc_put(struct ififo_mpsc *fifo, int value);
 
-void ififo_copy(struct ififo *fifo, int *buf, int idx, int count);
+/* consumer side only */
+int ififo_mpsc_get(struct ififo_mpsc *fifo, int *value);
 
 #endif /* IFIFO_H */
@@ -0,0 +1,95 @@
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/bitops.h>
+#include <linux/log2.h>
+
+#include "qtree.h"
+
+int qtree_alloc(struct qtree **qt, gfp_t gfp_mask)
+{
+    struct qtree *self;
+
+    if (!(self = kzalloc(sizeof(struct qtree), gfp_mask)))
+        return -ENOMEM;
+
+    *qt = self;
+    return 0;
+}
+
+void qtree_free(struct qtree *qt)
+{
+    kfree(qt);
+}
+
+/* a power of 2 [2^l, 2^(l+1)) is 2^QTREE_SUB_BITS buckets, by the bits after the top one */
+static unsigned int qtree_bucket(u64 value)
+{
+    unsigned int l;
+
+    if (value < (1 << QTREE_SUB_BITS))
+        return value;
+
+    l = fls64(value) - 1;
+    return ((l - QTREE_SUB_BITS + 1) << QTREE_SUB_BITS) +
+        ((value >> (l - QTREE_SUB_BITS)) & ((1 << QTREE_SUB_BITS) - 1));
+}
+
+/* the middle of the bucket */
+static u64 qtree_value(unsigned int b)
+{
+    unsigned int shift;
+
+    if (b < (1 << QTREE_SUB_BITS))
+        return b;
+
+    shift = (b >> QTREE_SUB_BITS) - 1;
+    return ((u64) ((1 << QTREE_SUB_BITS) | (b & ((1 << QTREE_SUB_BITS) - 1))) << shift) +
+        ((1ULL << shift) >> 1);
+}
+
+static void qtree_update(struct qtree *qt, unsigned int b, int delta)
+{
+    unsigned int i;
+
+    for (i = b + 1; i <= QTREE_BUCKETS; i += i & -i)
+        qt->tree[i] += delta;
+}
+
+void qtree_add(struct qtree *qt, u64 value)
+{
+    qtree_update(qt, qtree_bucket(value), 1);
+    qt->count++;
+}
+
+void qtree_remove(struct qtree *qt, u64 value)
+{
+    qtree_update(qt, qtree_bucket(value), -1);
+    qt->count--;
+}
+
+u64 qtree_kth(struct qtree *qt, unsigned int k)
+{
+    unsigned int pos = 0, step;
+
+    if (k >= qt->count)
+        return 0;
+
+    /* descend the tree: the largest pos whose prefix count is <= k */
+    for (step = 1 << ilog2(QTREE_BUCKETS); step; step >>= 1) {
+        if (pos + step <= QTREE_BUCKETS && qt->tree[pos + step] <= k) {
+            pos += step;
+            k -= qt->tree[pos];
+        }
+    }
+    /* pos buckets hold k or fewer: the sample is in bucket pos (0-based) */
+    return qtree_value(pos);
+}
+
+unsigned int qtree_rank(struct qtree *qt, u64 value)
+{
+    unsigned int i, rank = 0;
+
+    for (i = qtree_bucket(value); i > 0; i -= i & -i)
+        rank += qt->tree[i];
+    return rank;
+}
@@ -0,0 +1,48 @@
+#ifndef QTREE_H
+#define QTREE_H
+
+#include <linux/types.h>
+#include <linux/slab.h>
+
+/*
+ * Order statistics of a window of samples: a Fenwick tree of counts over
+ * quantized values. The values are u64, put in log-linear buckets:
+ * QTREE_SUB_BITS bits of mantissa per power of 2, so a value comes back
+ * off by less than 1 / 2^(QTREE_SUB_BITS + 1) -- under 1% -- and values
+ * below 2^QTREE_SUB_BITS exactly.
+ *
+ * qtree_add() puts in the newest sample and qtree_remove() takes out the
+ * oldest one (the caller keeps the samples, e.g. in an ififo, to know
+ * which). qtree_kth() and qtree_rank() answer in O(log buckets), whatever
+ * the number of samples. There is no locking: callers serialize.
+ */
+
+#define QTREE_SUB_BITS  6
+#define QTREE_BUCKETS   ((64 - QTREE_SUB_BITS + 1) << QTREE_SUB_BITS)
+
+struct qtree {
+    unsigned int count;
+    /* the Fenwick tree, 1-based: tree[i] counts buckets (i - lowbit(i), i] */
+    u32 tree[QTREE_BUCKETS + 1];
+};
+
+int qtree_alloc(struct qtree **qt, gfp_t gfp_mask);
+
+void qtree_free(struct qtree *qt);
+
+static inline unsigned int qtree_count(struct qtree *qt)
+{
+    return qt->count;
+}
+
+void qtree_add(struct qtree *qt, u64 value);
+
+void qtree_remove(struct qtree *qt, u64 value);
+
+/* the k-th smallest sample (from 0), quantized; 0 if there are not that many */
+u64 qtree_kth(struct qtree *qt, unsigned int k);
+
+/* how many samples are less than value (in a lower bucket) */
+unsigned int qtree_rank(struct qtree *qt, u64 value);
+
+#endif /* QTREE_H */
@@ -0,0 +1,42 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "tfifo.h"
+
+/*
+ * What the unit tests here share. CHECK() counts a check and reports it
+ * if it fails; REQUIRE() also returns from the test, when there is no
+ * point going on. Each test is a program of its own, so the counts are
+ * static; main() ends with return check_done().
+ */
+
+static int checks, failures;
+
+#define CHECK(cond) do { \
+        checks++; \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: %s: check failed: %s\n", \
+                    __FILE__, __LINE__, __func__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+#define REQUIRE(cond) do { \
+        CHECK(cond); \
+        if (!(cond)) \
+            return; \
+    } while (0)
+
+static inline int check_done(void)
+{
+    printf("%d checks, %d failed\n", checks, failures);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* samples kept in order, as blkstat keeps its response times */
+DEFINE_TFIFO(u64fifo, u64)
+
+#endif /* CHECK_H */
@@ -0,0 +1,354 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "macros.h"
+#include "tfifo.h"
+
+/*
+ * Benchmark of tfifo (so ififo too: it is the int one) for a few element
+ * types and sizes, against kfifo. For every combination:
+ *
+ *   window    is_full, get and put: dropping the oldest item when full
+ *   overwrite the same with put_overwrite (blkstat's rtimes)
+ *   bulk      put_n/get_n in batches of BATCH
+ *
+ * each the best of RUNS, and
+ *   snapshot  copying out the whole full fifo: latency per call, GB/s
+ *
+ * kfifo itself is kernel only, so kfifo_* below does what lib/kfifo.c
+ * does (3.x): byte copies of n * esize, scaled on every call, at most
+ * two memcpy()s, a barrier after each, and out of line. Single items go
+ * through kfifo_in(&fifo, &val, 1), as with an untyped kfifo.
+ */
+
+#define DEF_OPS     10000000
+#define BATCH       64
+#define RUNS        3
+#define SNAP_BYTES  (256UL << 20)
+#define SNAP_MAX    2000
+
+static unsigned long ops = DEF_OPS;
+static volatile unsigned long sink;
+
+void print_usage(char *progname)
+{
+    fprintf(stderr, "Usage %s [options]\n", progname);
+    fprintf(stderr, "   -n ops        items per measurement (default %d)\n", DEF_OPS);
+
+    exit(EXIT_FAILURE);
+}
+
+static unsigned long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int cmp_ul(const void *l, const void *r)
+{
+    unsigned long a = *(unsigned long *) l, b = *(unsigned long *) r;
+
+    return a < b ? -1 : a > b;
+}
+
+/* --- kfifo, the way lib/kfifo.c does it --- */
+
+struct kfifo {
+    unsigned int in;
+    unsigned int out;
+    unsigned int mask;
+    unsigned int esize;
+    void *data;
+};
+
+static struct kfifo *kfifo_alloc(unsigned int size, unsigned int esize)
+{
+    struct kfifo *fifo = kzalloc(sizeof(*fifo), GFP_KERNEL);
+
+    if (!fifo)
+        return NULL;
+    size = roundup_pow_of_two(size);
+    if (!(fifo->data = kzalloc((size_t) size * esize, GFP_KERNEL))) {
+        kfree(fifo);
+        return NULL;
+    }
+    fifo->mask = size - 1;
+    fifo->esize = esize;
+    return fifo;
+}
+
+static void kfifo_free(struct kfifo *fifo)
+{
+    kfree(fifo->data);
+    kfree(fifo);
+}
+
+static inline unsigned int kfifo_len(struct kfifo *fifo)
+{
+    return fifo->in - fifo->out;
+}
+
+static inline int kfifo_is_full(struct kfifo *fifo)
+{
+    return kfifo_len(fifo) > fifo->mask;
+}
+
+static inline void kfifo_skip(struct kfifo *fifo)
+{
+    fifo->out++;
+}
+
+static void kfifo_copy_in(struct kfifo *fifo, const void *src, unsigned int len, unsigned int off)
+{
+    unsigned int size = fifo->mask + 1;
+    unsigned int esize = fifo->esize;
+    unsigned int l;
+
+    off &= fifo->mask;
+    if (esize != 1) {
+        off *= esize;
+        size *= esize;
+        len *= esize;
+    }
+    l = min(len, size - off);
+
+    memcpy((char *) fifo->data + off, src, l);
+    memcpy(fifo->data, (const char *) src + l, len - l);
+    smp_wmb();
+}
+
+static void kfifo_copy_out(struct kfifo *fifo, void *dst, unsigned int len, unsigned int off)
+{
+    unsigned int size = fifo->mask + 1;
+    unsigned int esize = fifo->esize;
+    unsigned int l;
+
+    off &= fifo->mask;
+    if (esize != 1) {
+        off *= esize;
+        size *= esize;
+        len *= esize;
+    }
+    l = min(len, size - off);
+
+    memcpy(dst, (char *) fifo->data + off, l);
+    memcpy((char *) dst + l, fifo->data, len - l);
+    smp_wmb();
+}
+
+static noinline unsigned int kfifo_in(struct kfifo *fifo, const void *buf, unsigned int len)
+{
+    unsigned int l = fifo->mask + 1 - kfifo_len(fifo);
+
+    if (len > l)
+        len = l;
+    kfifo_copy_in(fifo, buf, len, fifo->in);
+    fifo->in += len;
+    return len;
+}
+
+static noinline unsigned int kfifo_out_peek(struct kfifo *fifo, void *buf, unsigned int len)
+{
+    unsigned int l = kfifo_len(fifo);
+
+    if (len > l)
+        len = l;
+    kfifo_copy_out(fifo, buf, len, fifo->out);
+    return len;
+}
+
+static unsigned int kfifo_out(struct kfifo *fifo, void *buf, unsigned int len)
+{
+    len = kfifo_out_peek(fifo, buf, len);
+    fifo->out += len;
+    return len;
+}
+
+/* --- the benchmarks, per element type --- */
+
+static void report(const char *type, unsigned int size, const char *what,
+        unsigned long items, unsigned long ns, unsigned long kitems, unsigned long kns)
+{
+    printf("%-6s %8u  %-9s  tfifo %7.2f ns/item  kfifo %7.2f ns/item  (x%.2f)\n",
+            type, size, what, (double) ns / items, (double) kns / kitems,
+            ((double) kns / kitems) / ((double) ns / items));
+}
+
+#define DEFINE_BENCH(name, type)                                                \
+DEFINE_TFIFO(name##fifo, type)                                                  \
+                                                                                \
+static void name##_window(struct name##fifo *fifo, struct kfifo *kfifo)         \
+{                                                                               \
+    unsigned long i, start, ns = ~0UL, ons = ~0UL, kns = ~0UL;                  \
+    type val;                                                                   \
+    int r;                                                                      \
+                                                                                \
+    memset(&val, 0, sizeof(val));                                               \
+    for (r = 0; r < RUNS; r++) {                                                \
+        start = now_ns();                                                       \
+        for (i = 0; i < ops; i++) {                                             \
+            *(unsigned long *) &val = i;                                        \
+            if (name##fifo_is_full(fifo))                                       \
+                name##fifo_get(fifo, NULL);                                     \
+            name##fifo_put(fifo, val);                                          \
+        }                                                                       \
+        ns = min(ns, now_ns() - start);                                         \
+                                                                                \
+        start = now_ns();                                                       \
+        for (i = 0; i < ops; i++) {                                             \
+            *(unsigned long *) &val = i;                                        \
+            name##fifo_put_overwrite(fifo, val, NULL);                          \
+        }                                                                       \
+        ons = min(ons, now_ns() - start);                                       \
+                                                                                \
+        start = now_ns();                                                       \
+        for (i = 0; i < ops; i++) {                                             \
+            *(unsigned long *) &val = i;                                        \
+            if (kfifo_is_full(kfifo))                                           \
+                kfifo_skip(kfifo);                                              \
+            kfifo_in(kfifo, &val, 1);                                           \
+        }                                                                       \
+        kns = min(kns, now_ns() - start);                                       \
+    }                                                                           \
+                                                                                \
+    report(#name, fifo->size, "window", ops, ns, ops, kns);                     \
+    report(#name, fifo->size, "overwrite", ops, ons, ops, kns);                 \
+}                                                                               \
+                                                                                \
+static void name##_bulk(struct name##fifo *fifo, struct kfifo *kfifo)           \
+{                                                                               \
+    static type buf[BATCH];                                                     \
+    unsigned long done, kdone, start, ns = ~0UL, kns = ~0UL;                    \
+    unsigned int n;                                                             \
+    int r;                                                                      \
+                                                                                \
+    name##fifo_get_n(fifo, NULL, fifo->size);                                   \
+    kfifo->out = kfifo->in;                                                     \
+                                                                                \
+    /* the same number of items every run: whole fills and drains */           \
+    for (r = 0; r < RUNS; r++) {                                                \
+        start = now_ns();                                                       \
+        for (done = 0; done < ops; ) {                                          \
+            while ((n = name##fifo_put_n(fifo, buf, BATCH)))                    \
+                done += n;                                                      \
+            while ((n = name##fifo_get_n(fifo, buf, BATCH)))                    \
+                done += n;                                                      \
+        }                                                                       \
+        ns = min(ns, now_ns() - start);                                         \
+                                                                                \
+        start = now_ns();                                                       \
+        for (kdone = 0; kdone < ops; ) {                                        \
+            while ((n = kfifo_in(kfifo, buf, BATCH)))                           \
+                kdone += n;                                                     \
+            while ((n = kfifo_out(kfifo, buf, BATCH)))                          \
+                kdone += n;                                                     \
+        }                                                                       \
+        kns = min(kns, now_ns() - start);                                       \
+    }                                                                           \
+                                                                                \
+    report(#name, fifo->size, "bulk", done, ns, kdone, kns);                    \
+}                                                                               \
+                                                                                \
+static void name##_snapshot(struct name##fifo *fifo, struct kfifo *kfifo)       \
+{                                                                               \
+    unsigned long bytes = (unsigned long) fifo->size * sizeof(type);            \
+    unsigned long reps = min(max(SNAP_BYTES / bytes, 5UL), (unsigned long) SNAP_MAX); \
+    unsigned long *lat, *klat, sum = 0, ksum = 0, start, i;                     \
+    type *buf;                                                                  \
+                                                                                \
+    lat = calloc(reps, sizeof(*lat));                                           \
+    klat = calloc(reps, sizeof(*klat));                                         \
+    buf = malloc(bytes);                                                        \
+    if (!lat || !klat || !buf)                                                  \
+        serr_exit("can't allocate %lu bytes", bytes);                           \
+                                                                                \
+    /* both full */                                                             \
+    name##fifo_put_n(fifo, buf, fifo->size);                                    \
+    kfifo->in = kfifo->out + fifo->size;                                        \
+                                                                                \
+    for (i = 0; i < reps; i++) {                                                \
+        start = now_ns();                                                       \
+        sink += name##fifo_snapshot(fifo, buf, fifo->size);                     \
+        sum += lat[i] = now_ns() - start;                                       \
+                                                                                \
+        start = now_ns();                                                       \
+        sink += kfifo_out_peek(kfifo, buf, fifo->size);                         \
+        ksum += klat[i] = now_ns() - start;                                     \
+    }                                                                           \
+    qsort(lat, reps, sizeof(*lat), cmp_ul);                                     \
+    qsort(klat, reps, sizeof(*klat), cmp_ul);                                   \
+                                                                                \
+    printf("%-6s %8u  %-9s  tfifo p50 %9.2f us p99 %9.2f us %6.2f GB/s  "       \
+            "kfifo p50 %9.2f us p99 %9.2f us %6.2f GB/s\n",                     \
+            #name, fifo->size, "snapshot",                                      \
+            lat[reps / 2] / 1e3, lat[reps * 99 / 100] / 1e3, (double) bytes * reps / sum, \
+            klat[reps / 2] / 1e3, klat[reps * 99 / 100] / 1e3, (double) bytes * reps / ksum); \
+                                                                                \
+    free(buf);                                                                  \
+    free(klat);                                                                 \
+    free(lat);                                                                  \
+}                                                                               \
+                                                                                \
+static void name##_bench(unsigned int size)                                     \
+{                                                                               \
+    struct name##fifo *fifo;                                                    \
+    struct kfifo *kfifo;                                                        \
+                                                                                \
+    if (name##fifo_alloc(&fifo, size, GFP_KERNEL) ||                            \
+            !(kfifo = kfifo_alloc(size, sizeof(type))))                         \
+        serr_exit("can't allocate fifos of %u", size);                          \
+                                                                                \
+    name##_window(fifo, kfifo);                                                 \
+    name##_bulk(fifo, kfifo);                                                   \
+    name##_snapshot(fifo, kfifo);                                               \
+                                                                                \
+    kfifo_free(kfifo);                                                          \
+    name##fifo_free(fifo);                                                      \
+}
+
+/* a completion record, as it might be kept instead of a bare time */
+struct rec {
+    u64 time;
+    u64 sector;
+    u32 sectors;
+    u32 op;
+    u64 pad;
+};
+
+/* the window stores the index in the first word: no type is smaller than that */
+typedef unsigned long word;
+
+DEFINE_BENCH(word, word)
+DEFINE_BENCH(u64, u64)
+DEFINE_BENCH(rec, struct rec)
+
+int main(int argc, char *argv[])
+{
+    /* powers of 2, so that kfifo (which rounds up) holds as many */
+    unsigned int sizes[] = {64, 1024, 65536, 1048576};
+    unsigned int i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+            case 'n':
+                ops = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                print_usage(argv[0]);
+        }
+    }
+    if (!ops)
+        print_usage(argv[0]);
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        word_bench(sizes[i]);
+        u64_bench(sizes[i]);
+        rec_bench(sizes[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "ififo.h"
+#include "check.h"
+
+/*
+ * Unit tests of ififo/tfifo and the lock-free fifos, built in userspace
+ * with kshim.h. Exits with a failure status if any check fails.
+ */
+
+struct rec {
+    u64 time;
+    u32 sectors;
+    u32 op;
+};
+
+DEFINE_TFIFO(recfifo, struct rec)
+
+static struct ififo *new_fifo(unsigned int size)
+{
+    struct ififo *fifo;
+
+    if (ififo_alloc(&fifo, size, GFP_KERNEL)) {
+        fprintf(stderr, "can't allocate a fifo of %u\n", size);
+        exit(EXIT_FAILURE);
+    }
+    return fifo;
+}
+
+/* start the indices at base, as if base items had gone through */
+static void move_to(struct ififo *fifo, unsigned int base)
+{
+    fifo->in = fifo->out = base;
+}
+
+static void test_alloc(void)
+{
+    struct ififo *fifo;
+
+    CHECK(ififo_alloc(&fifo, 0, GFP_KERNEL) == -EINVAL);
+
+    fifo = new_fifo(1);
+    CHECK(fifo->size == 1 && fifo->mask == 0);
+    ififo_free(fifo);
+
+    fifo = new_fifo(5);
+    CHECK(fifo->size == 5 && fifo->mask == 7);
+    /* the buffer starts on a cache line */
+    CHECK(((unsigned long) fifo->buffer & (L1_CACHE_BYTES - 1)) == 0);
+    ififo_free(fifo);
+
+    fifo = new_fifo(1024);
+    CHECK(fifo->mask == 1023);
+    ififo_free(fifo);
+}
+
+static void test_empty_full(void)
+{
+    struct ififo *fifo = new_fifo(5);
+    int i, val = -1;
+
+    CHECK(ififo_is_empty(fifo) && !ififo_is_full(fifo) && ififo_len(fifo) == 0);
+    CHECK(!ififo_get(fifo, &val) && val == -1);
+
+    /* full at size, not at the number of slots */
+    for (i = 0; i < 5; i++)
+        CHECK(ififo_put(fifo, i));
+    CHECK(ififo_is_full(fifo) && ififo_len(fifo) == 5);
+    CHECK(!ififo_put(fifo, 99));
+    CHECK(ififo_len(fifo) == 5);
+
+    CHECK(ififo_get(fifo, &val) && val == 0);
+    CHECK(!ififo_is_full(fifo));
+    /* NULL drops the item */
+    CHECK(ififo_get(fifo, NULL));
+    for (i = 2; i < 5; i++)
+        CHECK(ififo_get(fifo, &val) && val == i);
+    CHECK(ififo_is_empty(fifo) && !ififo_get(fifo, &val));
+
+    ififo_free(fifo);
+}
+
+static void test_wraparound(void)
+{
+    struct ififo *fifo = new_fifo(6);
+    int i, val;
+
+    /* the indices wrap at UINT_MAX halfway through */
+    move_to(fifo, UINT_MAX - 2);
+    for (i = 0; i < 6; i++)
+        CHECK(ififo_put(fifo, i));
+    CHECK(fifo->in < fifo->out);
+    CHECK(ififo_len(fifo) == 6 && ififo_is_full(fifo));
+    for (i = 0; i < 6; i++)
+        CHECK(ififo_get_at(fifo, &val, i) && val == i);
+    for (i = 0; i < 6; i++)
+        CHECK(ififo_get(fifo, &val) && val == i);
+    CHECK(ififo_is_empty(fifo));
+
+    /* many laps around the buffer, as blkstat's window does */
+    move_to(fifo, 0);
+    for (i = 0; i < 1000; i++) {
+        if (ififo_is_full(fifo))
+            ififo_get(fifo, NULL);
+        ififo_put(fifo, i);
+    }
+    for (i = 0; i < 6; i++)
+        CHECK(ififo_get_at(fifo, &val, i) && val == 994 + i);
+
+    ififo_free(fifo);
+}
+
+static void test_get_at(void)
+{
+    struct ififo *fifo = new_fifo(4);
+    int val = -1;
+
+    CHECK(!ififo_get_at(fifo, &val, 0) && val == -1);
+    ififo_put(fifo, 10);
+    ififo_put(fifo, 11);
+    CHECK(!ififo_get_at(fifo, &val, -1));
+    CHECK(!ififo_get_at(fifo, &val, 2));
+    CHECK(ififo_get_at(fifo, &val, 1) && val == 11);
+    /* it's a peek */
+    CHECK(ififo_len(fifo) == 2);
+
+    ififo_free(fifo);
+}
+
+static void test_copy(void)
+{
+    struct ififo *fifo = new_fifo(8);
+    int buf[16], i;
+
+    /* the items run across the end of the buffer: slots 5, 6, 7, 0, 1, ... */
+    move_to(fifo, 5);
+    for (i = 0; i < 8; i++)
+        ififo_put(fifo, i);
+
+    memset(buf, 0xff, sizeof(buf));
+    ififo_copy(fifo, buf, 0, 8);
+    for (i = 0; i < 8; i++)
+        CHECK(buf[i] == i);
+    CHECK(buf[8] == -1);
+
+    /* only the part after the end */
+    memset(buf, 0xff, sizeof(buf));
+    ififo_copy(fifo, buf, 4, 2);
+    CHECK(buf[0] == 4 && buf[1] == 5 && buf[2] == -1);
+
+    /* up to the end of the buffer exactly */
+    memset(buf, 0xff, sizeof(buf));
+    ififo_copy(fifo, buf, 0, 3);
+    CHECK(buf[0] == 0 && buf[2] == 2 && buf[3] == -1);
+
+    /* count past the end of the items is cut short */
+    memset(buf, 0xff, sizeof(buf));
+    ififo_copy(fifo, buf, 6, 100);
+    CHECK(buf[0] == 6 && buf[1] == 7 && buf[2] == -1);
+
+    /* out of range: nothing is copied */
+    memset(buf, 0xff, sizeof(buf));
+    ififo_copy(fifo, buf, 8, 1);
+    ififo_copy(fifo, buf, -1, 1);
+    ififo_copy(fifo, buf, 0, 0);
+    CHECK(buf[0] == -1);
+
+    ififo_free(fifo);
+}
+
+static void test_bulk(void)
+{
+    struct ififo *fifo = new_fifo(8);
+    int in[12], out[12], i;
+
+    for (i = 0; i < 12; i++)
+        in[i] = 100 + i;
+
+    move_to(fifo, 6);
+    CHECK(ififo_put_n(fifo, in, 0) == 0);
+    /* only 8 fit; they wrap after 2 */
+    CHECK(ififo_put_n(fifo, in, 12) == 8);
+    CHECK(ififo_is_full(fifo) && ififo_put_n(fifo, in, 1) == 0);
+
+    CHECK(ififo_get_n(fifo, out, 3) == 3);
+    CHECK(out[0] == 100 && out[2] == 102);
+    CHECK(ififo_get_n(fifo, NULL, 1) == 1);
+    CHECK(ififo_get_n(fifo, out, 12) == 4);
+    CHECK(out[0] == 104 && out[3] == 107);
+    CHECK(ififo_is_empty(fifo) && ififo_get_n(fifo, out, 1) == 0);
+
+    ififo_free(fifo);
+}
+
+static void test_snapshot(void)
+{
+    struct ififo *fifo = new_fifo(8);
+    int buf[8], i;
+
+    CHECK(ififo_snapshot(fifo, buf, 8) == 0);
+
+    move_to(fifo, 3);
+    for (i = 0; i < 8; i++)
+        ififo_put(fifo, i);
+    CHECK(ififo_snapshot(fifo, buf, 8) == 8);
+    for (i = 0; i < 8; i++)
+        CHECK(buf[i] == i);
+
+    /* the newest ones */
+    CHECK(ififo_snapshot(fifo, buf, 3) == 3);
+    CHECK(buf[0] == 5 && buf[2] == 7);
+    CHECK(ififo_len(fifo) == 8);
+
+    ififo_free(fifo);
+}
+
+static void test_overwrite(void)
+{
+    struct ififo *fifo = new_fifo(6);
+    int buf[8], old = -1, i;
+
+    move_to(fifo, 5);
+    for (i = 0; i < 6; i++)
+        CHECK(!ififo_put_overwrite(fifo, i, &old));
+    CHECK(ififo_is_full(fifo) && old == -1 && ififo_dropped(fifo) == 0);
+
+    /* 8 slots, size 6: the slot freed is not the one reused */
+    CHECK(ififo_put_overwrite(fifo, 6, &old) && old == 0);
+    CHECK(ififo_put_overwrite(fifo, 7, NULL));
+    CHECK(ififo_put_overwrite(fifo, 8, &old) && old == 2);
+    CHECK(ififo_len(fifo) == 6 && ififo_dropped(fifo) == 3);
+
+    CHECK(ififo_snapshot(fifo, buf, 8) == 6);
+    for (i = 0; i < 6; i++)
+        CHECK(buf[i] == 3 + i);
+
+    /* laps around the buffer, one item in and one out each time */
+    for (i = 9; i < 40; i++)
+        CHECK(ififo_put_overwrite(fifo, i, &old) && old == i - 6);
+    CHECK(ififo_get(fifo, &old) && old == 34);
+    CHECK(!ififo_put_overwrite(fifo, 40, &old));
+    CHECK(ififo_dropped(fifo) == 34);
+
+    ififo_free(fifo);
+
+    /* a power of 2: the item dropped and the new one share the slot */
+    fifo = new_fifo(4);
+    for (i = 0; i < 10; i++)
+        ififo_put_overwrite(fifo, i, &old);
+    CHECK(old == 5 && ififo_dropped(fifo) == 6);
+    CHECK(ififo_snapshot(fifo, buf, 4) == 4 && buf[0] == 6 && buf[3] == 9);
+    ififo_free(fifo);
+}
+
+static void test_typed(void)
+{
+    struct u64fifo *ufifo;
+    struct recfifo *rfifo;
+    struct rec r = { .time = 1ULL << 40, .sectors = 8, .op = 1 }, r2;
+    u64 val, buf[4];
+
+    REQUIRE(u64fifo_alloc(&ufifo, 3, GFP_KERNEL) == 0);
+    /* no truncation to int */
+    CHECK(u64fifo_put(ufifo, 5ULL << 33));
+    CHECK(u64fifo_put(ufifo, ~0ULL));
+    CHECK(u64fifo_get_at(ufifo, &val, 0) && val == 5ULL << 33);
+    CHECK(u64fifo_snapshot(ufifo, buf, 4) == 2 && buf[1] == ~0ULL);
+    u64fifo_free(ufifo);
+
+    REQUIRE(recfifo_alloc(&rfifo, 2, GFP_KERNEL) == 0);
+    CHECK(((unsigned long) rfifo->buffer & (L1_CACHE_BYTES - 1)) == 0);
+    CHECK(recfifo_put(rfifo, r));
+    REQUIRE(recfifo_get(rfifo, &r2));
+    CHECK(r2.time == r.time && r2.sectors == 8 && r2.op == 1);
+    recfifo_free(rfifo);
+}
+
+static void test_spsc_mpsc(void)
+{
+    struct ififo_spsc *spsc;
+    struct ififo_mpsc *mpsc;
+    int i, val;
+
+    /* these hold all the slots */
+    REQUIRE(ififo_spsc_alloc(&spsc, 3, GFP_KERNEL) == 0);
+    for (i = 0; i < 4; i++)
+        CHECK(ififo_spsc_put(spsc, i));
+    CHECK(!ififo_spsc_put(spsc, 4) && ififo_spsc_len(spsc) == 4);
+    for (i = 0; i < 4; i++)
+        CHECK(ififo_spsc_get(spsc, &val) && val == i);
+    CHECK(!ififo_spsc_get(spsc, &val));
+    ififo_spsc_free(spsc);
+
+    REQUIRE(ififo_mpsc_alloc(&mpsc, 4, GFP_KERNEL) == 0);
+    /* several laps, so that the slots' sequence numbers move on */
+    for (i = 0; i < 20; i++) {
+        CHECK(ififo_mpsc_put(mpsc, i));
+        CHECK(ififo_mpsc_put(mpsc, i + 100));
+        CHECK(ififo_mpsc_get(mpsc, &val) && val == i);
+        CHECK(ififo_mpsc_get(mpsc, &val) && val == i + 100);
+    }
+    for (i = 0; i < 4; i++)
+        CHECK(ififo_mpsc_put(mpsc, i));
+    CHECK(!ififo_mpsc_put(mpsc, 4));
+    CHECK(ififo_mpsc_get(mpsc, &val) && val == 0);
+    ififo_mpsc_free(mpsc);
+}
+
+#define NR_PRODUCERS    4
+#define NR_ITEMS        200000
+
+static struct ififo_mpsc *mpsc;
+
+static void *producer(void *arg)
+{
+    int id = (int) (long) arg, i;
+
+    for (i = 0; i < NR_ITEMS; i++)
+        while (!ififo_mpsc_put(mpsc, id << 24 | i))
+            sched_yield();
+    return NULL;
+}
+
+/* every producer's items arrive once and in order */
+static void test_mpsc_threads(void)
+{
+    pthread_t tids[NR_PRODUCERS];
+    int next[NR_PRODUCERS] = {0};
+    long got = 0, bad = 0;
+    int i, val, id;
+
+    REQUIRE(ififo_mpsc_alloc(&mpsc, 64, GFP_KERNEL) == 0);
+    for (i = 0; i < NR_PRODUCERS; i++)
+        pthread_create(&tids[i], NULL, producer, (void *) (long) i);
+
+    while (got < (long) NR_PRODUCERS * NR_ITEMS) {
+        if (!ififo_mpsc_get(mpsc, &val)) {
+            sched_yield();
+            continue;
+        }
+        got++;
+        id = val >> 24;
+        if (id < 0 || id >= NR_PRODUCERS || (val & 0xffffff) != next[id]++)
+            bad++;
+    }
+    for (i = 0; i < NR_PRODUCERS; i++)
+        pthread_join(tids[i], NULL);
+
+    CHECK(bad == 0);
+    CHECK(!ififo_mpsc_get(mpsc, &val));
+    ififo_mpsc_free(mpsc);
+}
+
+int main(void)
+{
+    test_alloc();
+    test_empty_full();
+    test_wraparound();
+    test_get_at();
+    test_copy();
+    test_bulk();
+    test_snapshot();
+    test_overwrite();
+    test_typed();
+    test_spsc_mpsc();
+    test_mpsc_threads();
+
+    return check_done();
+}
@@ -0,0 +1,75 @@
+#ifndef KSHIM_H
+#define KSHIM_H
+
+/*
+ * Just enough of the kernel API for ififo, tfifo.h, qtree and wagg to build
+ * in userspace. The linux/ and asm/ headers here all come down to this.
+ * The barriers are C11 fences: what smp_*() mean, not what they cost on
+ * a given CPU.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+
+typedef uint64_t u64;
+typedef uint32_t u32;
+typedef unsigned int gfp_t;
+
+#define GFP_KERNEL  0
+#define GFP_ATOMIC  0
+
+#define L1_CACHE_BYTES 64
+#define ____cacheline_aligned_in_smp __attribute__((aligned(L1_CACHE_BYTES)))
+
+#define ALIGN(x, a)     (((x) + (a) - 1) & ~((size_t) (a) - 1))
+#define min(a, b)       ((a) < (b) ? (a) : (b))
+#define max(a, b)       ((a) > (b) ? (a) : (b))
+#define min_t(t, a, b)  ((t) (a) < (t) (b) ? (t) (a) : (t) (b))
+#define max_t(t, a, b)  ((t) (a) > (t) (b) ? (t) (a) : (t) (b))
+
+#define noinline        __attribute__((noinline))
+#define __maybe_unused  __attribute__((unused))
+
+#define ACCESS_ONCE(x)  (*(volatile __typeof__(x) *) &(x))
+
+#define smp_wmb()       __atomic_thread_fence(__ATOMIC_RELEASE)
+#define smp_rmb()       __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define smp_mb()        __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define smp_load_acquire(p)         __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v)     __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define cmpxchg(p, o, n)            __sync_val_compare_and_swap(p, o, n)
+
+static inline unsigned int roundup_pow_of_two(unsigned int n)
+{
+    return n <= 1 ? 1 : 1U << (32 - __builtin_clz(n - 1));
+}
+
+static inline int fls64(u64 x)
+{
+    return x ? 64 - __builtin_clzll(x) : 0;
+}
+
+#define div_u64(a, b)   ((u64) (a) / (b))
+
+#define ilog2(n)        (63 - __builtin_clzll((u64) (n)))
+
+/* kmalloc() memory of a cache line or more is line aligned: so is this */
+static inline void *kzalloc(size_t size, gfp_t gfp_mask)
+{
+    void *p;
+
+    (void) gfp_mask;
+    if (posix_memalign(&p, L1_CACHE_BYTES, size))
+        return NULL;
+    return memset(p, 0, size);
+}
+
+static inline void kfree(const void *p)
+{
+    free((void *) p);
+}
+
+#endif /* KSHIM_H */
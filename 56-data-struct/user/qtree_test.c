@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "qtree.h"
+#include "check.h"
+
+/*
+ * Unit tests of qtree: where values fall in the log-linear buckets, what
+ * comes back of them, and that the counts add and take out in any order,
+ * down to an all-zero tree.
+ */
+
+/* within the quantization error of a bucket */
+static int close_to(u64 got, u64 exact)
+{
+    u64 diff = got > exact ? got - exact : exact - got;
+
+    return diff <= exact >> (QTREE_SUB_BITS + 1);
+}
+
+static int cmp_u64(const void *l, const void *r)
+{
+    u64 a = *(u64 *) l, b = *(u64 *) r;
+
+    return a < b ? -1 : a > b;
+}
+
+static int tree_is_zero(struct qtree *qt)
+{
+    unsigned int i;
+
+    for (i = 0; i <= QTREE_BUCKETS; i++)
+        if (qt->tree[i])
+            return 0;
+    return 1;
+}
+
+static void test_empty(void)
+{
+    struct qtree *qt;
+
+    REQUIRE(qtree_alloc(&qt, GFP_KERNEL) == 0);
+    CHECK(qtree_count(qt) == 0 && qtree_kth(qt, 0) == 0);
+    CHECK(qtree_rank(qt, 0) == 0 && qtree_rank(qt, ~0ULL) == 0);
+
+    qtree_add(qt, 7);
+    CHECK(qtree_kth(qt, 0) == 7);
+    /* past the count */
+    CHECK(qtree_kth(qt, 1) == 0);
+    qtree_remove(qt, 7);
+    CHECK(qtree_count(qt) == 0 && tree_is_zero(qt));
+
+    qtree_free(qt);
+}
+
+/* one sample at a time, at and around every power of 2 */
+static void test_buckets(void)
+{
+    struct qtree *qt;
+    u64 v, vals[4], step;
+    unsigned int l, i;
+
+    REQUIRE(qtree_alloc(&qt, GFP_KERNEL) == 0);
+
+    /* below 2^QTREE_SUB_BITS a value is a bucket of its own */
+    for (i = 0; i < (1 << QTREE_SUB_BITS); i++) {
+        qtree_add(qt, i);
+        CHECK(qtree_kth(qt, 0) == i);
+        qtree_remove(qt, i);
+    }
+
+    for (l = 1; l < 64; l++) {
+        v = 1ULL << l;
+        vals[0] = v - 1;
+        vals[1] = v;
+        vals[2] = v + 1;
+        vals[3] = v + (v >> 1);
+        for (i = 0; i < 4; i++) {
+            qtree_add(qt, vals[i]);
+            CHECK(close_to(qtree_kth(qt, 0), vals[i]));
+            qtree_remove(qt, vals[i]);
+        }
+
+        /* 2^l - 1 and 2^l are never in the same bucket */
+        qtree_add(qt, v - 1);
+        CHECK(qtree_rank(qt, v) == 1);
+        qtree_remove(qt, v - 1);
+
+        /* a bucket above the exact ones is 2^(l - QTREE_SUB_BITS) wide */
+        if (l > QTREE_SUB_BITS) {
+            step = 1ULL << (l - QTREE_SUB_BITS);
+            qtree_add(qt, v);
+            CHECK(qtree_rank(qt, v + step - 1) == 0);
+            CHECK(qtree_rank(qt, v + step) == 1);
+            qtree_remove(qt, v);
+        }
+    }
+
+    CHECK(qtree_count(qt) == 0 && tree_is_zero(qt));
+    qtree_free(qt);
+}
+
+static void test_duplicates(void)
+{
+    struct qtree *qt;
+    int i;
+
+    REQUIRE(qtree_alloc(&qt, GFP_KERNEL) == 0);
+
+    for (i = 0; i < 1000; i++)
+        qtree_add(qt, 12345);
+    CHECK(qtree_kth(qt, 0) == qtree_kth(qt, 999));
+    CHECK(close_to(qtree_kth(qt, 500), 12345));
+    CHECK(qtree_rank(qt, 12345) == 0 && qtree_rank(qt, ~0ULL) == 1000);
+
+    /* one below them all moves every rank by one */
+    qtree_add(qt, 1);
+    CHECK(qtree_kth(qt, 0) == 1);
+    CHECK(close_to(qtree_kth(qt, 1), 12345));
+    CHECK(qtree_rank(qt, 12345) == 1);
+
+    qtree_free(qt);
+}
+
+#define NR_VALUES 20000
+
+/*
+ * Unlike wagg, qtree doesn't care which sample leaves: take out half of
+ * them in random order and check what is left against a sort.
+ */
+static void test_any_order(void)
+{
+    static u64 vals[NR_VALUES];
+    struct qtree *qt;
+    unsigned int i, j, k, n;
+    u64 tmp;
+
+    REQUIRE(qtree_alloc(&qt, GFP_KERNEL) == 0);
+
+    srandom(1);
+    for (i = 0; i < NR_VALUES; i++) {
+        /* spread over many powers of 2 */
+        vals[i] = (u64) random() * random() >> (random() % 48);
+        qtree_add(qt, vals[i]);
+    }
+    for (i = NR_VALUES - 1; i > 0; i--) {
+        j = random() % (i + 1);
+        tmp = vals[i];
+        vals[i] = vals[j];
+        vals[j] = tmp;
+    }
+
+    n = NR_VALUES / 2;
+    for (i = n; i < NR_VALUES; i++)
+        qtree_remove(qt, vals[i]);
+    REQUIRE(qtree_count(qt) == n);
+
+    qsort(vals, n, sizeof(u64), cmp_u64);
+    for (k = 0; k < n; k += 97) {
+        CHECK(close_to(qtree_kth(qt, k), vals[k]));
+        /* those in lower buckets only */
+        CHECK(qtree_rank(qt, vals[k]) <= k);
+    }
+    CHECK(close_to(qtree_kth(qt, n - 1), vals[n - 1]));
+    for (k = 1; k < n; k++)
+        if (qtree_kth(qt, k) < qtree_kth(qt, k - 1))
+            break;
+    CHECK(k == n);
+
+    for (i = 0; i < n; i++)
+        qtree_remove(qt, vals[i]);
+    CHECK(qtree_count(qt) == 0 && tree_is_zero(qt));
+
+    qtree_free(qt);
+}
+
+int main(void)
+{
+    test_empty();
+    test_buckets();
+    test_duplicates();
+    test_any_order();
+
+    return check_done();
+}
@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#include "wagg.h"
+#include "check.h"
+
+/*
+ * Unit tests of wagg: the min and max deques as samples beat each other
+ * and leave, sample numbers wrapping around, and long runs with the
+ * samples kept in a u64fifo, as wagg's callers keep them, checked
+ * against a pass over the window.
+ */
+
+/* put val in the window of wa, the oldest sample making way if it is full */
+static void slide(struct wagg *wa, struct u64fifo *fifo, u64 val)
+{
+    u64 old = 0;
+
+    if (u64fifo_is_full(fifo)) {
+        u64fifo_get(fifo, &old);
+        wagg_remove(wa, old);
+    }
+    u64fifo_put(fifo, val);
+    wagg_add(wa, val);
+}
+
+/* all of the aggregates, against the samples in the fifo */
+static int agrees(struct wagg *wa, struct u64fifo *fifo)
+{
+    static u64 samples[4096];
+    u64 sum = 0, min = ~0ULL, max = 0;
+    unsigned int i, n;
+
+    n = u64fifo_snapshot(fifo, samples, 4096);
+    for (i = 0; i < n; i++) {
+        sum += samples[i];
+        min = samples[i] < min ? samples[i] : min;
+        max = samples[i] > max ? samples[i] : max;
+    }
+    return n && wagg_count(wa) == n && wagg_sum(wa) == sum && wagg_mean(wa) == sum / n &&
+        wagg_min(wa) == min && wagg_max(wa) == max;
+}
+
+static unsigned int deque_len(struct wagg_deque *dq)
+{
+    return dq->tail - dq->head;
+}
+
+static void test_alloc(void)
+{
+    struct wagg *wa;
+
+    CHECK(wagg_alloc(&wa, 0, GFP_KERNEL) == -EINVAL);
+    REQUIRE(wagg_alloc(&wa, 3, GFP_KERNEL) == 0);
+    CHECK(wa->mask == 3);
+    CHECK(wagg_count(wa) == 0 && wagg_min(wa) == 0 && wagg_max(wa) == 0 && wagg_mean(wa) == 0);
+
+    /* removing from an empty window does nothing */
+    wagg_remove(wa, 4);
+    CHECK(wagg_count(wa) == 0 && wagg_sum(wa) == 0);
+
+    wagg_free(wa);
+}
+
+/* the extremes as the samples that hold them leave */
+static void test_leaving(void)
+{
+    struct wagg *wa;
+
+    REQUIRE(wagg_alloc(&wa, 3, GFP_KERNEL) == 0);
+
+    wagg_add(wa, 5);
+    wagg_add(wa, 1);
+    wagg_add(wa, 9);
+    CHECK(wagg_count(wa) == 3 && wagg_sum(wa) == 15 && wagg_mean(wa) == 5);
+    CHECK(wagg_min(wa) == 1 && wagg_max(wa) == 9);
+
+    /* 5 leaves: nothing changes but the sum */
+    wagg_remove(wa, 5);
+    wagg_add(wa, 3);
+    CHECK(wagg_min(wa) == 1 && wagg_max(wa) == 9 && wagg_sum(wa) == 13);
+
+    /* 1 leaves: the min is the next smallest */
+    wagg_remove(wa, 1);
+    wagg_add(wa, 4);
+    CHECK(wagg_min(wa) == 3 && wagg_max(wa) == 9);
+
+    /* 9 leaves */
+    wagg_remove(wa, 9);
+    wagg_add(wa, 4);
+    CHECK(wagg_min(wa) == 3 && wagg_max(wa) == 4);
+
+    /* equal values: one leaving doesn't take the other along */
+    wagg_remove(wa, 3);
+    wagg_add(wa, 4);
+    wagg_remove(wa, 4);
+    CHECK(wagg_min(wa) == 4 && wagg_max(wa) == 4 && wagg_count(wa) == 2);
+
+    wagg_free(wa);
+}
+
+/*
+ * A rising run keeps the whole window in the min deque and only the
+ * newest sample in the max one; a falling run the other way round. The
+ * window is not a power of 2, so the deques run round their slots.
+ */
+static void test_monotonic(void)
+{
+    struct u64fifo *fifo;
+    struct wagg *wa;
+    unsigned int i, bad = 0;
+
+    REQUIRE(wagg_alloc(&wa, 5, GFP_KERNEL) == 0);
+    REQUIRE(u64fifo_alloc(&fifo, 5, GFP_KERNEL) == 0);
+
+    for (i = 0; i < 100; i++) {
+        slide(wa, fifo, i);
+        if (!agrees(wa, fifo) || deque_len(&wa->min) != wagg_count(wa) ||
+                deque_len(&wa->max) != 1)
+            bad++;
+    }
+    CHECK(bad == 0);
+    CHECK(wagg_min(wa) == 95 && wagg_max(wa) == 99);
+
+    for (i = 100; i > 0; i--) {
+        slide(wa, fifo, i);
+        /* once the rising samples have left, it's the max deque that holds them all */
+        if (!agrees(wa, fifo) || (i <= 95 && (deque_len(&wa->max) != wagg_count(wa) ||
+                    deque_len(&wa->min) != 1)))
+            bad++;
+    }
+    CHECK(bad == 0);
+    CHECK(wagg_min(wa) == 1 && wagg_max(wa) == 5);
+
+    u64fifo_free(fifo);
+    wagg_free(wa);
+}
+
+/* the sample numbers are unsigned and wrap; who has left is by their difference */
+static void test_seq_wrap(void)
+{
+    struct u64fifo *fifo;
+    struct wagg *wa;
+    unsigned int i, bad = 0;
+
+    REQUIRE(wagg_alloc(&wa, 7, GFP_KERNEL) == 0);
+    REQUIRE(u64fifo_alloc(&fifo, 7, GFP_KERNEL) == 0);
+
+    wa->first = wa->next = UINT_MAX - 20;
+    srandom(1);
+    for (i = 0; i < 100; i++) {
+        slide(wa, fifo, random() % 50);
+        if (!agrees(wa, fifo))
+            bad++;
+    }
+    /* past the wrap, with windows across it on the way */
+    CHECK(wa->first < 100 && wagg_count(wa) == 7);
+    CHECK(bad == 0);
+
+    u64fifo_free(fifo);
+    wagg_free(wa);
+}
+
+#define WINDOW  1000
+#define SAMPLES 50000
+
+static void test_drift(void)
+{
+    struct u64fifo *fifo;
+    struct wagg *wa;
+    unsigned int i, bad = 0;
+    u64 val;
+
+    REQUIRE(wagg_alloc(&wa, WINDOW, GFP_KERNEL) == 0);
+    REQUIRE(u64fifo_alloc(&fifo, WINDOW, GFP_KERNEL) == 0);
+
+    srandom(1);
+    for (i = 0; i < SAMPLES; i++) {
+        /* slow drifts, with runs going up and down */
+        val = 1000000 + (i / 3000 % 2 ? i % 3000 : 3000 - i % 3000) * 100 + random() % 5000;
+        slide(wa, fifo, val);
+        if (i % 97 == 0 && !agrees(wa, fifo))
+            bad++;
+    }
+    CHECK(bad == 0);
+
+    u64fifo_free(fifo);
+    wagg_free(wa);
+}
+
+int main(void)
+{
+    test_alloc();
+    test_leaving();
+    test_monotonic();
+    test_seq_wrap();
+    test_drift();
+
+    return check_done();
+}
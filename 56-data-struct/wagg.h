@@ -0,0 +1,77 @@
+#ifndef WAGG_H
+#define WAGG_H
+
+#include <linux/types.h>
+#include <linux/slab.h>
+
+/*
+ * Aggregates of a sliding window of samples: count, sum (so the mean),
+ * min and max, each read in O(1). The samples themselves are kept by the
+ * caller, e.g. in an ififo; wagg_add() is told of the newest one, and
+ * wagg_remove() that the oldest has left. Samples must leave in the order
+ * they came, as from a FIFO.
+ *
+ * min and max are monotonic deques of the samples that may still become
+ * the extreme of the window: adding a sample drops from the back those it
+ * beats, as they leave before it; the front is the extreme and goes when
+ * its sample leaves the window. Each sample goes in and out once, so
+ * wagg_add() is O(1) amortized. No locking: callers serialize.
+ */
+
+struct wagg_entry {
+    u64 value;
+    /* the sample's number, to know when it leaves */
+    unsigned int seq;
+};
+
+struct wagg_deque {
+    unsigned int head;      /* the extreme */
+    unsigned int tail;      /* one past the newest */
+    struct wagg_entry *entries;
+};
+
+struct wagg {
+    unsigned int size;
+    unsigned int mask;
+    /* the numbers of the oldest sample in the window and of the next one */
+    unsigned int first;
+    unsigned int next;
+    u64 sum;
+    struct wagg_deque min;
+    struct wagg_deque max;
+};
+
+/* for windows of up to size samples: remove the oldest before adding to a full one */
+int wagg_alloc(struct wagg **wa, unsigned int size, gfp_t gfp_mask);
+
+void wagg_free(struct wagg *wa);
+
+void wagg_add(struct wagg *wa, u64 value);
+
+/* the oldest sample has left the window */
+void wagg_remove(struct wagg *wa, u64 value);
+
+static inline unsigned int wagg_count(struct wagg *wa)
+{
+    return wa->next - wa->first;
+}
+
+static inline u64 wagg_sum(struct wagg *wa)
+{
+    return wa->sum;
+}
+
+/* these are 0 for an empty window */
+static inline u64 wagg_min(struct wagg *wa)
+{
+    return wagg_count(wa) ? wa->min.entries[wa->min.head & wa->mask].value : 0;
+}
+
+static inline u64 wagg_max(struct wagg *wa)
+{
+    return wagg_count(wa) ? wa->max.entries[wa->max.head & wa->mask].value : 0;
+}
+
+u64 wagg_mean(struct wagg *wa);
+
+#endif /* WAGG_H */
@@ -0,0 +1,42 @@
+#ifndef IFIFO_MMAP_H
+#define IFIFO_MMAP_H
+
+#include <linux/types.h>
+
+/*
+ * Layout of the ring that 56-data-struct/fifommap maps to userspace: one
+ * header page, then the slots, starting at data_offset. The module fills
+ * the slots and moves in; the reader takes them and moves out, both with
+ * release stores that the other side reads with acquire loads (as in
+ * ififo_spsc). in and out are free-running: in - out samples are there,
+ * at slots (index & mask).
+ */
+
+#define IFIFO_MMAP_MAGIC    0x69666d70      /* "ifmp" */
+#define IFIFO_MMAP_DEV      "/dev/fifommap"
+
+/* keeps the producer's and the consumer's index off each other's line */
+#define IFIFO_MMAP_LINE     64
+
+struct ififo_mmap_sample {
+    __u64 seq;              /* counts every sample, those dropped too */
+    __u64 ns;               /* CLOCK_MONOTONIC time it was taken */
+};
+
+struct ififo_mmap_header {
+    /* set up at load time, read-only */
+    __u32 magic;
+    __u32 mask;             /* slots - 1 */
+    __u32 sample_size;
+    __u32 data_offset;      /* from the start of the mapping */
+
+    /* the producer's */
+    __u32 in __attribute__((aligned(IFIFO_MMAP_LINE)));
+    __u32 pad;
+    __u64 dropped;          /* samples not put for want of room */
+
+    /* the consumer's */
+    __u32 out __attribute__((aligned(IFIFO_MMAP_LINE)));
+};
+
+#endif /* IFIFO_MMAP_H */
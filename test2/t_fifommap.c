@@ -0,0 +1,139 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/mman.h>
+
+#include "macros.h"
+#include "ififo_mmap.h"
+
+/*
+ * Reader of the ring of 56-data-struct/fifommap: maps it and takes the
+ * samples straight from the mapping. The only system call in the loop is
+ * poll(), when the ring is empty. Once a second, prints how many samples
+ * came, how many the module dropped, the seq gaps seen (they should add
+ * up to the drops), the polls made and the worst delay from the sample
+ * being taken to it being read.
+ */
+
+#define DEF_SECS 10
+
+void print_usage(char *progname)
+{
+    fprintf(stderr, "Usage %s [options] [device]\n", progname);
+    fprintf(stderr, "   -s secs       run time (default %d)\n", DEF_SECS);
+    fprintf(stderr, "   device        default %s\n", IFIFO_MMAP_DEV);
+
+    exit(EXIT_FAILURE);
+}
+
+static unsigned long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, fd, secs = DEF_SECS;
+    char *dev = IFIFO_MMAP_DEV;
+    long pagesize = sysconf(_SC_PAGESIZE);
+    struct ififo_mmap_header *hdr;
+    struct ififo_mmap_sample *slots, *s;
+    struct pollfd pfd;
+    unsigned int in, out, mask;
+    unsigned long long next_seq = 0, dropped = 0;
+    unsigned long samples = 0, gaps = 0, polls = 0, delay, max_delay = 0;
+    unsigned long now, start, tick;
+    size_t len;
+    int first = 1;
+
+    while ((opt = getopt(argc, argv, "s:")) != -1) {
+        switch (opt) {
+            case 's':
+                secs = atoi(optarg);
+                break;
+            default:
+                print_usage(argv[0]);
+        }
+    }
+    if (secs <= 0)
+        print_usage(argv[0]);
+    if (optind < argc)
+        dev = argv[optind];
+
+    if ((fd = open(dev, O_RDWR)) < 0)
+        serr_exit("can't open %s", dev);
+
+    /* the header says how big the rest is */
+    hdr = mmap(NULL, pagesize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (hdr == MAP_FAILED)
+        serr_exit("can't map the header of %s", dev);
+    if (hdr->magic != IFIFO_MMAP_MAGIC || hdr->sample_size != sizeof(*slots))
+        err_exit("%s: not a fifommap ring (magic %#x)", dev, hdr->magic);
+    mask = hdr->mask;
+    len = hdr->data_offset + (size_t) (mask + 1) * sizeof(*slots);
+    munmap(hdr, pagesize);
+
+    hdr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (hdr == MAP_FAILED)
+        serr_exit("can't map %zu bytes of %s", len, dev);
+    slots = (struct ififo_mmap_sample *) ((char *) hdr + hdr->data_offset);
+
+    printf("%s: %u slots\n", dev, mask + 1);
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    out = hdr->out;
+    dropped = hdr->dropped;
+    start = tick = now_ns();
+
+    for (;;) {
+        in = __atomic_load_n(&hdr->in, __ATOMIC_ACQUIRE);
+        if (in == out) {
+            polls++;
+            if (poll(&pfd, 1, 1000) < 0 && errno != EINTR)
+                serr_exit("poll failed");
+        }
+
+        now = now_ns();
+        for (; out != in; out++) {
+            s = &slots[out & mask];
+            if (!first && s->seq != next_seq)
+                gaps += s->seq - next_seq;
+            first = 0;
+            next_seq = s->seq + 1;
+
+            delay = now > s->ns ? now - s->ns : 0;
+            if (delay > max_delay)
+                max_delay = delay;
+            samples++;
+        }
+        /* the slots are the module's again */
+        __atomic_store_n(&hdr->out, out, __ATOMIC_RELEASE);
+
+        if (now - tick >= 1000000000UL) {
+            unsigned long long d = __atomic_load_n(&hdr->dropped, __ATOMIC_RELAXED);
+
+            printf("samples: %lu -- dropped: %llu -- gaps: %lu -- polls: %lu -- "
+                    "max delay (us): %.1f\n", samples, d - dropped, gaps, polls,
+                    max_delay / 1e3);
+            fflush(stdout);
+            dropped = d;
+            samples = gaps = polls = max_delay = 0;
+            tick = now;
+        }
+        if (now - start >= secs * 1000000000UL)
+            break;
+    }
+
+    munmap(hdr, len);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,310 @@
+#define _GNU_SOURCE     /* O_DIRECT */
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>       /* BLKGETSIZE64 */
+#include <linux/aio_abi.h>
+
+#include "macros.h"
+
+/*
+ * Load generator for the stacked block devices: N threads, each keeping
+ * QD O_DIRECT I/Os in flight with Linux native AIO, at random aligned
+ * offsets, for a number of seconds. Reports IOPS, throughput and the
+ * latency percentiles of all threads together.
+ *
+ * With blkstat target=null or stackbd null_io=1 there is no device below,
+ * so the numbers are those of the stacking layer itself.
+ */
+
+#define DEF_THREADS 1
+#define DEF_QD 32
+#define DEF_BS 4096
+#define DEF_SECS 10
+
+/* latency histogram: 4 buckets per power of 2 of nanoseconds */
+#define NR_BUCKETS 256
+
+struct worker {
+    pthread_t tid;
+    int fd;
+    unsigned int seed;
+    unsigned long ios;
+    unsigned long sum_ns;
+    unsigned long min_ns, max_ns;
+    unsigned long hist[NR_BUCKETS];
+};
+
+static size_t bs = DEF_BS;
+static int qd = DEF_QD, write_pct = 0, secs = DEF_SECS;
+static unsigned long long nblocks;
+static volatile int stop;
+
+void print_usage(char *progname)
+{
+    fprintf(stderr, "Usage %s [options] device\n", progname);
+    fprintf(stderr, "   -t threads    number of threads (default %d)\n", DEF_THREADS);
+    fprintf(stderr, "   -q qd         I/Os in flight per thread (default %d)\n", DEF_QD);
+    fprintf(stderr, "   -b bs         block size in bytes (default %d)\n", DEF_BS);
+    fprintf(stderr, "   -w pct        percentage of writes (default 0)\n");
+    fprintf(stderr, "   -s secs       run time (default %d)\n", DEF_SECS);
+
+    exit(EXIT_FAILURE);
+}
+
+static unsigned long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int io_setup(unsigned nr, aio_context_t *ctx)
+{
+    return syscall(__NR_io_setup, nr, ctx);
+}
+
+static int io_destroy(aio_context_t ctx)
+{
+    return syscall(__NR_io_destroy, ctx);
+}
+
+static int io_submit(aio_context_t ctx, long nr, struct iocb **iocbs)
+{
+    return syscall(__NR_io_submit, ctx, nr, iocbs);
+}
+
+static int io_getevents(aio_context_t ctx, long min_nr, long nr, struct io_event *events)
+{
+    return syscall(__NR_io_getevents, ctx, min_nr, nr, events, NULL);
+}
+
+static unsigned int bucket(unsigned long ns)
+{
+    unsigned int l;
+
+    if (ns < 4)
+        return ns;
+
+    l = 63 - __builtin_clzl(ns);
+    return (l << 2) + ((ns >> (l - 2)) & 3);
+}
+
+/* the upper bound of a bucket */
+static unsigned long bucket_ns(unsigned int b)
+{
+    unsigned int l = b >> 2;
+
+    if (l < 2)
+        return b + 1;
+
+    return (4UL + (b & 3) + 1) << (l - 2);
+}
+
+/* set up iocb for the next I/O and note when it went out */
+static void prep(struct worker *w, struct iocb *cb, char *buf, unsigned long *start)
+{
+    memset(cb, 0, sizeof(*cb));
+    cb->aio_fildes = w->fd;
+    cb->aio_lio_opcode = (int) (rand_r(&w->seed) % 100) < write_pct ?
+        IOCB_CMD_PWRITE : IOCB_CMD_PREAD;
+    cb->aio_buf = (unsigned long) buf;
+    cb->aio_nbytes = bs;
+    cb->aio_offset = (long long) (((unsigned long long) rand_r(&w->seed) << 31 |
+                rand_r(&w->seed)) % nblocks) * bs;
+    cb->aio_data = (unsigned long) start;
+    *start = now_ns();
+}
+
+static void *worker_fn(void *arg)
+{
+    struct worker *w = arg;
+    aio_context_t ctx = 0;
+    struct io_event *events;
+    struct iocb *cbs, **ptrs;
+    unsigned long *starts, ns, now;
+    char *bufs;
+    int i, n;
+
+    cbs = calloc(qd, sizeof(*cbs));
+    ptrs = calloc(qd, sizeof(*ptrs));
+    starts = calloc(qd, sizeof(*starts));
+    events = calloc(qd, sizeof(*events));
+    if (!cbs || !ptrs || !starts || !events ||
+            posix_memalign((void **) &bufs, getpagesize(), bs * qd))
+        serr_exit("can't allocate %d I/Os", qd);
+    memset(bufs, 0x5a, bs * qd);
+
+    if (io_setup(qd, &ctx) < 0)
+        serr_exit("io_setup(%d) failed", qd);
+
+    for (i = 0; i < qd; i++) {
+        prep(w, &cbs[i], bufs + i * bs, &starts[i]);
+        ptrs[i] = &cbs[i];
+    }
+    if (io_submit(ctx, qd, ptrs) != qd)
+        serr_exit("io_submit failed");
+
+    /* every completion is replaced by a new I/O until the time is up */
+    for (n = qd; n > 0; ) {
+        if ((i = io_getevents(ctx, 1, qd, events)) < 0) {
+            if (errno == EINTR)
+                continue;
+            serr_exit("io_getevents failed");
+        }
+        now = now_ns();
+
+        while (i--) {
+            struct iocb *cb = (struct iocb *) (unsigned long) events[i].obj;
+            unsigned long *start = (unsigned long *) (unsigned long) events[i].data;
+
+            if (events[i].res != (long long) bs)
+                err_exit("I/O failed at offset %llu", (unsigned long long) cb->aio_offset);
+
+            ns = now - *start;
+            w->ios++;
+            w->sum_ns += ns;
+            if (ns < w->min_ns)
+                w->min_ns = ns;
+            if (ns > w->max_ns)
+                w->max_ns = ns;
+            w->hist[bucket(ns)]++;
+
+            if (stop) {
+                n--;
+                continue;
+            }
+            prep(w, cb, (char *) (unsigned long) cb->aio_buf, start);
+            if (io_submit(ctx, 1, &cb) != 1)
+                serr_exit("io_submit failed");
+        }
+    }
+
+    io_destroy(ctx);
+    free(bufs);
+    free(events);
+    free(starts);
+    free(ptrs);
+    free(cbs);
+    return NULL;
+}
+
+/* the latency at rank (of total), from the merged histogram */
+static unsigned long percentile(unsigned long *hist, unsigned long total, double pct)
+{
+    unsigned long rank = total * pct / 100, sum = 0;
+    unsigned int b;
+
+    for (b = 0; b < NR_BUCKETS - 1; b++) {
+        sum += hist[b];
+        if (sum > rank)
+            break;
+    }
+    return bucket_ns(b);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, fd, i, nthreads = DEF_THREADS;
+    unsigned long long devsize;
+    struct stat st;
+    unsigned long hist[NR_BUCKETS] = {0};
+    unsigned long ios = 0, sum = 0, min = ~0UL, max = 0, start, elapsed;
+    struct worker *workers;
+    unsigned int b;
+
+    while ((opt = getopt(argc, argv, "t:q:b:w:s:")) != -1) {
+        switch (opt) {
+            case 't':
+                nthreads = atoi(optarg);
+                break;
+            case 'q':
+                qd = atoi(optarg);
+                break;
+            case 'b':
+                bs = atoi(optarg);
+                break;
+            case 'w':
+                write_pct = atoi(optarg);
+                break;
+            case 's':
+                secs = atoi(optarg);
+                break;
+            default:
+                print_usage(argv[0]);
+        }
+    }
+
+    if (optind >= argc || nthreads <= 0 || qd <= 0 || bs == 0 || bs % 512 ||
+            write_pct < 0 || write_pct > 100 || secs <= 0)
+        print_usage(argv[0]);
+
+    if ((fd = open(argv[optind], (write_pct ? O_RDWR : O_RDONLY) | O_DIRECT)) < 0)
+        serr_exit("can't open device %s", argv[optind]);
+    /* a regular file will do too, for trying the tool out */
+    if (fstat(fd, &st) < 0)
+        serr_exit("can't stat %s", argv[optind]);
+    if (S_ISREG(st.st_mode))
+        devsize = st.st_size;
+    else if (ioctl(fd, BLKGETSIZE64, &devsize) < 0)
+        serr_exit("BLKGETSIZE64 failed");
+    if (devsize < bs)
+        err_exit("device is smaller than the block size (%llu bytes)", devsize);
+    nblocks = devsize / bs;
+
+    if (!(workers = calloc(nthreads, sizeof(*workers))))
+        serr_exit("can't allocate %d threads", nthreads);
+
+    printf("%s: %d thread(s) x QD %d, %zu byte I/Os, %d%% writes, %d s\n",
+            argv[optind], nthreads, qd, bs, write_pct, secs);
+
+    start = now_ns();
+    for (i = 0; i < nthreads; i++) {
+        workers[i].fd = fd;
+        workers[i].seed = i + 1;
+        workers[i].min_ns = ~0UL;
+        if ((errno = pthread_create(&workers[i].tid, NULL, worker_fn, &workers[i])))
+            serr_exit("can't start thread %d", i);
+    }
+
+    sleep(secs);
+    stop = 1;
+
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].tid, NULL);
+        ios += workers[i].ios;
+        sum += workers[i].sum_ns;
+        if (workers[i].min_ns < min)
+            min = workers[i].min_ns;
+        if (workers[i].max_ns > max)
+            max = workers[i].max_ns;
+        for (b = 0; b < NR_BUCKETS; b++)
+            hist[b] += workers[i].hist[b];
+    }
+    elapsed = now_ns() - start;
+
+    if (!ios)
+        err_exit("no I/O done in %d s", secs);
+
+    printf("IOPS: %.0f -- MB/s: %.1f\n", ios * 1e9 / elapsed,
+            ios * bs * 1e9 / elapsed / 1048576);
+    printf("lat (us) min: %.1f mean: %.1f p50: %.1f p90: %.1f p99: %.1f "
+            "p99.9: %.1f p99.99: %.1f max: %.1f\n",
+            min / 1e3, (double) sum / ios / 1e3,
+            percentile(hist, ios, 50) / 1e3, percentile(hist, ios, 90) / 1e3,
+            percentile(hist, ios, 99) / 1e3, percentile(hist, ios, 99.9) / 1e3,
+            percentile(hist, ios, 99.99) / 1e3, max / 1e3);
+
+    free(workers);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,98 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+
+#include "macros.h"
+
+/*
+ * Moves a linear stackbd device over to another target while it stays
+ * in use (the STACKBD_MIGRATE ioctl), then follows the copy in
+ * /proc/stackbd until it is done or has failed.
+ */
+
+#define STACKBD_MIGRATE 1001
+#define DEF_DEVICE "/dev/stackbd0"
+#define PROC_FILE "/proc/stackbd"
+
+void print_usage(char *progname)
+{
+    fprintf(stderr, "Usage %s [options] new-target\n", progname);
+    fprintf(stderr, "   -d device     stacked device (default %s)\n", DEF_DEVICE);
+    fprintf(stderr, "   -i secs       progress report interval (default 1)\n");
+    fprintf(stderr, "   -n            don't wait for the copy to finish\n");
+
+    exit(EXIT_FAILURE);
+}
+
+/* the Migration: line of /proc/stackbd, or 0 if there is none */
+static int read_progress(char *line, size_t size)
+{
+    FILE *f = fopen(PROC_FILE, "r");
+    int found = 0;
+
+    if (!f)
+        serr_exit("can't open %s", PROC_FILE);
+    while (fgets(line, size, f))
+        if (!strncmp(line, "Migration:", 10)) {
+            found = 1;
+            break;
+        }
+    fclose(f);
+    return found;
+}
+
+int main(int argc, char *argv[])
+{
+    char *device = DEF_DEVICE;
+    char path[80], line[256];
+    int opt, fd, interval = 1, wait = 1;
+
+    while ((opt = getopt(argc, argv, "d:i:n")) != -1) {
+        switch (opt) {
+            case 'd':
+                device = optarg;
+                break;
+            case 'i':
+                interval = atoi(optarg);
+                break;
+            case 'n':
+                wait = 0;
+                break;
+            default:
+                print_usage(argv[0]);
+        }
+    }
+
+    if (optind >= argc || interval <= 0 || strlen(argv[optind]) >= sizeof(path))
+        print_usage(argv[0]);
+
+    /* the driver copies a fixed-size buffer */
+    memset(path, 0, sizeof(path));
+    strcpy(path, argv[optind]);
+
+    if ((fd = open(device, O_RDONLY)) < 0)
+        serr_exit("can't open device %s", device);
+    if (ioctl(fd, STACKBD_MIGRATE, path) < 0)
+        serr_exit("can't migrate %s to %s", device, path);
+    close(fd);
+
+    printf("%s: migrating to %s\n", device, path);
+    if (!wait)
+        return 0;
+
+    for (;;) {
+        sleep(interval);
+        if (!read_progress(line, sizeof(line)))
+            err_exit("no migration in %s", PROC_FILE);
+        fputs(line, stdout);
+        fflush(stdout);
+        if (strstr(line, "done"))
+            return 0;
+        if (strstr(line, "failed"))
+            return EXIT_FAILURE;
+    }
+}
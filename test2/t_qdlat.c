@@ -0,0 +1,172 @@
+#define _GNU_SOURCE     /* O_DIRECT */
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>   /* BLKGETSIZE64 */
+
+#include "macros.h"
+
+/*
+ * QD1 latency benchmark for the stacked block devices: issues one
+ * O_DIRECT I/O at a time at random aligned offsets and reports the
+ * latency distribution. With -m, the run is repeated for each of the
+ * listed stackbd inline_mode values, so the submission policies can
+ * be compared side by side.
+ */
+
+#define DEF_COUNT 10000
+#define DEF_BS 4096
+#define INLINE_PARAM "/sys/module/stackbdkt/parameters/inline_mode"
+
+static char *mode_names[] = {"worker", "adaptive", "inline"};
+
+void print_usage(char *progname)
+{
+    fprintf(stderr, "Usage %s [options] device\n", progname);
+    fprintf(stderr, "   -n count      number of I/Os per run (default %d)\n", DEF_COUNT);
+    fprintf(stderr, "   -b bs         block size in bytes (default %d)\n", DEF_BS);
+    fprintf(stderr, "   -w            issue writes instead of reads\n");
+    fprintf(stderr, "   -m modes      comma-separated inline_mode values to compare, e.g. 0,1,2\n");
+    fprintf(stderr, "   -p path       inline_mode parameter file (default %s)\n", INLINE_PARAM);
+
+    exit(EXIT_FAILURE);
+}
+
+static int cmp_ulong(const void *l, const void *r)
+{
+    unsigned long a = *(const unsigned long *) l;
+    unsigned long b = *(const unsigned long *) r;
+
+    return a < b ? -1 : a > b;
+}
+
+static unsigned long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void set_mode(char *param, int mode)
+{
+    FILE *f = fopen(param, "w");
+
+    if (!f)
+        serr_exit("can't open %s", param);
+    fprintf(f, "%d\n", mode);
+    if (fclose(f))
+        serr_exit("can't set inline_mode to %d", mode);
+}
+
+static void run(int fd, char *label, int count, size_t bs, unsigned long long devsize,
+        int do_write, char *buf, unsigned long *lat)
+{
+    unsigned long long nblocks = devsize / bs;
+    unsigned long start, total, sum = 0;
+    off_t off;
+    ssize_t rc;
+    int i;
+
+    total = now_ns();
+    for (i = 0; i < count; i++) {
+        off = (off_t) (random() % nblocks) * bs;
+
+        start = now_ns();
+        if (do_write)
+            rc = pwrite(fd, buf, bs, off);
+        else
+            rc = pread(fd, buf, bs, off);
+        lat[i] = now_ns() - start;
+
+        if (rc != (ssize_t) bs)
+            serr_exit("I/O failed at offset %llu", (unsigned long long) off);
+        sum += lat[i];
+    }
+    total = now_ns() - total;
+
+    qsort(lat, count, sizeof(*lat), cmp_ulong);
+
+    printf("%-10s IOPS: %8.0f -- lat (us) min: %7.1f mean: %7.1f p50: %7.1f "
+            "p99: %7.1f p99.9: %7.1f max: %7.1f\n",
+            label, count * 1e9 / total,
+            lat[0] / 1e3, (double) sum / count / 1e3,
+            lat[count / 2] / 1e3, lat[count * 99 / 100] / 1e3,
+            lat[count * 999 / 1000] / 1e3, lat[count - 1] / 1e3);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, fd, count = DEF_COUNT, do_write = 0;
+    size_t bs = DEF_BS;
+    char *modes = NULL, *param = INLINE_PARAM, *tok;
+    unsigned long long devsize;
+    unsigned long *lat;
+    char *buf;
+    int mode;
+
+    while ((opt = getopt(argc, argv, "n:b:wm:p:")) != -1) {
+        switch (opt) {
+            case 'n':
+                count = atoi(optarg);
+                break;
+            case 'b':
+                bs = atoi(optarg);
+                break;
+            case 'w':
+                do_write = 1;
+                break;
+            case 'm':
+                modes = optarg;
+                break;
+            case 'p':
+                param = optarg;
+                break;
+            default:
+                print_usage(argv[0]);
+        }
+    }
+
+    if (optind >= argc || count <= 0 || bs == 0 || bs % 512)
+        print_usage(argv[0]);
+
+    if ((fd = open(argv[optind], (do_write ? O_RDWR : O_RDONLY) | O_DIRECT)) < 0)
+        serr_exit("can't open device %s", argv[optind]);
+
+    if (ioctl(fd, BLKGETSIZE64, &devsize) < 0)
+        serr_exit("BLKGETSIZE64 failed");
+    if (devsize < bs)
+        err_exit("device is smaller than the block size (%llu bytes)", devsize);
+
+    if (posix_memalign((void **) &buf, getpagesize(), bs))
+        err_exit("can't allocate %zu byte buffer", bs);
+    memset(buf, 0x5a, bs);
+
+    if (!(lat = malloc(count * sizeof(*lat))))
+        serr_exit("can't allocate latency buffer");
+
+    printf("%s: %d %s I/Os of %zu bytes at QD1\n", argv[optind], count,
+            do_write ? "write" : "read", bs);
+
+    if (!modes) {
+        run(fd, "current", count, bs, devsize, do_write, buf, lat);
+    } else {
+        for (tok = strtok(modes, ","); tok; tok = strtok(NULL, ",")) {
+            mode = atoi(tok);
+            if (mode < 0 || mode > 2)
+                err_exit("bad inline_mode %d", mode);
+            set_mode(param, mode);
+            run(fd, mode_names[mode], count, bs, devsize, do_write, buf, lat);
+        }
+    }
+
+    free(lat);
+    free(buf);
+    close(fd);
+    return 0;
+}